@@ -0,0 +1,421 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryArena.h"
+#include "DiscoveryHash.h"
+
+/** A string stored in the store's string table, which unlike the snapshot's may grow past 4 GB.*/
+struct DiscoveryStoreString
+{
+	uint64_t offset;
+	uint64_t size;
+};
+
+/**
+* A scan whose contributions the store holds: its path, its results the way the scan cache keeps them, i.e. lines of versionID, buildID and path,
+* and the hashes of the keys of its aggregate sources, sorted, at sourceKeyOffset in the source key section,
+* with the fields of its own copy of each source at the same offset in the source field section.
+*/
+struct DiscoveryStoreScan
+{
+	DiscoveryStoreString scanPath;
+	DiscoveryStoreString results;
+	uint64_t sourceKeyOffset;
+	uint64_t sourceKeyCount;
+};
+
+/** See DiscoverySource, scanIndex is the scan the source is kept from and scanCount the number of scans with the source.*/
+struct DiscoveryStoreSource
+{
+	int32_t sourceTypeID;
+	uint32_t scanIndex;
+	uint32_t scanCount;
+	uint32_t reserved;
+	DiscoveryStoreString sourceKeyOriginal;
+	DiscoveryStoreString sourceKeyUpperCase;
+	DiscoveryStoreString sourceProductVersion;
+	DiscoveryStoreString sourceCompanyName;
+	DiscoveryStoreString sourceProductName;
+	DiscoveryStoreString sourceFileDescription;
+	DiscoveryStoreString sourceFileVersion;
+	/** The text, see DiscoverySource::sourceFileSizeText.*/
+	DiscoveryStoreString sourceFileSize;
+	DiscoveryStoreString sourceFilePath;
+};
+
+/** See DiscoveryScanSourceFields.*/
+struct DiscoveryStoreSourceFields
+{
+	DiscoveryStoreString sourceKeyOriginal;
+	DiscoveryStoreString sourceFilePath;
+};
+
+/** See DiscoveryAggregateResult, scanIndex is the scan of its scanPath.*/
+struct DiscoveryStoreResult
+{
+	int32_t versionID;
+	int32_t buildID;
+	int32_t count;
+	uint32_t scanIndex;
+	DiscoveryStoreString detectionPath;
+};
+
+/**
+* The store file starts with this header, followed by the scan, source key, source field, source and result records and then the string table,
+* each section at the offset recorded here. Results are in the order of DiscoveryAggregateResultKey.
+*/
+struct DiscoveryAggregateStoreHeader
+{
+	char magic[8];
+	uint32_t formatVersion;
+	uint32_t reserved;
+	/** Of the library the latest scans were matched with.*/
+	DiscoveryHash128 libraryVersion;
+	uint64_t scanOffset;
+	uint64_t scanCount;
+	uint64_t sourceKeyOffset;
+	uint64_t sourceKeyCount;
+	uint64_t sourceFieldOffset;
+	uint64_t sourceFieldCount;
+	uint64_t sourceOffset;
+	uint64_t sourceCount;
+	uint64_t resultOffset;
+	uint64_t resultCount;
+	uint64_t stringOffset;
+	uint64_t stringSize;
+};
+
+/**
+* The <code>DiscoveryAggregateStore</code> class is the aggregate sources and results of every scan processed so far,
+* with what each scan contributed to them, in a single binary file which is memory mapped to load them, instead of parsing the aggregate files.
+* Records are fixed size and are read in place, strings handed out by stringAt point into the mapped file and stay valid until close.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateStore
+{
+	/** To be incremented whenever any of the record layouts changes.*/
+	static const uint32_t formatVersion = 3;
+
+	boost::iostreams::mapped_file_source file;
+	const DiscoveryAggregateStoreHeader* header;
+
+	DiscoveryAggregateStore() : header(nullptr) {}
+
+	static const char* magic()
+	{
+		return "DESTORE\0";
+	}
+
+	/** Maps the store, returns false when it is damaged or of another format version.*/
+	bool open(const string& path)
+	{
+		close();
+
+		boost::system::error_code error;
+		if (filesystem::file_size(path, error) < sizeof(DiscoveryAggregateStoreHeader) || error)
+			return false;
+		try
+		{
+			file.open(path);
+		}
+		catch (const ios_base::failure&)
+		{
+			return false;
+		}
+
+		header = reinterpret_cast<const DiscoveryAggregateStoreHeader*>(file.data());
+		if (memcmp(header->magic, magic(), sizeof(header->magic)) != 0 || header->formatVersion != formatVersion
+			|| !isSectionValid(header->scanOffset, header->scanCount, sizeof(DiscoveryStoreScan))
+			|| !isSectionValid(header->sourceKeyOffset, header->sourceKeyCount, sizeof(DiscoveryHash128))
+			|| !isSectionValid(header->sourceFieldOffset, header->sourceFieldCount, sizeof(DiscoveryStoreSourceFields)) || header->sourceFieldCount != header->sourceKeyCount
+			|| !isSectionValid(header->sourceOffset, header->sourceCount, sizeof(DiscoveryStoreSource))
+			|| !isSectionValid(header->resultOffset, header->resultCount, sizeof(DiscoveryStoreResult))
+			|| !isSectionValid(header->stringOffset, header->stringSize, 1))
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (file.is_open())
+			file.close();
+		header = nullptr;
+	}
+
+	const DiscoveryStoreScan* scans() const
+	{
+		return reinterpret_cast<const DiscoveryStoreScan*>(file.data() + header->scanOffset);
+	}
+
+	const DiscoveryHash128* sourceKeys() const
+	{
+		return reinterpret_cast<const DiscoveryHash128*>(file.data() + header->sourceKeyOffset);
+	}
+
+	const DiscoveryStoreSourceFields* sourceFields() const
+	{
+		return reinterpret_cast<const DiscoveryStoreSourceFields*>(file.data() + header->sourceFieldOffset);
+	}
+
+	const DiscoveryStoreSource* sources() const
+	{
+		return reinterpret_cast<const DiscoveryStoreSource*>(file.data() + header->sourceOffset);
+	}
+
+	const DiscoveryStoreResult* results() const
+	{
+		return reinterpret_cast<const DiscoveryStoreResult*>(file.data() + header->resultOffset);
+	}
+
+	/** False when the string lies outside the string table, i.e. the store is damaged.*/
+	bool isStringValid(const DiscoveryStoreString& value) const
+	{
+		return value.offset <= header->stringSize && value.size <= header->stringSize - value.offset;
+	}
+
+	/** False when the scan's source keys and fields or results lie outside their sections.*/
+	bool isScanValid(const DiscoveryStoreScan& scan) const
+	{
+		if (scan.sourceKeyOffset > header->sourceKeyCount || scan.sourceKeyCount > header->sourceKeyCount - scan.sourceKeyOffset
+			|| !isStringValid(scan.scanPath) || !isStringValid(scan.results))
+			return false;
+		// the source field section is as long as the source key section
+		const DiscoveryStoreSourceFields* fields = sourceFields() + scan.sourceKeyOffset;
+		for (uint64_t i = 0; i < scan.sourceKeyCount; i++)
+			if (!isStringValid(fields[i].sourceKeyOriginal) || !isStringValid(fields[i].sourceFilePath))
+				return false;
+		return true;
+	}
+
+	boost::string_ref stringAt(const DiscoveryStoreString& value) const
+	{
+		return boost::string_ref(file.data() + header->stringOffset + value.offset, static_cast<size_t>(value.size));
+	}
+
+private:
+	bool isSectionValid(uint64_t offset, uint64_t count, size_t recordSize) const
+	{
+		return offset % 8 == 0 && offset <= file.size() && count <= (file.size() - offset) / recordSize;
+	}
+};
+
+/**
+* The <code>DiscoveryAggregateStoreWriter</code> class collects the records of a store and writes the store file.
+* Each distinct string is stored once in the string table, which pays off for the company names and versions repeated by many sources.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateStoreWriter
+{
+	vector<DiscoveryStoreScan> scans;
+	vector<DiscoveryHash128> sourceKeys;
+	vector<DiscoveryStoreSourceFields> sourceFields;
+	vector<DiscoveryStoreSource> sources;
+	vector<DiscoveryStoreResult> results;
+
+	string strings;
+	unordered_map<boost::string_ref, uint64_t, DiscoveryStringRefHash> stringOffsets;
+
+	/** The keys of stringOffsets, strings would invalidate them whenever it grows.*/
+	DiscoveryArena arena;
+
+	DiscoveryStoreString addString(boost::string_ref value)
+	{
+		DiscoveryStoreString stored = { 0, value.size() };
+		if (value.empty())
+			return stored;
+
+		auto it = stringOffsets.find(value);
+		if (it != stringOffsets.end())
+		{
+			stored.offset = it->second;
+			return stored;
+		}
+		stored.offset = strings.size();
+		strings.append(value.data(), value.size());
+		stringOffsets.insert(make_pair(arena.store(value), stored.offset));
+		return stored;
+	}
+
+	/** Strings unlikely to repeat, e.g. the results of a scan, are not worth looking up.*/
+	DiscoveryStoreString addUniqueString(boost::string_ref value)
+	{
+		DiscoveryStoreString stored = { strings.size(), value.size() };
+		strings.append(value.data(), value.size());
+		return stored;
+	}
+
+	/** Writes to a temporary file first and renames it, so that a stopped run leaves the previous store behind rather than a partial one.*/
+	bool write(const string& path, const DiscoveryHash128& libraryVersion)
+	{
+		DiscoveryAggregateStoreHeader header = DiscoveryAggregateStoreHeader();
+		memcpy(header.magic, DiscoveryAggregateStore::magic(), sizeof(header.magic));
+		header.formatVersion = DiscoveryAggregateStore::formatVersion;
+		header.libraryVersion = libraryVersion;
+
+		uint64_t offset = alignedOffset(sizeof(header));
+		header.scanOffset = offset;
+		header.scanCount = scans.size();
+		offset = alignedOffset(offset + scans.size() * sizeof(DiscoveryStoreScan));
+		header.sourceKeyOffset = offset;
+		header.sourceKeyCount = sourceKeys.size();
+		offset = alignedOffset(offset + sourceKeys.size() * sizeof(DiscoveryHash128));
+		header.sourceFieldOffset = offset;
+		header.sourceFieldCount = sourceFields.size();
+		offset = alignedOffset(offset + sourceFields.size() * sizeof(DiscoveryStoreSourceFields));
+		header.sourceOffset = offset;
+		header.sourceCount = sources.size();
+		offset = alignedOffset(offset + sources.size() * sizeof(DiscoveryStoreSource));
+		header.resultOffset = offset;
+		header.resultCount = results.size();
+		offset = alignedOffset(offset + results.size() * sizeof(DiscoveryStoreResult));
+		header.stringOffset = offset;
+		header.stringSize = strings.size();
+
+		boost::system::error_code error;
+		filesystem::create_directories(filesystem::path(path).parent_path(), error);
+		string temporaryPath = filesystem::unique_path(path + ".%%%%-%%%%-%%%%.tmp").string();
+		ofstream ofs(temporaryPath, fstream::out | fstream::trunc | fstream::binary);
+		if (!ofs)
+			return false;
+		writeSection(ofs, &header, sizeof(header), header.scanOffset);
+		writeSection(ofs, scans.data(), scans.size() * sizeof(DiscoveryStoreScan), header.sourceKeyOffset);
+		writeSection(ofs, sourceKeys.data(), sourceKeys.size() * sizeof(DiscoveryHash128), header.sourceFieldOffset);
+		writeSection(ofs, sourceFields.data(), sourceFields.size() * sizeof(DiscoveryStoreSourceFields), header.sourceOffset);
+		writeSection(ofs, sources.data(), sources.size() * sizeof(DiscoveryStoreSource), header.resultOffset);
+		writeSection(ofs, results.data(), results.size() * sizeof(DiscoveryStoreResult), header.stringOffset);
+		ofs.write(strings.data(), strings.size());
+		ofs.close();
+		if (!ofs)
+		{
+			filesystem::remove(temporaryPath, error);
+			return false;
+		}
+
+		filesystem::rename(temporaryPath, path, error);
+		return !error;
+	}
+
+private:
+	static uint64_t alignedOffset(uint64_t offset)
+	{
+		return (offset + 7) & ~static_cast<uint64_t>(7);
+	}
+
+	/** Writes the section and pads it up to the offset of the next one.*/
+	static void writeSection(ofstream& ofs, const void* data, size_t size, uint64_t nextOffset)
+	{
+		ofs.write(static_cast<const char*>(data), size);
+		while (static_cast<uint64_t>(ofs.tellp()) < nextOffset)
+			ofs.put('\0');
+	}
+};
+
+/**
+* The fields of a scan's own copy of an aggregate source which are not part of its key, i.e. which may differ from one scan with the source to another,
+* so that the source can take them from whichever scan it comes to be kept from.
+*/
+struct DiscoveryScanSourceFields
+{
+	string sourceKeyOriginal;
+	string sourceFilePath;
+};
+
+/**
+* What a single scan adds to the aggregates: its results, lines of versionID, buildID and path, and the key hashes of its sources, sorted and unique,
+* with the fields of each source at the same position in sourceFields, those of the first line of the scan with the source.
+*/
+struct DiscoveryScanContribution
+{
+	string results;
+	vector<DiscoveryHash128> sourceKeys;
+	vector<DiscoveryScanSourceFields> sourceFields;
+};
+
+/**
+* The <code>DiscoveryAggregateProvenance</code> class keeps what each scan has contributed to the aggregates,
+* so that a scan processed again can have its previous contribution taken back instead of being counted twice,
+* and how many scans have each aggregate source, so that a source is dropped once no scan has it anymore.
+* The processing tasks hand in their contributions through ingest, they are applied once no task is running.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateProvenance
+{
+	/** Only while open do the processing tasks collect their contributions.*/
+	bool isOpen;
+
+	/** The latest contribution of each scan, by scan ID.*/
+	unordered_map<int, DiscoveryScanContribution> scans;
+	unordered_map<DiscoveryHash128, uint32_t, DiscoveryHash128Hash> sourceScanCounts;
+
+	/** Handed in since they were last applied, in the order the tasks finished, thread safe.*/
+	vector<pair<int, DiscoveryScanContribution>> ingested;
+	mutex mutexIngested;
+
+	DiscoveryAggregateProvenance() : isOpen(false) {}
+
+	void ingest(int scanID, DiscoveryScanContribution& contribution)
+	{
+		// stable, so that the first line of the scan with a source is the one kept, as it is in the aggregate
+		vector<size_t> order(contribution.sourceKeys.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		stable_sort(order.begin(), order.end(), [&contribution](size_t a, size_t b) { return contribution.sourceKeys[a] < contribution.sourceKeys[b]; });
+
+		DiscoveryScanContribution sorted;
+		sorted.results.swap(contribution.results);
+		sorted.sourceKeys.reserve(order.size());
+		sorted.sourceFields.reserve(order.size());
+		for (auto it = order.begin(); it != order.end(); it++)
+			if (sorted.sourceKeys.empty() || sorted.sourceKeys.back() != contribution.sourceKeys[*it])
+			{
+				sorted.sourceKeys.push_back(contribution.sourceKeys[*it]);
+				sorted.sourceFields.push_back(DiscoveryScanSourceFields());
+				sorted.sourceFields.back().sourceKeyOriginal.swap(contribution.sourceFields[*it].sourceKeyOriginal);
+				sorted.sourceFields.back().sourceFilePath.swap(contribution.sourceFields[*it].sourceFilePath);
+			}
+		contribution.sourceKeys.clear();
+		contribution.sourceFields.clear();
+
+		mutex::scoped_lock lock(mutexIngested);
+		ingested.emplace_back(scanID, DiscoveryScanContribution());
+		ingested.back().second.results.swap(sorted.results);
+		ingested.back().second.sourceKeys.swap(sorted.sourceKeys);
+		ingested.back().second.sourceFields.swap(sorted.sourceFields);
+	}
+
+	void clear()
+	{
+		isOpen = false;
+		scans.clear();
+		sourceScanCounts.clear();
+		ingested.clear();
+	}
+};
@@ -0,0 +1,132 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <memory>
+#include <unordered_set>
+
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/**
+* The <code>DiscoveryArena</code> class stores string bytes in large blocks, so that many small strings
+* cost neither a heap allocation nor a std::string header each. The stored strings are handed out as string_refs,
+* which stay valid for as long as the arena or any of its copies exist, since copies share the blocks.
+* Nothing is ever freed individually. Not thread safe.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryArena
+{
+	static const size_t blockSize = 64 * 1024;
+
+	vector<shared_ptr<char>> blocks;
+
+	/** Unused bytes at the end of the last block.*/
+	char* next;
+	size_t remaining;
+
+	DiscoveryArena() : next(nullptr), remaining(0) {}
+
+	/** Copies the string into the arena, returns a mutable pointer to the copy.*/
+	char* allocate(boost::string_ref value)
+	{
+		if (value.empty())
+			return nullptr;
+
+		if (value.size() > remaining)
+		{
+			// strings longer than a quarter of a block get a block of their own, so that the current block is not wasted
+			if (value.size() > blockSize / 4)
+			{
+				blocks.push_back(shared_ptr<char>(new char[value.size()], default_delete<char[]>()));
+				memcpy(blocks.back().get(), value.data(), value.size());
+				return blocks.back().get();
+			}
+			blocks.push_back(shared_ptr<char>(new char[blockSize], default_delete<char[]>()));
+			next = blocks.back().get();
+			remaining = blockSize;
+		}
+
+		char* copy = next;
+		memcpy(copy, value.data(), value.size());
+		next += value.size();
+		remaining -= value.size();
+		return copy;
+	}
+
+	boost::string_ref store(boost::string_ref value)
+	{
+		return boost::string_ref(allocate(value), value.size());
+	}
+};
+
+struct DiscoveryStringRefHash
+{
+	size_t operator()(boost::string_ref value) const
+	{
+		return boost::hash_range(value.begin(), value.end());
+	}
+};
+
+/**
+* The <code>DiscoveryStringPool</code> class interns strings that repeat all over the fleet, such as company and product names,
+* so that each distinct value is stored only once for the whole run. It is split into shards by hash, each with its own mutex
+* and arena, so it can be shared by all the processing tasks. Interned strings live as long as the pool.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryStringPool
+{
+	static const size_t shardCount = 16;
+
+	struct Shard
+	{
+		mutex mutexShard;
+		unordered_set<boost::string_ref, DiscoveryStringRefHash> strings;
+		DiscoveryArena arena;
+	};
+
+	Shard shards[shardCount];
+
+	/** Number of intern calls and how many of them found the string already there.*/
+	atomic<size_t> lookups;
+	atomic<size_t> hits;
+
+	DiscoveryStringPool() : lookups(0), hits(0) {}
+
+	boost::string_ref intern(boost::string_ref value)
+	{
+		if (value.empty())
+			return boost::string_ref();
+
+		++lookups;
+		Shard& shard = shards[DiscoveryStringRefHash()(value) % shardCount];
+		mutex::scoped_lock lock(shard.mutexShard);
+
+		auto it = shard.strings.find(value);
+		if (it != shard.strings.end())
+		{
+			++hits;
+			return *it;
+		}
+		return *shard.strings.insert(shard.arena.store(value)).first;
+	}
+};
@@ -0,0 +1,464 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <chrono>
+#include <cstdint>
+
+#include "DiscoveryCaseFolding.h"
+#include "DiscoveryRuleIndex.h"
+
+/**
+* The <code>DiscoveryBenchmarkRandom</code> class is a splitmix64 generator.
+* Unlike the standard distributions it gives the same sequence on every platform and library, so a seed always generates the same data.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryBenchmarkRandom
+{
+	uint64_t state;
+
+	DiscoveryBenchmarkRandom(uint64_t seed) : state(seed) {}
+
+	uint64_t next()
+	{
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	/** Uniform in [0, n), n has to be positive.*/
+	size_t below(size_t n)
+	{
+		return static_cast<size_t>(next() % n);
+	}
+
+	/** Skewed towards 0 like the popularity of software across a fleet, [0, n), n has to be positive.*/
+	size_t popular(size_t n)
+	{
+		size_t a = below(n);
+		size_t b = below(n);
+		return a * b / n;
+	}
+
+	bool percent(size_t percentage)
+	{
+		return below(100) < percentage;
+	}
+};
+
+/** The size and shape of the generated rule library and scans, and how many times the benchmark repeats each measurement.*/
+struct DiscoveryBenchmarkParameters
+{
+	size_t machineCount;
+	size_t productCount;
+	/** Each version has its own signature and rules, and excludes the previous version of the product.*/
+	size_t versionsPerProduct;
+	/** Average per scan, scans range from half to one and a half times as large.*/
+	size_t addremovesPerScan;
+	size_t filesPerScan;
+	/** Percentage of the rules with glob patterns instead of exact values.*/
+	size_t wildcardPercentage;
+	/** Number of directories between the drive and the product directory in the file paths.*/
+	size_t pathDepth;
+	size_t iterations;
+	uint64_t seed;
+
+	DiscoveryBenchmarkParameters() : machineCount(200), productCount(500), versionsPerProduct(4), addremovesPerScan(100), filesPerScan(2000),
+		wildcardPercentage(25), pathDepth(3), iterations(3), seed(1) {}
+
+	/** Sets the parameter of a /name:value command line option, returns false when the option is not a benchmark parameter or its value is not a number.*/
+	bool parse(const string& option)
+	{
+		static const struct { const char* name; size_t DiscoveryBenchmarkParameters::*parameter; } options[] = {
+			{ "/machines:", &DiscoveryBenchmarkParameters::machineCount },
+			{ "/products:", &DiscoveryBenchmarkParameters::productCount },
+			{ "/versions:", &DiscoveryBenchmarkParameters::versionsPerProduct },
+			{ "/addremoves:", &DiscoveryBenchmarkParameters::addremovesPerScan },
+			{ "/files:", &DiscoveryBenchmarkParameters::filesPerScan },
+			{ "/wildcards:", &DiscoveryBenchmarkParameters::wildcardPercentage },
+			{ "/depth:", &DiscoveryBenchmarkParameters::pathDepth },
+			{ "/iterations:", &DiscoveryBenchmarkParameters::iterations }
+		};
+		for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+			if (boost::starts_with(option, options[i].name))
+			{
+				uint64_t value;
+				if (!parseValue(option.substr(strlen(options[i].name)), value) || value > numeric_limits<size_t>::max())
+					return false;
+				this->*options[i].parameter = static_cast<size_t>(value);
+				return true;
+			}
+		if (boost::starts_with(option, "/seed:"))
+			return parseValue(option.substr(6), seed);
+		return false;
+	}
+
+private:
+	// digits only, since stoull would take a sign or stop at the first character which is not a digit
+	static bool parseValue(const string& text, uint64_t& value)
+	{
+		if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+			return false;
+		try {
+			value = stoull(text);
+		}
+		catch (const out_of_range&) {
+			return false;
+		}
+		return true;
+	}
+};
+
+/**
+* The <code>DiscoveryBenchmarkGenerator</code> class writes a synthetic rule library and fleet of scans, in the same formats as the real ones,
+* under the library and scans directories of a root directory.
+* Products have addremove and file rules, some with glob patterns, the files are spread over directory trees of the given depth,
+* the scans have a popularity skew, so the same sources show up on many machines, and a share of noise without any rule.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryBenchmarkGenerator
+{
+	static void generate(const string& rootPath, const DiscoveryBenchmarkParameters& parameters)
+	{
+		filesystem::create_directories(rootPath + "library\\");
+		filesystem::create_directories(rootPath + "logs\\");
+		filesystem::create_directories(rootPath + "results\\");
+		// scans of a larger earlier run must not be left behind
+		filesystem::remove_all(rootPath + "scans\\");
+		filesystem::create_directories(rootPath + "scans\\");
+
+		DiscoveryBenchmarkRandom random(parameters.seed);
+		generateLibrary(rootPath, parameters, random);
+		for (size_t machine = 0; machine < parameters.machineCount; machine++)
+			generateScan(rootPath, parameters, random, machine);
+	}
+
+private:
+	static const char* publisher(size_t product)
+	{
+		static const char* publishers[] = { "Microsoft Corporation", "Adobe Systems", "Oracle (America)", "Acme", "Foo.Bar+Inc" };
+		return publishers[product % (sizeof(publishers) / sizeof(publishers[0]))];
+	}
+
+	static int versionID(const DiscoveryBenchmarkParameters& parameters, size_t product, size_t version)
+	{
+		return static_cast<int>(1000 + product * parameters.versionsPerProduct + version);
+	}
+
+	static void generateLibrary(const string& rootPath, const DiscoveryBenchmarkParameters& parameters, DiscoveryBenchmarkRandom& random)
+	{
+		ofstream ofsRules(rootPath + "library\\DiscoveryRules.txt", fstream::out | fstream::trunc);
+		ofstream ofsVERs(rootPath + "library\\DiscoveryVERs.txt", fstream::out | fstream::trunc);
+		ofstream ofsSignatures(rootPath + "library\\DiscoverySignatures.txt", fstream::out | fstream::trunc);
+
+		for (size_t product = 0; product < parameters.productCount; product++)
+		for (size_t version = 0; version < parameters.versionsPerProduct; version++)
+		{
+			int id = versionID(parameters, product, version);
+			int buildID = id * 10;
+
+			// versionID, buildID, sourceTypeID, key, productVersion, productName, fileVersion, fileSize, filePath
+			ofsRules << id << "\t" << buildID << "\t" << 1 << "\t" << "Product" << product << " Suite" << "\t"
+				<< product << "." << version << (random.percent(parameters.wildcardPercentage) ? ".*" : ".0") << "\t\t\t\t" << endl;
+
+			bool isWildcard = random.percent(parameters.wildcardPercentage);
+			ofsRules << id << "\t" << buildID << "\t" << 0 << "\t" << "app" << product << ".exe" << "\t"
+				<< product << "." << version << ".0" << "\t"
+				<< "Product" << product << (isWildcard ? "*" : "") << "\t"
+				<< product << "." << version << (isWildcard ? ".*" : ".0.1") << "\t" << "\t"
+				<< (random.percent(parameters.wildcardPercentage) ? "*\\app" + to_string(product) + "\\*" : "") << endl;
+
+			// a second file rule for the same build, so that builds are only found with all their rules matched
+			ofsRules << id << "\t" << buildID << "\t" << 0 << "\t" << "lib" << product << ".dll" << "\t"
+				<< "\t" << "\t" << "\t" << 4096 + product << "\t" << endl;
+
+			// excludedVersionID, versionID
+			if (version > 0)
+				ofsVERs << versionID(parameters, product, version - 1) << "\t" << id << "\t" << "x" << endl;
+
+			// publisherID, publisherName, webPage, productID, productName, licensable, category, versionID, uniqueVersion,
+			// build, major, minor, edition, variation, licenseVersion
+			ofsSignatures << product % 5 << "\t" << publisher(product) << "\t" << "www.publisher" << product % 5 << ".com" << "\t"
+				<< product << "\t" << "Product" << product << "\t" << (product % 3 == 0 ? "N" : "Y") << "\t" << "Category" << product % 7 << "\t"
+				<< id << "\t" << product << "." << version << "\t" << "b" << version << "\t" << product << "\t" << version << "\t"
+				<< "Pro" << "\t" << "\t" << "L" << version << endl;
+		}
+	}
+
+	static string directory(const DiscoveryBenchmarkParameters& parameters, DiscoveryBenchmarkRandom& random)
+	{
+		string path = "C:\\Program Files";
+		for (size_t i = 0; i < parameters.pathDepth; i++)
+			path += "\\dir" + to_string(random.below(8));
+		return path;
+	}
+
+	static void generateScan(const string& rootPath, const DiscoveryBenchmarkParameters& parameters, DiscoveryBenchmarkRandom& random, size_t machine)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "m%06u.scan", static_cast<unsigned>(machine));
+		ofstream ofs((filesystem::path(rootPath + "scans\\") / name).string(),fstream::out | fstream::trunc | fstream::binary);
+
+		// scans of different sizes, so that scheduling matters
+		size_t scale = 50 + random.below(101);
+		size_t addremoveCount = parameters.addremovesPerScan * scale / 100;
+		size_t fileCount = parameters.filesPerScan * scale / 100;
+
+		// half of the addremoves are products with rules, each installed product also brings two files of its own
+		ofs << "<SourceName=AddRemoves>" << endl;
+		vector<pair<size_t, size_t>> installed;
+		for (size_t i = 0; i < addremoveCount; i++)
+		{
+			if (parameters.productCount > 0 && parameters.versionsPerProduct > 0 && random.percent(50))
+			{
+				size_t product = random.popular(parameters.productCount);
+				size_t version = random.popular(parameters.versionsPerProduct);
+				installed.push_back(make_pair(product, version));
+				ofs << "Product" << product << " Suite" << "\t" << product << "." << version << "." << random.below(3) << "\t"
+					<< publisher(product) << "\t" << "C:\\Program Files\\app" << product << "\t" << "uninstall.exe" << "\t" << 0 << endl;
+			}
+			else
+				ofs << "Noise " << random.below(100000) << "\t" << "1." << random.below(10) << "\t" << "Noise Inc" << "\t\t\t" << 0 << endl;
+		}
+
+		ofs << "<SourceName=Files>" << endl;
+		size_t files = 0;
+		for (auto it = installed.begin(); it != installed.end() && files + 2 <= fileCount; it++, files += 2)
+		{
+			size_t product = it->first;
+			size_t version = it->second;
+			string path = directory(parameters, random) + "\\app" + to_string(product) + "\\bin";
+			ofs << path << "\t" << "APP" << product << ".exe" << "\t" << product << "." << version << ".0" << "\t" << publisher(product) << "\t"
+				<< "Product" << product << (random.percent(50) ? " Ultimate" : "") << "\t" << "desc" << "\t" << product << "." << version << ".0.1" << "\t" << 123456 << endl;
+			ofs << path << "\t" << "lib" << product << ".dll" << "\t" << "\t" << publisher(product) << "\t" << "\t" << "\t" << "\t" << 4096 + product << endl;
+		}
+		for (; files < fileCount; files++)
+			ofs << directory(parameters, random) << "\\noise" << "\t" << "file" << random.below(100000) << ".dat" << "\t" << "1.0" << "\t"
+				<< "Noise Inc" << "\t" << "Noise" << "\t" << "\t" << "1.0.0.1" << "\t" << random.below(1 << 20) << endl;
+	}
+};
+
+/**
+* The <code>DiscoveryBenchmarkTimings</code> class accumulates the time spent in each measured phase, in the order the phases were first seen.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryBenchmarkTimings
+{
+	vector<pair<string, long long>> phases;
+
+	void add(const string& phase, long long nanoseconds)
+	{
+		for (auto it = phases.begin(); it != phases.end(); it++)
+			if (it->first == phase)
+			{
+				it->second += nanoseconds;
+				return;
+			}
+		phases.push_back(make_pair(phase, nanoseconds));
+	}
+
+	/** Average time per iteration and per scan of each phase.*/
+	void report(ostream& os, size_t iterations, size_t scanCount) const
+	{
+		for (auto it = phases.begin(); it != phases.end(); it++)
+			os << it->first << ": " << it->second / 1000000.0 / max<size_t>(iterations, 1) << " ms per iteration, "
+				<< it->second / 1000.0 / max<size_t>(iterations * scanCount, 1) << " us per scan" << endl;
+	}
+};
+
+/**
+* The <code>DiscoveryCaseFoldingBenchmark</code> class times the DiscoveryCaseFolding kernels against the Boost algorithms they replace,
+* uppercasing, case insensitive equality and prefix tests, on a corpus of strings, and counts the strings on which the two disagree,
+* which has to be none. Each string is compared with a copy in lower case, which is equal, and with a copy differing in its last byte.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryCaseFoldingBenchmark
+{
+	static void run(ostream& report, const vector<string>& corpus, size_t iterations)
+	{
+		vector<string> lowerCase;
+		vector<string> different;
+		size_t bytes = 0;
+		for (auto it = corpus.begin(); it != corpus.end(); it++)
+		{
+			lowerCase.push_back(boost::to_lower_copy(*it));
+			different.push_back(*it);
+			if (!different.back().empty())
+				different.back().back() ^= 1;
+			bytes += it->size();
+		}
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			boost::string_ref prefix(lowerCase[i].data(), lowerCase[i].size() / 2);
+			if (DiscoveryCaseFolding::toUpperCopy(corpus[i]) != to_upper_copy(corpus[i])
+				|| DiscoveryCaseFolding::iequals(corpus[i], lowerCase[i]) != boost::iequals(corpus[i], lowerCase[i])
+				|| DiscoveryCaseFolding::iequals(corpus[i], different[i]) != boost::iequals(corpus[i], different[i])
+				|| DiscoveryCaseFolding::istartsWith(corpus[i], prefix) != boost::istarts_with(corpus[i], prefix))
+				mismatches++;
+		}
+
+		// enough repetitions for the clock, the checksums keep the compiler from dropping the work
+		size_t repetitions = max<size_t>(iterations, 1) * 10;
+		size_t checksum = 0;
+		string upperCase;
+
+		auto start = chrono::steady_clock::now();
+		for (size_t r = 0; r < repetitions; r++)
+			for (auto it = corpus.begin(); it != corpus.end(); it++)
+			{
+				upperCase = *it;
+				to_upper(upperCase);
+				checksum += upperCase.size();
+			}
+		long long boostToUpper = elapsed(start);
+		for (size_t r = 0; r < repetitions; r++)
+			for (auto it = corpus.begin(); it != corpus.end(); it++)
+			{
+				DiscoveryCaseFolding::assignUpper(upperCase, *it);
+				checksum += upperCase.size();
+			}
+		long long kernelToUpper = elapsed(start);
+
+		for (size_t r = 0; r < repetitions; r++)
+			for (size_t i = 0; i < corpus.size(); i++)
+				checksum += boost::iequals(corpus[i], lowerCase[i]) + boost::iequals(corpus[i], different[i]);
+		long long boostIequals = elapsed(start);
+		for (size_t r = 0; r < repetitions; r++)
+			for (size_t i = 0; i < corpus.size(); i++)
+				checksum += DiscoveryCaseFolding::iequals(corpus[i], lowerCase[i]) + DiscoveryCaseFolding::iequals(corpus[i], different[i]);
+		long long kernelIequals = elapsed(start);
+
+		for (size_t r = 0; r < repetitions; r++)
+			for (size_t i = 0; i < corpus.size(); i++)
+				checksum += boost::istarts_with(corpus[i], boost::string_ref(lowerCase[i].data(), lowerCase[i].size() / 2));
+		long long boostIstartsWith = elapsed(start);
+		for (size_t r = 0; r < repetitions; r++)
+			for (size_t i = 0; i < corpus.size(); i++)
+				checksum += DiscoveryCaseFolding::istartsWith(corpus[i], boost::string_ref(lowerCase[i].data(), lowerCase[i].size() / 2));
+		long long kernelIstartsWith = elapsed(start);
+
+		report << "caseFolding (" << DiscoveryCaseFolding::instructionSet() << "): strings: " << corpus.size() << ", bytes: " << bytes
+			<< ", mismatches: " << mismatches << ", checksum: " << checksum << endl;
+		reportKernel(report, "toUpper", boostToUpper, kernelToUpper, repetitions * corpus.size());
+		reportKernel(report, "iequals", boostIequals, kernelIequals, repetitions * corpus.size() * 2);
+		reportKernel(report, "istartsWith", boostIstartsWith, kernelIstartsWith, repetitions * corpus.size());
+	}
+
+private:
+	// the time since start, which is then reset to now
+	static long long elapsed(chrono::steady_clock::time_point& start)
+	{
+		auto end = chrono::steady_clock::now();
+		long long nanoseconds = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+		start = end;
+		return nanoseconds;
+	}
+
+	static void reportKernel(ostream& report, const char* kernel, long long boostNanoseconds, long long kernelNanoseconds, size_t calls)
+	{
+		report << "caseFolding " << kernel << ": boost: " << boostNanoseconds / static_cast<double>(max<size_t>(calls, 1)) << " ns per call, kernel: "
+			<< kernelNanoseconds / static_cast<double>(max<size_t>(calls, 1)) << " ns per call, speedup: "
+			<< (kernelNanoseconds > 0 ? boostNanoseconds / static_cast<double>(kernelNanoseconds) : 0) << endl;
+	}
+};
+
+/**
+* The <code>DiscoveryRuleIndexBenchmark</code> class times the lookups of DiscoveryRuleIndex against those of the container index it was built from,
+* separately for the keys of the rules, which are found, and for keys which are not, as most of the files of a scan are.
+* The keys not found are the keys of the rules with their last byte changed and with a suffix, so they hash and probe like real ones.
+* The rules found by the two for each key are counted, the counts have to be the same.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryRuleIndexBenchmark
+{
+	/** index is the container index by sourceTypeID and key, lookups the sourceTypeIDs and uppercased keys of the rules.*/
+	template <class Index>
+	static void run(ostream& report, const Index& index, const DiscoveryRuleIndex& ruleIndex, const vector<pair<int, string>>& lookups, size_t iterations)
+	{
+		vector<pair<int, string>> misses;
+		for (auto it = lookups.begin(); it != lookups.end(); it++)
+		{
+			misses.push_back(*it);
+			if (!misses.back().second.empty())
+				misses.back().second.back() ^= 1;
+			misses.push_back(make_pair(it->first, it->second + ".MUI"));
+		}
+
+		size_t mismatches = 0;
+		size_t hits = 0;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			const vector<pair<int, string>>& keys = pass == 0 ? lookups : misses;
+			for (auto it = keys.begin(); it != keys.end(); it++)
+			{
+				auto range = index.equal_range(boost::make_tuple(it->first, boost::string_ref(it->second)));
+				auto indexRange = ruleIndex.equal_range(it->first, it->second);
+				size_t found = distance(range.first, range.second);
+				mismatches += found != static_cast<size_t>(indexRange.second - indexRange.first);
+				hits += pass == 1 && found > 0;
+			}
+		}
+
+		report << "ruleIndex: keys: " << ruleIndex.keyCount() << ", slots: " << ruleIndex.capacity() << ", lookups found: " << lookups.size()
+			<< ", lookups not found: " << misses.size() << " (of which found anyway: " << hits << "), mismatches: " << mismatches << endl;
+		reportLookups(report, "found", index, ruleIndex, lookups, iterations);
+		reportLookups(report, "not found", index, ruleIndex, misses, iterations);
+	}
+
+private:
+	template <class Index>
+	static void reportLookups(ostream& report, const char* kind, const Index& index, const DiscoveryRuleIndex& ruleIndex, const vector<pair<int, string>>& keys, size_t iterations)
+	{
+		// enough repetitions for the clock, the checksum keeps the compiler from dropping the work
+		size_t repetitions = max<size_t>(iterations, 1) * 10;
+		size_t checksum = 0;
+
+		auto start = chrono::steady_clock::now();
+		for (size_t r = 0; r < repetitions; r++)
+			for (auto it = keys.begin(); it != keys.end(); it++)
+				checksum += index.find(boost::make_tuple(it->first, boost::string_ref(it->second))) != index.end();
+		auto end = chrono::steady_clock::now();
+		long long containerNanoseconds = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+
+		start = end;
+		for (size_t r = 0; r < repetitions; r++)
+			for (auto it = keys.begin(); it != keys.end(); it++)
+				checksum += ruleIndex.contains(it->first, it->second);
+		end = chrono::steady_clock::now();
+		long long ruleIndexNanoseconds = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+
+		double lookups = static_cast<double>(repetitions * keys.size());
+		report << "ruleIndex " << kind << ": container: " << lookupsPerSecond(lookups, containerNanoseconds) << " lookups per second, ruleIndex: "
+			<< lookupsPerSecond(lookups, ruleIndexNanoseconds) << " lookups per second, speedup: "
+			<< (ruleIndexNanoseconds > 0 ? containerNanoseconds / static_cast<double>(ruleIndexNanoseconds) : 0) << ", checksum: " << checksum << endl;
+	}
+
+	static double lookupsPerSecond(double lookups, long long nanoseconds)
+	{
+		return nanoseconds > 0 ? lookups * 1e9 / nanoseconds : 0;
+	}
+};
@@ -0,0 +1,172 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <boost/utility/string_ref.hpp>
+
+// the widest of the instruction sets the build targets, the kernels fall back to a byte at a time without either
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DISCOVERY_CASE_FOLDING_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DISCOVERY_CASE_FOLDING_SSE2
+#endif
+
+/**
+* The <code>DiscoveryCaseFolding</code> class uppercases and compares case insensitively the mostly ASCII strings of scans and rules,
+* 32 bytes at a time with AVX2 or 16 bytes at a time with SSE2, whichever the build targets, and the bytes left over one at a time.
+* Only a to z are folded, the bytes of non-ASCII characters are left as they are and have to match exactly,
+* the same as Boost's to_upper and iequals in the classic "C" locale the engine runs in, so either gives the same keys.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryCaseFolding
+{
+	/** The instruction set the kernels are built for, for reports.*/
+	static const char* instructionSet()
+	{
+#if defined(DISCOVERY_CASE_FOLDING_AVX2)
+		return "AVX2";
+#elif defined(DISCOVERY_CASE_FOLDING_SSE2)
+		return "SSE2";
+#else
+		return "scalar";
+#endif
+	}
+
+	static char toUpper(char c)
+	{
+		return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+	}
+
+	/** Uppercases size bytes from source into target, which may be source itself.*/
+	static void copyUpper(const char* source, char* target, size_t size)
+	{
+		size_t i = 0;
+#if defined(DISCOVERY_CASE_FOLDING_AVX2)
+		for (; i + 32 <= size; i += 32)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), upper(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i))));
+#elif defined(DISCOVERY_CASE_FOLDING_SSE2)
+		for (; i + 16 <= size; i += 16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), upper(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i))));
+#endif
+		for (; i < size; i++)
+			target[i] = toUpper(source[i]);
+	}
+
+	static void toUpper(char* value, size_t size)
+	{
+		copyUpper(value, value, size);
+	}
+
+	static void toUpper(string& value)
+	{
+		if (!value.empty())
+			toUpper(&value[0], value.size());
+	}
+
+	/** Replaces target with the uppercased value, reusing its buffer.*/
+	static void assignUpper(string& target, boost::string_ref value)
+	{
+		target.resize(value.size());
+		if (!value.empty())
+			copyUpper(value.data(), &target[0], value.size());
+	}
+
+	static string toUpperCopy(boost::string_ref value)
+	{
+		string upperCase;
+		assignUpper(upperCase, value);
+		return upperCase;
+	}
+
+	static bool iequals(boost::string_ref a, boost::string_ref b)
+	{
+		return a.size() == b.size() && iequals(a.data(), b.data(), a.size());
+	}
+
+	static bool istartsWith(boost::string_ref value, boost::string_ref prefix)
+	{
+		return prefix.size() <= value.size() && iequals(value.data(), prefix.data(), prefix.size());
+	}
+
+	/** Whether value is upperCase but for the case of its letters, upperCase having been uppercased already, which saves folding it again.*/
+	static bool equalsUpperCase(const char* value, const char* upperCase, size_t size)
+	{
+		size_t i = 0;
+#if defined(DISCOVERY_CASE_FOLDING_AVX2)
+		for (; i + 32 <= size; i += 32)
+			if (!equal(upper(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(value + i))), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(upperCase + i))))
+				return false;
+#elif defined(DISCOVERY_CASE_FOLDING_SSE2)
+		for (; i + 16 <= size; i += 16)
+			if (!equal(upper(_mm_loadu_si128(reinterpret_cast<const __m128i*>(value + i))), _mm_loadu_si128(reinterpret_cast<const __m128i*>(upperCase + i))))
+				return false;
+#endif
+		for (; i < size; i++)
+			if (toUpper(value[i]) != upperCase[i])
+				return false;
+		return true;
+	}
+
+private:
+	static bool iequals(const char* a, const char* b, size_t size)
+	{
+		size_t i = 0;
+#if defined(DISCOVERY_CASE_FOLDING_AVX2)
+		for (; i + 32 <= size; i += 32)
+			if (!equal(upper(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i))), upper(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)))))
+				return false;
+#elif defined(DISCOVERY_CASE_FOLDING_SSE2)
+		for (; i + 16 <= size; i += 16)
+			if (!equal(upper(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))), upper(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)))))
+				return false;
+#endif
+		for (; i < size; i++)
+			if (toUpper(a[i]) != toUpper(b[i]))
+				return false;
+		return true;
+	}
+
+	// the comparisons are signed, so the bytes from 0x80 up, i.e. those of non-ASCII characters, are below 'a' and never folded
+#if defined(DISCOVERY_CASE_FOLDING_AVX2)
+	static __m256i upper(__m256i bytes)
+	{
+		__m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), bytes));
+		return _mm256_sub_epi8(bytes, _mm256_and_si256(isLower, _mm256_set1_epi8('a' - 'A')));
+	}
+
+	static bool equal(__m256i a, __m256i b)
+	{
+		return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) == -1;
+	}
+#elif defined(DISCOVERY_CASE_FOLDING_SSE2)
+	static __m128i upper(__m128i bytes)
+	{
+		__m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('z' + 1)));
+		return _mm_sub_epi8(bytes, _mm_and_si128(isLower, _mm_set1_epi8('a' - 'A')));
+	}
+
+	static bool equal(__m128i a, __m128i b)
+	{
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+	}
+#endif
+};
@@ -24,25 +24,203 @@ limitations under the License.
 // definitions and default initializations
 // of static DiscoveryEngine containers
 // as opposed to their definitions in DiscoveryEngine.h
-DiscoveryRules DiscoveryEngine::discoveryRules;
-unordered_multimap<int, int> DiscoveryEngine::discoveryVERs;
-unordered_map<int, DiscoverySignature> DiscoveryEngine::discoverySignatures;
-unordered_map<string, DiscoverySource> DiscoveryEngine::discoveryAggregateSources;
-mutex DiscoveryEngine::mutexDiscoveryAggregateSources;
+string DiscoveryEngine::rootPath = "s:\\";
+string DiscoveryEngine::resultsPath = "s:\\results\\";
+int DiscoveryEngine::shardIndex = 0;
+int DiscoveryEngine::shardCount = 1;
+bool DiscoveryEngine::isNormalizedOutput = false;
+bool DiscoveryEngine::isIncremental = false;
+shared_ptr<DiscoveryLibrary> DiscoveryEngine::discoveryLibrary = make_shared<DiscoveryLibrary>();
+DiscoveryScanCache DiscoveryEngine::scanCache;
+int DiscoveryEngine::configuredWorkerThreadCount = 0;
+bool DiscoveryEngine::isPinningWorkerThreads = false;
+bool DiscoveryEngine::isPipelined = false;
+int DiscoveryEngine::pipelineReaderCount = 1;
+int DiscoveryEngine::pipelineWriterCount = 1;
+int DiscoveryEngine::pipelineQueueDepth = 8;
+int DiscoveryEngine::daemonPollSeconds = 5;
+int DiscoveryEngine::daemonCheckpointSeconds = 60;
+vector<string> DiscoveryEngine::scanPaths;
+unordered_map<string, int> DiscoveryEngine::scanIDs;
+DiscoveryAggregateSources DiscoveryEngine::discoveryAggregateSources;
+list<DiscoveryResultWriter> DiscoveryEngine::workerResultWriters;
 mutex DiscoveryEngine::mutexDiscoveryResults;
-unordered_map<string, DiscoveryAggregateResult> DiscoveryEngine::discoveryAggregateResults;
+DiscoveryLockStats DiscoveryEngine::lockStatsDiscoveryResults;
+DiscoveryAggregateProvenance DiscoveryEngine::aggregateProvenance;
+DiscoverySourceIDs DiscoveryEngine::normalizedSourceIDs;
+DiscoveryMetrics DiscoveryEngine::metrics;
+map<DiscoveryAggregateResultKey, DiscoveryAggregateResult> DiscoveryEngine::discoveryAggregateResults;
+list<DiscoveryWorkerAggregateResults> DiscoveryEngine::workerDiscoveryAggregateResults;
 mutex DiscoveryEngine::mutexDiscoveryAggregateResults;
+DiscoveryLockStats DiscoveryEngine::lockStatsDiscoveryAggregateResults;
 
 size_t DiscoverySource::moveCtorCalls;
 size_t DiscoverySource::copyCtorCalls;
+DiscoveryStringPool DiscoverySource::stringPool;
+
+atomic<size_t> DiscoveryEngine::ProcessScanTask::scanBytesParsed(0);
+atomic<size_t> DiscoveryEngine::ProcessScanTask::scanSourcesParsed(0);
+atomic<long long> DiscoveryEngine::ProcessScanTask::scanParseNanoseconds(0);
+atomic<char> DiscoveryEngine::ProcessScanTask::prefetchedPages(0);
+
+atomic<size_t> DiscoveryRule::globCompilations(0);
+atomic<size_t> DiscoveryRule::globEvaluations(0);
+
+// command line arguments are wide in Unicode builds, while paths are narrow strings everywhere else
+static string toString(const _TCHAR* value)
+{
+	string result;
+	for (; *value != 0; value++)
+		result.push_back(static_cast<char>(*value));
+	return result;
+}
+
+// digits only and at least minimum, since _ttoi would take a sign, stop at the first character which is not a digit or give 0 for no number at all
+static bool parseCount(const _TCHAR* value, int minimum, int& count)
+{
+	string text = toString(value);
+	if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+		return false;
+	int parsed;
+	try {
+		parsed = stoi(text);
+	}
+	catch (const out_of_range&) {
+		return false;
+	}
+	if (parsed < minimum)
+		return false;
+	count = parsed;
+	return true;
+}
+
+static void printUsage()
+{
+	cout << "Options:" << endl
+		<< "  /root:path           the root directory of the library, scans and results" << endl
+		<< "  /threads:N           the number of worker threads, /pin pins each of them to a processor" << endl
+		<< "  /pipeline            runs the scans through reader, matcher and writer threads, /readers:N, /writers:N and /queue:N size it" << endl
+		<< "  /shard:i/N           only processes the i-th of N shards of the scans, /merge:N then combines the N shards" << endl
+		<< "  /normalized          writes the normalized output instead of the verbose results, /expand rebuilds the verbose results from it" << endl
+		<< "  /daemon              processes the scans as they land, changed ones only with /incremental, /poll:N and /checkpoint:N set its intervals in seconds," << endl
+		<< "                       /checkpoint:0 checkpoints after every poll which has found scans" << endl
+		<< "  /incremental         adds the scans to the aggregates of the previous incremental runs" << endl
+		<< "  /benchmark           runs the benchmark, sized by /machines:N, /products:N, /versions:N, /addremoves:N, /files:N," << endl
+		<< "                       /wildcards:N, /depth:N, /iterations:N and /seed:N" << endl;
+}
 
 int _tmain(int argc, _TCHAR* argv[])
 {
 	time_t start = time(0);
 
+	// /threads:N sets the number of worker threads, /pin pins each of them to a processor,
+	// /pipeline runs the scans through reader, matcher and writer threads instead, with the worker threads as matchers,
+	// /readers:N, /writers:N and /queue:N set the number of reader and writer threads and the depth of the queues between them,
+	// /shard:i/N only processes the i-th of N shards of the scans, with partial results under rootPath\shards\i\,
+	// /merge:N then combines the partial results of the N shards into rootPath\results\,
+	// /normalized writes the normalized output instead of the verbose results, /expand then rebuilds the verbose results from it,
+	// /daemon keeps running and processes the scans as they land, looking for them every /poll:N seconds and checkpointing every /checkpoint:N seconds,
+	// /incremental adds the scans to the aggregates of the previous incremental runs, kept in rootPath\store\, replacing what the scans processed again added before,
+	// /root:path sets rootPath, /benchmark runs the benchmark under rootPath\benchmark\, or /root:path when given, see DiscoveryBenchmarkParameters for its options
+	bool isRootSet = false;
+	bool isBenchmarking = false;
+	int mergedShardCount = 0;
+	bool isExpanding = false;
+	bool isDaemon = false;
+	DiscoveryBenchmarkParameters benchmarkParameters;
+	for (int i = 1; i < argc; i++)
+	{
+		bool isValid = true;
+		if (_tcsncmp(argv[i], _T("/root:"), 6) == 0)
+		{
+			DiscoveryEngine::rootPath = toString(argv[i] + 6);
+			isRootSet = true;
+		}
+		else if (_tcsncmp(argv[i], _T("/threads:"), 9) == 0)
+			isValid = parseCount(argv[i] + 9, 1, DiscoveryEngine::configuredWorkerThreadCount);
+		else if (_tcscmp(argv[i], _T("/pin")) == 0)
+			DiscoveryEngine::isPinningWorkerThreads = true;
+		else if (_tcscmp(argv[i], _T("/pipeline")) == 0)
+			DiscoveryEngine::isPipelined = true;
+		else if (_tcsncmp(argv[i], _T("/readers:"), 9) == 0)
+			isValid = parseCount(argv[i] + 9, 1, DiscoveryEngine::pipelineReaderCount);
+		else if (_tcsncmp(argv[i], _T("/writers:"), 9) == 0)
+			isValid = parseCount(argv[i] + 9, 1, DiscoveryEngine::pipelineWriterCount);
+		else if (_tcsncmp(argv[i], _T("/queue:"), 7) == 0)
+			isValid = parseCount(argv[i] + 7, 1, DiscoveryEngine::pipelineQueueDepth);
+		else if (_tcsncmp(argv[i], _T("/shard:"), 7) == 0)
+		{
+			string shard = toString(argv[i] + 7);
+			size_t slash = shard.find('/');
+			DiscoveryEngine::shardIndex = atoi(shard.c_str());
+			DiscoveryEngine::shardCount = slash != string::npos ? atoi(shard.c_str() + slash + 1) : 0;
+			if (DiscoveryEngine::shardCount < 1 || DiscoveryEngine::shardIndex < 0 || DiscoveryEngine::shardIndex >= DiscoveryEngine::shardCount)
+			{
+				cout << "Invalid shard " << shard << ", expected /shard:i/N with 0 <= i < N" << endl;
+				return 1;
+			}
+		}
+		else if (_tcsncmp(argv[i], _T("/merge:"), 7) == 0)
+			isValid = parseCount(argv[i] + 7, 1, mergedShardCount);
+		else if (_tcscmp(argv[i], _T("/normalized")) == 0)
+			DiscoveryEngine::isNormalizedOutput = true;
+		else if (_tcscmp(argv[i], _T("/expand")) == 0)
+			isExpanding = true;
+		else if (_tcscmp(argv[i], _T("/daemon")) == 0)
+			isDaemon = true;
+		else if (_tcscmp(argv[i], _T("/incremental")) == 0)
+			DiscoveryEngine::isIncremental = true;
+		else if (_tcsncmp(argv[i], _T("/poll:"), 6) == 0)
+			isValid = parseCount(argv[i] + 6, 1, DiscoveryEngine::daemonPollSeconds);
+		else if (_tcsncmp(argv[i], _T("/checkpoint:"), 12) == 0)
+			isValid = parseCount(argv[i] + 12, 0, DiscoveryEngine::daemonCheckpointSeconds);
+		else if (_tcscmp(argv[i], _T("/benchmark")) == 0)
+			isBenchmarking = true;
+		else
+			isValid = benchmarkParameters.parse(toString(argv[i]));
+
+		if (!isValid)
+		{
+			cout << "Unknown option or invalid value " << toString(argv[i]) << endl;
+			printUsage();
+			return 1;
+		}
+	}
+
+	if (isBenchmarking)
+	{
+		// the benchmark generates its own library and scans, which must not end up among the real ones
+		if (!isRootSet)
+			DiscoveryEngine::rootPath += "benchmark\\";
+		try {
+			DiscoveryEngine::runBenchmark(benchmarkParameters);
+		}
+		catch (const std::exception& e) {
+			cout << e.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// the shards of a run would each replace the store with their own scans
+	if (DiscoveryEngine::isIncremental && (DiscoveryEngine::shardCount > 1 || mergedShardCount > 0))
+	{
+		cout << "/incremental cannot be combined with /shard or /merge" << endl;
+		return 1;
+	}
+
+	DiscoveryEngine::resultsPath = DiscoveryEngine::shardCount > 1 ? DiscoveryEngine::shardResultsPath(DiscoveryEngine::shardIndex) : DiscoveryEngine::rootPath + "results\\";
+
+	// the normalized output is expanded in place, without processing anything
+	if (isExpanding)
+	{
+		DiscoveryEngine::expandNormalizedResults();
+		return 0;
+	}
+
 	try {
-		filesystem::remove_all("s:\\results\\");
-		filesystem::create_directory("s:\\results\\");
+		filesystem::remove_all(DiscoveryEngine::resultsPath);
+		filesystem::create_directories(DiscoveryEngine::resultsPath);
 	}
 	catch (const boost::filesystem::filesystem_error& e) {
 		cout << e.what();
@@ -50,23 +228,41 @@ int _tmain(int argc, _TCHAR* argv[])
 		return 1;
 	}
 
-	DiscoveryEngine::loadDiscoveryRules();
-	DiscoveryEngine::loadDiscoverySignatures();
+	DiscoveryEngine::loadDiscoveryLibrary();
 
-	//if (argc == 1)
-	//{
-	DiscoveryEngine::processAllScans();
+	if (isDaemon)
+		DiscoveryEngine::runDaemon();
+	else if (mergedShardCount > 0)
+		DiscoveryEngine::mergeShards(mergedShardCount);
+	else
+	{
+		DiscoveryEngine::processAllScans();
 
-	DiscoveryEngine::saveDiscoveryAggregateResults();
-	DiscoveryEngine::saveDiscoveryAggregateSources();
-	//}
-	//else
-	//DiscoveryEngine::loadDiscoveryAggregateSources();
+		DiscoveryEngine::saveDiscoveryAggregateResults(DiscoveryEngine::resultsPath);
+		DiscoveryEngine::saveDiscoveryAggregateSources(DiscoveryEngine::resultsPath);
+	}
 
 	// log execution time
-	ofstream ofs("s:\\logs\\execution_times.txt", fstream::app | fstream::out);
+	ofstream ofs(DiscoveryEngine::rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+	shared_ptr<DiscoveryLibrary> library = DiscoveryEngine::currentDiscoveryLibrary();
+	ofs << "librarySource: " << (library->isLoadedFromSnapshot ? "snapshot" : "text") << endl;
+	ofs << "libraryLoad (ms): " << library->loadNanoseconds / 1000000.0 << endl;
 	ofs << "copyCtorCalls: " << DiscoverySource::copyCtorCalls << endl;
 	ofs << "moveCtorCalls: " << DiscoverySource::moveCtorCalls << endl;
+	ofs << "globCompilations: " << DiscoveryRule::globCompilations << endl;
+	ofs << "globEvaluations: " << DiscoveryRule::globEvaluations << endl;
+	ofs << "matchMemoLookups: " << library->matchMemo.lookups << endl;
+	ofs << "matchMemoHits: " << library->matchMemo.hits << endl;
+	ofs << "matchMemoEvictions: " << library->matchMemo.evictions << endl;
+	ofs << "aggregateSourcesLockAcquisitions: " << DiscoveryEngine::discoveryAggregateSources.lockStats.acquisitions << endl;
+	ofs << "aggregateSourcesLockContentions: " << DiscoveryEngine::discoveryAggregateSources.lockStats.contentions << endl;
+	ofs << "stringPoolLookups: " << DiscoverySource::stringPool.lookups << endl;
+	ofs << "stringPoolHits: " << DiscoverySource::stringPool.hits << endl;
+	ofs << "scanCacheHits: " << DiscoveryEngine::scanCache.hits << endl;
+	ofs << "scanCacheMisses: " << DiscoveryEngine::scanCache.misses << endl;
+	ofs << "scanCacheWriteFailures: " << DiscoveryEngine::scanCache.writeFailures << endl;
+	ofs << "scanBytesParsed: " << DiscoveryEngine::ProcessScanTask::scanBytesParsed << endl;
+	ofs << "scanParseThroughput (MB/s): " << (DiscoveryEngine::ProcessScanTask::scanParseNanoseconds > 0 ? DiscoveryEngine::ProcessScanTask::scanBytesParsed * 1000.0 / DiscoveryEngine::ProcessScanTask::scanParseNanoseconds : 0) << endl;
 	ofs << "Total (C++): " << time(0) - start << endl << endl;
 	ofs.close();
 
@@ -18,8 +18,36 @@ limitations under the License.
 
 #include "stdafx.h"
 
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <unordered_set>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryAggregateStore.h"
+#include "DiscoveryArena.h"
+#include "DiscoveryBenchmark.h"
+#include "DiscoveryCaseFolding.h"
+#include "DiscoveryGlob.h"
+#include "DiscoveryHash.h"
+#include "DiscoveryLibrarySnapshot.h"
+#include "DiscoveryMatchMemo.h"
+#include "DiscoveryMetrics.h"
+#include "DiscoveryOutputSegment.h"
+#include "DiscoveryPipeline.h"
+#include "DiscoveryRuleIndex.h"
+#include "DiscoveryScanCache.h"
+#include "DiscoveryScanWatcher.h"
+#include "DiscoveryWorkStealingPool.h"
+
 /**
 * The <code>DiscoverySource</code> class represents either addremove, file or pkginst discovery source.
+* It is a compact view, the field bytes live in a DiscoveryArena owned by whoever keeps the source,
+* i.e. a ProcessScanTask or the DiscoveryAggregateSources, while company and product names are interned in stringPool.
 * @author Inferapp
 * @version 1.0
 */
@@ -28,65 +56,269 @@ struct DiscoverySource
 	static size_t moveCtorCalls;
 	static size_t copyCtorCalls;
 
+	/** Fleet wide pool of repeating source strings, shared by all the processing tasks.*/
+	static DiscoveryStringPool stringPool;
+
 	/** 0: file, 1: addremove, 2: pkginst */
 	int sourceTypeID;
 
+	/** Index of the scan path in DiscoveryEngine::scanPaths.*/
+	int sourceScanID;
+
+	/** The value of sourceFileSizeText, -1 when it is empty or not a number parseFileSize accepts.*/
+	long long sourceFileSize;
+
 	/** File name, addremove description, or pkginst name.*/
-	string sourceKeyOriginal;
+	boost::string_ref sourceKeyOriginal;
 	/** File name, addremove description, or pkginst name. Uppercased for key usage.*/
-	string sourceKeyUpperCase;
-
-	string sourceProductVersion;
-	string sourceProductName;
-	string sourceFileVersion;
-	string sourceFileSize;
-	string sourceFilePath;
-	string sourceFileDescription;
-	string sourceCompanyName;
+	boost::string_ref sourceKeyUpperCase;
+
+	boost::string_ref sourceProductVersion;
+	/** Interned.*/
+	boost::string_ref sourceProductName;
+	boost::string_ref sourceFileVersion;
+	/** The file size the way the scan has it, which is what keys and output use, so that no size is changed or lost by being parsed.*/
+	boost::string_ref sourceFileSizeText;
+	boost::string_ref sourceFilePath;
+	boost::string_ref sourceFileDescription;
+	/** Interned.*/
+	boost::string_ref sourceCompanyName;
 	//string sourceInstalledLocation;
 	//string sourceUninstallString;
 	//string sourceOSComponent;
-	string sourceScanPath;
 
-	DiscoverySource() {}
+	DiscoverySource() : sourceTypeID(-1), sourceScanID(-1), sourceFileSize(-1) {}
 
 	// constructor for addremoves
-	DiscoverySource(string& sourceKeyOriginal, string& sourceProductVersion, string& sourceCompanyName) : sourceKeyOriginal(sourceKeyOriginal),
-		sourceKeyUpperCase(std::move(sourceKeyOriginal)), sourceProductVersion(std::move(sourceProductVersion)), sourceCompanyName(std::move(sourceCompanyName))
+	DiscoverySource(DiscoveryArena& arena, boost::string_ref sourceKeyOriginal, boost::string_ref sourceProductVersion, boost::string_ref sourceCompanyName)
+		: sourceTypeID(1), sourceScanID(-1), sourceFileSize(-1), sourceKeyOriginal(arena.store(sourceKeyOriginal)), sourceKeyUpperCase(storeUpperCase(arena, sourceKeyOriginal)),
+		sourceProductVersion(arena.store(sourceProductVersion)), sourceCompanyName(stringPool.intern(sourceCompanyName))
 	{
-		sourceTypeID = 1;
-		to_upper(this->sourceKeyUpperCase);
 	}
 
 	// constructor for files
-	DiscoverySource(string& sourceKeyOriginal, string& sourceProductVersion, string& sourceCompanyName,
-		string& sourceProductName, string& sourceFileDescription, string& sourceFileVersion, string& sourceFileSize,
-		string& sourceFilePath) : sourceKeyOriginal(sourceKeyOriginal),
-		sourceKeyUpperCase(std::move(sourceKeyOriginal)), sourceProductVersion(std::move(sourceProductVersion)), sourceCompanyName(std::move(sourceCompanyName)),
-		sourceProductName(std::move(sourceProductName)), sourceFileDescription(std::move(sourceFileDescription)), sourceFileVersion(std::move(sourceFileVersion)),
-		sourceFileSize(std::move(sourceFileSize)), /* change file size to int, get rid of move */ sourceFilePath(std::move(sourceFilePath))
+	DiscoverySource(DiscoveryArena& arena, boost::string_ref sourceKeyOriginal, boost::string_ref sourceProductVersion, boost::string_ref sourceCompanyName,
+		boost::string_ref sourceProductName, boost::string_ref sourceFileDescription, boost::string_ref sourceFileVersion, boost::string_ref sourceFileSizeText,
+		boost::string_ref sourceFilePath) : sourceTypeID(0), sourceScanID(-1), sourceFileSize(parseFileSize(sourceFileSizeText)),
+		sourceKeyOriginal(arena.store(sourceKeyOriginal)), sourceKeyUpperCase(storeUpperCase(arena, sourceKeyOriginal)), sourceProductVersion(arena.store(sourceProductVersion)),
+		sourceProductName(stringPool.intern(sourceProductName)), sourceFileVersion(arena.store(sourceFileVersion)), sourceFileSizeText(arena.store(sourceFileSizeText)), sourceFilePath(arena.store(sourceFilePath)),
+		sourceFileDescription(arena.store(sourceFileDescription)), sourceCompanyName(stringPool.intern(sourceCompanyName))
 	{
-		sourceTypeID = 0;
-		to_upper(this->sourceKeyUpperCase);
 	}
 
-	// copy constructor
-	DiscoverySource(const DiscoverySource& source) : sourceTypeID(source.sourceTypeID), sourceKeyOriginal(source.sourceKeyOriginal), sourceKeyUpperCase(source.sourceKeyUpperCase),
-		sourceProductVersion(source.sourceProductVersion), sourceProductName(source.sourceProductName), sourceFileVersion(source.sourceFileVersion),
-		sourceFileSize(source.sourceFileSize), sourceFilePath(source.sourceFilePath), sourceFileDescription(source.sourceFileDescription),
-		sourceCompanyName(source.sourceCompanyName), sourceScanPath(source.sourceScanPath)
+	// copy constructor, the copy shares the field bytes with the source
+	DiscoverySource(const DiscoverySource& source) : sourceTypeID(source.sourceTypeID), sourceScanID(source.sourceScanID), sourceFileSize(source.sourceFileSize),
+		sourceKeyOriginal(source.sourceKeyOriginal), sourceKeyUpperCase(source.sourceKeyUpperCase), sourceProductVersion(source.sourceProductVersion),
+		sourceProductName(source.sourceProductName), sourceFileVersion(source.sourceFileVersion), sourceFileSizeText(source.sourceFileSizeText), sourceFilePath(source.sourceFilePath),
+		sourceFileDescription(source.sourceFileDescription), sourceCompanyName(source.sourceCompanyName)
 	{
 		++copyCtorCalls;
 	}
 
 	// move constructor
-	DiscoverySource(DiscoverySource&& source) : sourceTypeID(source.sourceTypeID), sourceKeyOriginal(std::move(source.sourceKeyOriginal)), sourceKeyUpperCase(std::move(source.sourceKeyUpperCase)),
-		sourceProductVersion(std::move(source.sourceProductVersion)), sourceProductName(std::move(source.sourceProductName)), sourceFileVersion(std::move(source.sourceFileVersion)),
-		sourceFileSize(std::move(source.sourceFileSize)), sourceFilePath(std::move(source.sourceFilePath)), sourceFileDescription(std::move(source.sourceFileDescription)),
-		sourceCompanyName(std::move(source.sourceCompanyName)), sourceScanPath(std::move(source.sourceScanPath))
+	DiscoverySource(DiscoverySource&& source) : sourceTypeID(source.sourceTypeID), sourceScanID(source.sourceScanID), sourceFileSize(source.sourceFileSize),
+		sourceKeyOriginal(source.sourceKeyOriginal), sourceKeyUpperCase(source.sourceKeyUpperCase), sourceProductVersion(source.sourceProductVersion),
+		sourceProductName(source.sourceProductName), sourceFileVersion(source.sourceFileVersion), sourceFileSizeText(source.sourceFileSizeText), sourceFilePath(source.sourceFilePath),
+		sourceFileDescription(source.sourceFileDescription), sourceCompanyName(source.sourceCompanyName)
 	{
 		++moveCtorCalls;
 	}
+
+	/** Returns a copy whose field bytes are stored in the given arena, so that it does not depend on the arena of this source.*/
+	DiscoverySource storedIn(DiscoveryArena& arena) const
+	{
+		DiscoverySource source(*this);
+		source.sourceKeyOriginal = arena.store(sourceKeyOriginal);
+		source.sourceKeyUpperCase = arena.store(sourceKeyUpperCase);
+		source.sourceProductVersion = arena.store(sourceProductVersion);
+		source.sourceProductName = stringPool.intern(sourceProductName);
+		source.sourceFileVersion = arena.store(sourceFileVersion);
+		source.sourceFileSizeText = arena.store(sourceFileSizeText);
+		source.sourceFilePath = arena.store(sourceFilePath);
+		source.sourceFileDescription = arena.store(sourceFileDescription);
+		source.sourceCompanyName = stringPool.intern(sourceCompanyName);
+		return source;
+	}
+
+	static boost::string_ref storeUpperCase(DiscoveryArena& arena, boost::string_ref value)
+	{
+		char* copy = arena.allocate(value);
+		DiscoveryCaseFolding::toUpper(copy, value.size());
+		return boost::string_ref(copy, value.size());
+	}
+
+	/**
+	* Parses a file size, returns -1 unless it is a number written the one way to_string would write it, without leading zeros,
+	* so that two sizes have the same value only when they have the same text. 18 digits at most, which cannot overflow.
+	*/
+	static long long parseFileSize(boost::string_ref value)
+	{
+		if (value.empty() || value.size() > 18 || (value[0] == '0' && value.size() > 1))
+			return -1;
+		long long fileSize = 0;
+		for (auto it = value.begin(); it != value.end(); it++)
+			if (*it >= '0' && *it <= '9')
+				fileSize = fileSize * 10 + (*it - '0');
+			else
+				return -1;
+		return fileSize;
+	}
+};
+
+/**
+* The <code>DiscoveryAggregateSourceKey</code> class is the key of aggregate sources: sourceTypeID, sourceKeyUpperCase and the other attributes
+* but the file path, as field views with a 128 bit hash of them all. Each field is hashed on its own, chained, so the fields cannot run into each other.
+* The field bytes are not owned, the key of a stored source points to the source's bytes, a key for lookup to the scan line being parsed,
+* so looking a source up costs neither an allocation nor a copy.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateSourceKey
+{
+	DiscoveryHash128 hash;
+	int sourceTypeID;
+	boost::string_ref sourceKeyUpperCase;
+	boost::string_ref sourceProductVersion;
+	boost::string_ref sourceCompanyName;
+	boost::string_ref sourceProductName;
+	boost::string_ref sourceFileDescription;
+	boost::string_ref sourceFileVersion;
+	boost::string_ref sourceFileSizeText;
+
+	explicit DiscoveryAggregateSourceKey(const DiscoverySource& source) : sourceTypeID(source.sourceTypeID),
+		sourceKeyUpperCase(source.sourceKeyUpperCase), sourceProductVersion(source.sourceProductVersion), sourceCompanyName(source.sourceCompanyName),
+		sourceProductName(source.sourceProductName), sourceFileDescription(source.sourceFileDescription), sourceFileVersion(source.sourceFileVersion),
+		sourceFileSizeText(source.sourceFileSizeText)
+	{
+		hash = DiscoveryHash128(static_cast<uint64_t>(sourceTypeID), 0);
+		const boost::string_ref* fields[] = { &sourceKeyUpperCase, &sourceProductVersion, &sourceCompanyName, &sourceProductName, &sourceFileDescription, &sourceFileVersion, &sourceFileSizeText };
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+			hash = DiscoveryHash128::of(fields[i]->data(), fields[i]->size(), hash);
+	}
+
+	/** The key of a copy of the source, whose hash is already known.*/
+	DiscoveryAggregateSourceKey(const DiscoverySource& source, const DiscoveryHash128& hash) : hash(hash), sourceTypeID(source.sourceTypeID),
+		sourceKeyUpperCase(source.sourceKeyUpperCase), sourceProductVersion(source.sourceProductVersion), sourceCompanyName(source.sourceCompanyName),
+		sourceProductName(source.sourceProductName), sourceFileDescription(source.sourceFileDescription), sourceFileVersion(source.sourceFileVersion),
+		sourceFileSizeText(source.sourceFileSizeText)
+	{
+	}
+
+	bool operator==(const DiscoveryAggregateSourceKey& other) const
+	{
+		return hash == other.hash && sourceTypeID == other.sourceTypeID
+			&& sourceKeyUpperCase == other.sourceKeyUpperCase && sourceProductVersion == other.sourceProductVersion && sourceCompanyName == other.sourceCompanyName
+			&& sourceProductName == other.sourceProductName && sourceFileDescription == other.sourceFileDescription && sourceFileVersion == other.sourceFileVersion
+			&& sourceFileSizeText == other.sourceFileSizeText;
+	}
+};
+
+struct DiscoveryAggregateSourceKeyHash
+{
+	size_t operator()(const DiscoveryAggregateSourceKey& key) const
+	{
+		return static_cast<size_t>(key.hash.low);
+	}
+};
+
+/**
+* The <code>DiscoveryAggregateSources</code> container is a map of unique sources split into shards by key hash,
+* each with its own mutex and arena for the field bytes, so that the processing tasks only contend when they hit the same shard.
+* When several scans contain the same source, the one from the scan with the lowest scan ID is kept, i.e. the first scan path in order,
+* which makes the aggregate independent of the order in which the tasks happen to run. The daemon registers scans as they land, see runDaemon.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateSources
+{
+	static const size_t shardCount = 64;
+
+	struct Shard
+	{
+		mutex mutexShard;
+		unordered_map<DiscoveryAggregateSourceKey, DiscoverySource, DiscoveryAggregateSourceKeyHash> sources;
+		/** Bytes of replaced sources are not reclaimed, which is fine as long as replacements are rare.*/
+		DiscoveryArena arena;
+	};
+
+	Shard shards[shardCount];
+
+	/** Of all the shard mutexes together.*/
+	DiscoveryLockStats lockStats;
+
+	/**
+	* Adds a copy of the source found in the scan sourceScanID unless it is already there from a scan which comes first.
+	* The source may be a view of a scan line, the copy is only made when it is actually added.
+	* Returns the hash of the source's key, which is what DiscoveryAggregateProvenance knows the source by.
+	*/
+	DiscoveryHash128 insert(const DiscoverySource& source, int sourceScanID)
+	{
+		DiscoveryAggregateSourceKey key(source);
+		Shard& shard = shards[key.hash.high % shardCount];
+
+		lockStats.lock(shard.mutexShard);
+		mutex::scoped_lock lock(shard.mutexShard, boost::adopt_lock);
+
+		auto it = shard.sources.find(key);
+		if (it != shard.sources.end())
+		{
+			if (sourceScanID >= it->second.sourceScanID)
+				return key.hash;
+			shard.sources.erase(it);
+		}
+		DiscoverySource storedSource = source.storedIn(shard.arena);
+		storedSource.sourceScanID = sourceScanID;
+		shard.sources.insert(make_pair(DiscoveryAggregateSourceKey(storedSource, key.hash), storedSource));
+		return key.hash;
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < shardCount; i++)
+		{
+			shards[i].sources.clear();
+			shards[i].arena = DiscoveryArena();
+		}
+	}
+};
+
+/**
+* The <code>DiscoverySourceIDs</code> container is a set of the source IDs of the normalized output split into shards by hash,
+* each with its own mutex, so that each source is written to the sources dimension once, by whichever task matches it first.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoverySourceIDs
+{
+	static const size_t shardCount = 64;
+
+	struct Shard
+	{
+		mutex mutexShard;
+		unordered_set<DiscoveryHash128, DiscoveryHash128Hash> sourceIDs;
+	};
+
+	Shard shards[shardCount];
+
+	/** Of all the shard mutexes together.*/
+	DiscoveryLockStats lockStats;
+
+	/** Returns false when the source ID is already there.*/
+	bool insert(const DiscoveryHash128& sourceID)
+	{
+		Shard& shard = shards[sourceID.high % shardCount];
+
+		lockStats.lock(shard.mutexShard);
+		mutex::scoped_lock lock(shard.mutexShard, boost::adopt_lock);
+
+		return shard.sourceIDs.insert(sourceID).second;
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < shardCount; i++)
+			shards[i].sourceIDs.clear();
+	}
 };
 
 /**
@@ -96,39 +328,112 @@ struct DiscoverySource
 */
 struct DiscoveryRule
 {
+	/** Number of wildcard patterns compiled by loadDiscoveryRules.*/
+	static atomic<size_t> globCompilations;
+	/** Number of wildcard pattern matches performed by all the processing tasks.*/
+	static atomic<size_t> globEvaluations;
+
 	int versionID;
 	int buildID;
 
 	/** 0: Autonumber.*/
 	int ruleID;
 
+	/** Dense index of the rule among the rules of its buildID, in ruleID order, and the number of those rules.*/
+	int buildRuleIndex;
+	int buildRuleCount;
+
 	/** 0: file, 1: addremove, 2: pkginst */
 	int sourceTypeID;
 
+	/**
+	* The string attributes below point either into DiscoveryLibrary::arena, when the library was loaded from the text files,
+	* or into the mapped DiscoveryLibrary::snapshot.
+	*/
+
 	/** File name, addremove description, or pkginst name. Uppercased for key usage.*/
-	string ruleKeyUpperCase;
+	boost::string_ref ruleKeyUpperCase;
 	/** File name, addremove description, or pkginst name.*/
-	string ruleKeyOriginal;
+	boost::string_ref ruleKeyOriginal;
 
-	/** Simple glob style wildcard allowed, replaced with .* for regex matching.*/
-	string ruleProductVersion;
-	bool isRuleProductVersionRegex;
+	/** Simple glob style wildcard allowed, matched case sensitively.*/
+	boost::string_ref ruleProductVersion;
+	bool isRuleProductVersionGlob;
+
+	/** Simple glob style wildcard allowed, matched case insensitively.*/
+	boost::string_ref ruleProductName;
+	bool isRuleProductNameGlob;
+
+	/** Simple glob style wildcard allowed, matched case sensitively.*/
+	boost::string_ref ruleFileVersion;
+	bool isRuleFileVersionGlob;
+
+	/** Empty when the rule does not check file size.*/
+	boost::string_ref ruleFileSizeText;
+	/** The value of ruleFileSizeText, -1 when it is not a number parseFileSize accepts, see matchesFileSize.*/
+	long long ruleFileSize;
+
+	/**
+	* Simple glob style wildcard allowed, matched case insensitively.
+	* Always a glob whenever nonempty so no need for a separate boolean.
+	*/
+	boost::string_ref ruleFilePath;
+
+	/**
+	* Compiled counterparts of the above glob attributes, built once in loadDiscoveryRules
+	* and shared read-only by all the processing tasks. Only valid when the respective attribute is a glob.
+	*/
+	DiscoveryGlob ruleProductVersionGlob;
+	DiscoveryGlob ruleProductNameGlob;
+	DiscoveryGlob ruleFileVersionGlob;
+	DiscoveryGlob ruleFilePathGlob;
 
-	/** Simple glob style wildcard allowed, replaced with .* for regex matching. Case insensitivity is provided by ECMAScript | icase switch in regex constructor.*/
-	string ruleProductName;
-	bool isRuleProductNameRegex;
+	/** Sets the glob flags and compiles the glob attributes, once all the attributes are set.*/
+	void compileGlobs()
+	{
+		// simple glob style wildcard allowed, compiled for case sensitive glob matching
+		isRuleProductVersionGlob = ruleProductVersion.find('*') != boost::string_ref::npos;
+		if (isRuleProductVersionGlob)
+			ruleProductVersionGlob = compileGlob(ruleProductVersion, false);
+
+		// simple glob style wildcard allowed, compiled for case insensitive glob matching
+		isRuleProductNameGlob = ruleProductName.find('*') != boost::string_ref::npos;
+		if (isRuleProductNameGlob)
+			ruleProductNameGlob = compileGlob(ruleProductName, true);
+
+		// simple glob style wildcard allowed, compiled for case sensitive glob matching
+		isRuleFileVersionGlob = ruleFileVersion.find('*') != boost::string_ref::npos;
+		if (isRuleFileVersionGlob)
+			ruleFileVersionGlob = compileGlob(ruleFileVersion, false);
+
+		// simple glob style wildcard allowed, compiled for case insensitive glob matching
+		// rule file path is always a glob whenever present so no need to set a separate boolean as in the previous ones
+		if (!ruleFilePath.empty())
+			ruleFilePathGlob = compileGlob(ruleFilePath, true);
+	}
 
-	/** Simple glob style wildcard allowed, replaced with .* for regex matching.*/
-	string ruleFileVersion;
-	bool isRuleFileVersionRegex;
+	static DiscoveryGlob compileGlob(boost::string_ref pattern, bool caseInsensitive)
+	{
+		++globCompilations;
+		return DiscoveryGlob(pattern, caseInsensitive);
+	}
 
-	string ruleFileSize;
+	static bool matchGlob(boost::string_ref value, const DiscoveryGlob& glob)
+	{
+		++globEvaluations;
+		return glob.matches(value.data(), value.size());
+	}
 
 	/**
-	* Simple glob style wildcard allowed, replaced with .* for regex matching. Case insensitivity is provided by ECMAScript | icase switch in regex constructor.
-	* Always a regex whenever nonempty so no need for a separate boolean.
+	* Whether the source has the rule's file size, by value when both sizes are numbers parseFileSize accepts,
+	* otherwise by text, so that a size written any other way, e.g. "1,234", still matches the same text.
 	*/
-	string ruleFilePath;
+	bool matchesFileSize(const DiscoverySource& source) const
+	{
+		if (ruleFileSize >= 0 && source.sourceFileSize >= 0)
+			return source.sourceFileSize == ruleFileSize;
+		return source.sourceFileSizeText == ruleFileSizeText;
+	}
 };
 
 // index tags for DiscoveryRules
@@ -150,17 +455,19 @@ typedef multi_index_container<
 	composite_key<
 	DiscoveryRule,
 	member<DiscoveryRule, int, &DiscoveryRule::sourceTypeID>,
-	member<DiscoveryRule, string, &DiscoveryRule::ruleKeyUpperCase>,
-	member<DiscoveryRule, string, &DiscoveryRule::ruleProductVersion>
-	>
+	member<DiscoveryRule, boost::string_ref, &DiscoveryRule::ruleKeyUpperCase>,
+	member<DiscoveryRule, boost::string_ref, &DiscoveryRule::ruleProductVersion>
+	>,
+	composite_key_hash<boost::hash<int>, DiscoveryStringRefHash, DiscoveryStringRefHash>
 	>,
 	hashed_non_unique<
 	tag<BySourceTypeIDRuleKey>,
 	composite_key<
 	DiscoveryRule,
 	member<DiscoveryRule, int, &DiscoveryRule::sourceTypeID>,
-	member<DiscoveryRule, string, &DiscoveryRule::ruleKeyUpperCase>
-	>
+	member<DiscoveryRule, boost::string_ref, &DiscoveryRule::ruleKeyUpperCase>
+	>,
+	composite_key_hash<boost::hash<int>, DiscoveryStringRefHash>
 	>,
 	hashed_non_unique<
 	tag<ByBuildID>,
@@ -171,11 +478,6 @@ typedef multi_index_container<
 
 /**
 * The <code>DiscoveryMatch</code> class stores a single match between a rule and a source.
-* It also provides a natural order by rule.ruleID.
-* This is required for use in DiscoveryResult, which has a set of DiscoveryMatches,
-* and we only care for the first match against any unique DiscoveryRule,
-* so this natural ordering of DiscoveryMatch by rule.ruleID effectively prevents
-* adding more than one DiscoveryMatch with same DiscoveryRule.ruleID under given DiscoveryResult.
 * @author Inferapp
 * @version 1.0
 */
@@ -183,16 +485,89 @@ struct DiscoveryMatch
 {
 	DiscoveryRule* rule;
 	DiscoverySource* source;
+	DiscoveryMatch() : rule(nullptr), source(nullptr) {}
 	DiscoveryMatch(DiscoveryRule* rule, DiscoverySource* source) : rule(rule), source(source) {}
+};
+
+/**
+* The <code>DiscoveryMatches</code> class stores the matches of rules of a single buildID.
+* We only care for the first match against any unique DiscoveryRule, so the matches are kept in a bitset
+* by the rule's buildRuleIndex, which makes "all the rules of the buildID matched" a popcount compare,
+* plus the first DiscoveryMatch of each matched rule at the same index, which enumerates them in ruleID order.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryMatches
+{
+	/** Bit i is set when the rule with buildRuleIndex i has matched, the first 64 rules are inline.*/
+	uint64_t bits;
+	vector<uint64_t> moreBits;
+
+	/** Indexed by buildRuleIndex, the rule is nullptr where there is no match.*/
+	vector<DiscoveryMatch> matches;
+
+	/** buildRuleCount of the rules.*/
+	int ruleCount;
+
+	DiscoveryMatches() : bits(0), ruleCount(0) {}
+
+	bool contains(int buildRuleIndex) const
+	{
+		if (buildRuleIndex < 64)
+			return (bits >> buildRuleIndex & 1) != 0;
+		size_t word = buildRuleIndex / 64 - 1;
+		return word < moreBits.size() && (moreBits[word] >> buildRuleIndex % 64 & 1) != 0;
+	}
+
+	/** Adds the match unless there already is one for its rule.*/
+	void insert(const DiscoveryMatch& match)
+	{
+		int buildRuleIndex = match.rule->buildRuleIndex;
+		if (contains(buildRuleIndex))
+			return;
+
+		if (buildRuleIndex < 64)
+			bits |= uint64_t(1) << buildRuleIndex;
+		else
+		{
+			moreBits.resize(max(moreBits.size(), static_cast<size_t>(buildRuleIndex / 64)));
+			moreBits[buildRuleIndex / 64 - 1] |= uint64_t(1) << buildRuleIndex % 64;
+		}
 
-	/** Natural order by rule.ruleID.*/
-	bool operator<(DiscoveryMatch other) const {
-		return rule->ruleID < other.rule->ruleID;
+		if (matches.empty())
+		{
+			ruleCount = match.rule->buildRuleCount;
+			matches.resize(ruleCount);
+		}
+		matches[buildRuleIndex] = match;
+	}
+
+	/** Adds the matches of other for rules which have not matched yet.*/
+	void insert(const DiscoveryMatches& other)
+	{
+		for (auto it = other.matches.begin(); it != other.matches.end(); it++)
+			if (it->rule != nullptr)
+				insert(*it);
+	}
+
+	/** Number of rules matched.*/
+	int size() const
+	{
+		size_t count = bitset<64>(bits).count();
+		for (auto it = moreBits.begin(); it != moreBits.end(); it++)
+			count += bitset<64>(*it).count();
+		return static_cast<int>(count);
+	}
+
+	/** True when all the rules of the buildID matched.*/
+	bool isComplete() const
+	{
+		return ruleCount > 0 && size() == ruleCount;
 	}
 };
 
 /**
-* The <code>DiscoveryResult</code> class stores a set of discovery matches for a path/versionID/buildID.
+* The <code>DiscoveryResult</code> class stores the discovery matches for a path/versionID/buildID.
 * @author Inferapp
 * @version 1.0
 */
@@ -201,7 +576,7 @@ struct DiscoveryResult
 	string path;
 	int versionID;
 	int buildID;
-	set<DiscoveryMatch> discoveryMatches;
+	DiscoveryMatches discoveryMatches;
 	DiscoveryResult(string path, int versionID, int buildID) : path(path), versionID(versionID), buildID(buildID) {}
 };
 
@@ -240,47 +615,215 @@ struct DiscoveryAggregateResult
 	int count;
 	string scanPath;
 	DiscoveryAggregateResult(string detectionPath, int versionID, int buildID, int count, string scanPath) : detectionPath(detectionPath), versionID(versionID), buildID(buildID), count(count), scanPath(scanPath) {}
+
+	/** Adds one more occurrence of the same result, keeping the scanPath which comes first.*/
+	void add(boost::string_ref otherDetectionPath, const string& otherScanPath)
+	{
+		count++;
+		if (otherScanPath < scanPath)
+		{
+			detectionPath.assign(otherDetectionPath.data(), otherDetectionPath.size());
+			scanPath = otherScanPath;
+		}
+	}
+
+	/** Adds up counts of the same result from another aggregate, keeping the scanPath which comes first.*/
+	void merge(const DiscoveryAggregateResult& other)
+	{
+		count += other.count;
+		if (other.scanPath < scanPath)
+		{
+			detectionPath = other.detectionPath;
+			scanPath = other.scanPath;
+		}
+	}
+};
+
+/**
+* The <code>DiscoveryAggregateResultKey</code> class is the key of aggregate discovery results:
+* buildID and uppercased detectionPath (no need for versionID because buildID uniquely determines versionID).
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryAggregateResultKey
+{
+	int buildID;
+	string detectionPathUpperCase;
+	/** Of buildID and detectionPathUpperCase.*/
+	DiscoveryHash128 hash;
+
+	DiscoveryAggregateResultKey() : buildID(0) {}
+
+	DiscoveryAggregateResultKey(int buildID, boost::string_ref detectionPath)
+	{
+		assign(buildID, detectionPath);
+	}
+
+	/** Reuses the buffer of detectionPathUpperCase, so a key kept for lookups stops allocating once it has seen the longest path.*/
+	void assign(int buildID, boost::string_ref detectionPath)
+	{
+		this->buildID = buildID;
+		DiscoveryCaseFolding::assignUpper(detectionPathUpperCase, detectionPath);
+		hash = DiscoveryHash128::of(detectionPathUpperCase.data(), detectionPathUpperCase.size(), DiscoveryHash128(static_cast<uint64_t>(buildID), 0));
+	}
+
+	bool operator==(const DiscoveryAggregateResultKey& other) const
+	{
+		return hash == other.hash && buildID == other.buildID && detectionPathUpperCase == other.detectionPathUpperCase;
+	}
+
+	/** Natural order by buildID, then detectionPathUpperCase, which makes the saved aggregate results deterministic.*/
+	bool operator<(const DiscoveryAggregateResultKey& other) const
+	{
+		return buildID < other.buildID || (buildID == other.buildID && detectionPathUpperCase < other.detectionPathUpperCase);
+	}
+};
+
+struct DiscoveryAggregateResultKeyHash
+{
+	size_t operator()(const DiscoveryAggregateResultKey& key) const
+	{
+		return static_cast<size_t>(key.hash.low);
+	}
+};
+
+/** Partial aggregate of discovery results built by a single worker thread without locking.*/
+typedef unordered_map<DiscoveryAggregateResultKey, DiscoveryAggregateResult, DiscoveryAggregateResultKeyHash> DiscoveryWorkerAggregateResults;
+
+/**
+* The <code>DiscoveryVERClosure</code> class is the transitive closure of the version exclusion rules,
+* i.e. for each excluded versionID all the versionIDs which exclude it either directly or via a chain of rules.
+* The excluders of all the versions are kept sorted in a single vector, each version has its range within it.
+* Built once after the rules are loaded, read only afterwards, so it can be shared by all the processing tasks.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryVERClosure
+{
+	/** Offset/length of each excluded version's excluders within excludingVersionIDs.*/
+	unordered_map<int, pair<size_t, size_t>> ranges;
+
+	vector<int> excludingVersionIDs;
+
+	/**
+	* Versions which exclude themselves via a chain of rules. A version is never in its own range,
+	* so out of the versions of a cycle found on the same path, the one checked last survives.
+	*/
+	vector<int> cyclicVersionIDs;
+
+	/** Builds the closure of the rules, the key is excludedVersionID, the value is versionID.*/
+	void build(const unordered_multimap<int, int>& rules)
+	{
+		clear();
+
+		// sorted, so that the ranges are laid out and the cycles are reported in a stable order
+		vector<int> excludedVersionIDs;
+		for (auto it = rules.begin(); it != rules.end(); it++)
+			excludedVersionIDs.push_back(it->first);
+		sort(excludedVersionIDs.begin(), excludedVersionIDs.end());
+		excludedVersionIDs.erase(unique(excludedVersionIDs.begin(), excludedVersionIDs.end()), excludedVersionIDs.end());
+
+		// a walk with an explicit stack and a visited set per version, so neither long chains nor cycles can exhaust the stack
+		for (auto itVersion = excludedVersionIDs.begin(); itVersion != excludedVersionIDs.end(); itVersion++)
+		{
+			unordered_set<int> visited;
+			vector<int> pending(1, *itVersion);
+			bool isCyclic = false;
+			while (!pending.empty())
+			{
+				auto range = rules.equal_range(pending.back());
+				pending.pop_back();
+				for (auto itRule = range.first; itRule != range.second; itRule++)
+					if (itRule->second == *itVersion)
+						isCyclic = true;
+					else if (visited.insert(itRule->second).second)
+						pending.push_back(itRule->second);
+			}
+
+			size_t offset = excludingVersionIDs.size();
+			excludingVersionIDs.insert(excludingVersionIDs.end(), visited.begin(), visited.end());
+			sort(excludingVersionIDs.begin() + offset, excludingVersionIDs.end());
+			ranges.insert(make_pair(*itVersion, make_pair(offset, excludingVersionIDs.size() - offset)));
+			if (isCyclic)
+				cyclicVersionIDs.push_back(*itVersion);
+		}
+	}
+
+	/** True when any of the versions which exclude versionID is among presentVersionIDs, which must be sorted.*/
+	bool isExcluded(int versionID, const vector<int>& presentVersionIDs) const
+	{
+		auto itRange = ranges.find(versionID);
+		if (itRange == ranges.end())
+			return false;
+
+		// both sides are sorted, so walk them together like set_intersection, but stop at the first common version
+		auto itExcluding = excludingVersionIDs.begin() + itRange->second.first;
+		auto itExcludingEnd = itExcluding + itRange->second.second;
+		auto itPresent = presentVersionIDs.begin();
+		while (itExcluding != itExcludingEnd && itPresent != presentVersionIDs.end())
+			if (*itExcluding < *itPresent)
+				itExcluding++;
+			else if (*itPresent < *itExcluding)
+				itPresent++;
+			else
+				return true;
+		return false;
+	}
+
+	void clear()
+	{
+		ranges.clear();
+		excludingVersionIDs.clear();
+		cyclicVersionIDs.clear();
+	}
 };
 
 /**
 * The <code>DiscoverySignature</code> class stores publisher, product and version fields,
-* used for verbose software discovery results.
+* used for verbose software discovery results. Its strings live where the rules' do, see DiscoveryRule.
 * @author Inferapp
 * @version 1.0
 */
 struct DiscoverySignature
 {
 	int publisherID;
-	string publisherName;
-	string webPage;
+	boost::string_ref publisherName;
+	boost::string_ref webPage;
 	int productID;
-	string productName;
-	string productLicensable;
-	string productCategory;
+	boost::string_ref productName;
+	boost::string_ref productLicensable;
+	boost::string_ref productCategory;
 	int versionID;
-	string uniqueVersion;
-	string build;
-	string major;
-	string minor;
-	string edition;
-	string variation;
-	string licenseVersion;
+	boost::string_ref uniqueVersion;
+	boost::string_ref build;
+	boost::string_ref major;
+	boost::string_ref minor;
+	boost::string_ref edition;
+	boost::string_ref variation;
+	boost::string_ref licenseVersion;
 };
 
 /**
-* The <code>DiscoveryEngine</code> has a static container for discovery rules
-* as well as static aggregates for sources and results, which are shared by all the tasks,
-* which are instances of its ProcessScanTask nested static class.
+* The <code>DiscoveryLibrary</code> class is a loaded rule library: the rules, the version exclusion rules and the signatures,
+* along with the memory their strings live in and the memo of the rules matching each source, which points into the rules.
+* Once loaded nothing but matchMemo changes, a reload loads a whole new library instead,
+* which the tasks started after it use, while the tasks started before keep theirs alive until they are done.
 * @author Inferapp
 * @version 1.0
 */
-struct DiscoveryEngine
+struct DiscoveryLibrary
 {
 	/**
 	* discoveryRules stores discovery rules,
 	* shared by all the processing threads, see the container's class definition for details.
 	*/
-	static DiscoveryRules discoveryRules;
+	DiscoveryRules discoveryRules;
+
+	/**
+	* ruleIndex is discoveryRules' BySourceTypeIDRuleKey index frozen by loadDiscoveryLibrary into an open addressing table,
+	* which the processing tasks look the sources up in, see the class definition for details.
+	*/
+	DiscoveryRuleIndex ruleIndex;
 
 	/**
 	* discoveryVERs stores version exclusion rules,
@@ -288,346 +831,1020 @@ struct DiscoveryEngine
 	* The key is excludedVersionID, the value is versionID.
 	* The same excludedVersionID may be excluded by many different versionIDs, hence multimap.
 	*/
-	static unordered_multimap<int, int> discoveryVERs;
+	unordered_multimap<int, int> discoveryVERs;
+
+	/**
+	* discoveryVERClosure is discoveryVERs compiled into its transitive closure by loadDiscoveryRules,
+	* used by the processing tasks, see the class definition for details.
+	*/
+	DiscoveryVERClosure discoveryVERClosure;
 
 	/**
 	* discoverySignatures is a lookup for verbose software discovery results,
 	* shared by all the processing tasks
 	* The key is versionID.
 	*/
-	static unordered_map<int, DiscoverySignature> discoverySignatures;
+	unordered_map<int, DiscoverySignature> discoverySignatures;
 
 	/**
-	* discoveryAggregateSources is an aggregate of all unique sources (addremoves/files/pkginsts),
-	* shared by all the processing tasks.
-	* The key is concatenation of:
-	* for addremoves: sourceKeyUpperCase + sourceProductVersion + sourceCompanyName
-	* for files: sourceKeyUpperCase + sourceProductVersion + sourceCompanyName + sourceProductName
-	* + sourceFileDescription + sourceFileVersion + sourceFileSize
+	* arena keeps the strings of the rules and the signatures when they were loaded from the text files,
+	* otherwise they point into snapshot, which then stays mapped as long as the library is in use.
 	*/
-	static unordered_map<string, DiscoverySource> discoveryAggregateSources;
-	static mutex mutexDiscoveryAggregateSources;
+	DiscoveryArena arena;
+	DiscoveryLibrarySnapshot snapshot;
 
 	/**
-	* discoveryAggregateResults is an aggregate of all discovery results, unique by detectionPath/versionID/buildID,
-	* shared by all the processing tasks.
-	* The key is buildID + uppercased detectionPath (no need for versionID because buildID uniquely determines versionID).
+	* matchMemo remembers which rules match a source regardless of its file path,
+	* shared by all the processing tasks, see the class definition for details.
 	*/
-	static unordered_map<string, DiscoveryAggregateResult> discoveryAggregateResults;
-	static mutex mutexDiscoveryAggregateResults;
+	DiscoveryMatchMemo matchMemo;
 
-	// for saving scan-specific results
-	static mutex mutexDiscoveryResults;
+	/** Identifies the text files the library was loaded from, for the scan cache and for noticing they have changed.*/
+	DiscoveryHash128 version;
+
+	/** How the library was loaded by loadDiscoveryLibrary and how long it took, logged at the end of the run.*/
+	bool isLoadedFromSnapshot;
+	long long loadNanoseconds;
+
+	DiscoveryLibrary() : isLoadedFromSnapshot(false), loadNanoseconds(0) {}
+};
 
+/**
+* The <code>DiscoveryResultWriter</code> class has a single worker thread's segments of the scan-specific results files,
+* see the segment's class definition for details.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryResultWriter
+{
+	DiscoveryOutputSegment results;
+	DiscoveryOutputSegment resultsVerboseAddremoves;
+	DiscoveryOutputSegment resultsVerboseFiles;
+	DiscoveryOutputSegment normalizedMatches;
+	DiscoveryOutputSegment normalizedSources;
+
+	DiscoveryResultWriter(const string& resultsDirectory, int workerID) : results(resultsDirectory + "results.txt", workerID),
+		resultsVerboseAddremoves(resultsDirectory + "results_verbose_addremoves.txt", workerID), resultsVerboseFiles(resultsDirectory + "results_verbose_files.txt", workerID),
+		normalizedMatches(resultsDirectory + "normalized_matches.txt", workerID), normalizedSources(resultsDirectory + "normalized_sources.txt", workerID) {}
+};
 
+/**
+* The <code>DiscoveryEngine</code> has a static container for discovery rules
+* as well as static aggregates for sources and results, which are shared by all the tasks,
+* which are instances of its ProcessScanTask nested static class.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryEngine
+{
 	/**
-	* The <code>ProcessScanTask</code> static class is nested within DiscoveryEngine
-	* so that it has access to its static containers, shared by all the tasks.
-	* It is instantiated for each task.
-	* @author Inferapp
-	* @version 1.0
+	* rootPath is the directory with the library, scans, results, logs and cache directories, s:\ unless set from the command line.
 	*/
-	static struct ProcessScanTask
-	{
-		/** The scan to be processed by the task.*/
-		string sourceScanPath;
+	static string rootPath;
 
-		/** Input scan data, i.e. addremoves/files/pkginsts. We just need one simple iteration in any order so ArrayList is sufficient.*/
-		vector<DiscoverySource> discoveryMachineSources;
+	/**
+	* resultsPath is the directory the results are written to, rootPath\results\ unless the run is a shard of a sharded run,
+	* whose partial results go to rootPath\shards\<shard index>\ to be merged by mergeShards.
+	*/
+	static string resultsPath;
 
-		/** The container to build discovery results for the scan, see the container's class definition for details.*/
-		DiscoveryResults discoveryMachineResults;
+	/** The run only processes the scans of shard shardIndex of shardCount, see isScanInShard.*/
+	static int shardIndex;
+	static int shardCount;
 
-		ProcessScanTask(string sourceScanPath) : sourceScanPath(sourceScanPath) {}
+	/**
+	* isNormalizedOutput is set from the command line. Instead of the verbose results, which repeat the signature and the source for every match,
+	* the run then writes signatures, sources and scans dimensions once and a line of IDs per match, see saveNormalizedMatch,
+	* from which expandNormalizedResults rebuilds the verbose results.
+	*/
+	static bool isNormalizedOutput;
 
-		void operator () ()
+	/**
+	* isIncremental is set from the command line. The run then adds its scans to the aggregates of the previous runs, kept in the aggregate store,
+	* see aggregateStorePath, a scan processed before having its previous contribution replaced, see mergeIngestedScans.
+	* The results files only have the scans of the run, the aggregate files have every scan in the store.
+	*/
+	static bool isIncremental;
+
+	/**
+	* discoveryLibrary is the rule library the processing tasks start with, see the class definition for details.
+	* It is only read and replaced through currentDiscoveryLibrary and publishDiscoveryLibrary, which are atomic,
+	* so a reload waits neither for the tasks in flight nor they for it.
+	*/
+	static shared_ptr<DiscoveryLibrary> discoveryLibrary;
+
+	/**
+	* scanCache keeps the output of each scan processed, by the hash of the scan contents,
+	* so that the scans which have not changed since the last run are not matched again.
+	*/
+	static DiscoveryScanCache scanCache;
+
+	/** Set from the command line, 0 means half the processors, see processAllScans.*/
+	static int configuredWorkerThreadCount;
+	static bool isPinningWorkerThreads;
+
+	/**
+	* Set from the command line, see processAllScansPipelined. The number of matcher threads is the number of worker threads,
+	* the queue depth applies to each of the two queues between the stages.
+	*/
+	static bool isPipelined;
+	static int pipelineReaderCount;
+	static int pipelineWriterCount;
+	static int pipelineQueueDepth;
+
+	/** Set from the command line, how often runDaemon looks for new scans and a changed library, and how often it checkpoints.*/
+	static int daemonPollSeconds;
+	static int daemonCheckpointSeconds;
+
+	/**
+	* scanPaths stores the path of every scan, the index is the scan ID used by DiscoverySource, scanIDs is the reverse lookup.
+	* processAllScans registers its scans in path order, so a lower scan ID means a scan path which comes first.
+	* Only modified while no processing tasks are running.
+	*/
+	static vector<string> scanPaths;
+	static unordered_map<string, int> scanIDs;
+
+	/**
+	* discoveryAggregateSources is an aggregate of all unique sources (addremoves/files/pkginsts),
+	* shared by all the processing tasks, see the container's class definition for details.
+	* The key is made of:
+	* for addremoves: sourceTypeID, sourceKeyUpperCase, sourceProductVersion, sourceCompanyName
+	* for files: sourceTypeID, sourceKeyUpperCase, sourceProductVersion, sourceCompanyName, sourceProductName,
+	* sourceFileDescription, sourceFileVersion, sourceFileSize
+	* see DiscoveryAggregateSourceKey.
+	*/
+	static DiscoveryAggregateSources discoveryAggregateSources;
+
+	/**
+	* discoveryAggregateResults is an aggregate of all discovery results, unique by detectionPath/versionID/buildID,
+	* merged from workerDiscoveryAggregateResults once all the processing tasks are done.
+	* The key is buildID + uppercased detectionPath, see the key's class definition for details.
+	*/
+	static map<DiscoveryAggregateResultKey, DiscoveryAggregateResult> discoveryAggregateResults;
+
+	/**
+	* workerDiscoveryAggregateResults has one partial aggregate of discovery results per worker thread,
+	* so the processing tasks do not need to lock anything to add their results.
+	* A list, because the worker threads keep pointers to their partial aggregates.
+	*/
+	static list<DiscoveryWorkerAggregateResults> workerDiscoveryAggregateResults;
+	// for registering a new worker thread's partial aggregate
+	static mutex mutexDiscoveryAggregateResults;
+	static DiscoveryLockStats lockStatsDiscoveryAggregateResults;
+
+	/**
+	* workerResultWriters has one writer of scan-specific results per worker thread,
+	* processAllScans stitches their output into the results files once all the processing tasks are done.
+	* A list, because the worker threads keep pointers to their writers.
+	*/
+	static list<DiscoveryResultWriter> workerResultWriters;
+	// for registering a new worker thread's writer
+	static mutex mutexDiscoveryResults;
+	static DiscoveryLockStats lockStatsDiscoveryResults;
+
+	/** What each scan has contributed to the aggregates, open while isIncremental, see the class definition for details.*/
+	static DiscoveryAggregateProvenance aggregateProvenance;
+
+	/** The sources already written to the sources dimension of the normalized output, shared by all the processing tasks.*/
+	static DiscoverySourceIDs normalizedSourceIDs;
+
+	/** The metrics of the last processAllScans run, saved to logs\metrics.json at its end.*/
+	static DiscoveryMetrics metrics;
+
+
+	/**
+	* The <code>ProcessScanTask</code> static class is nested within DiscoveryEngine
+	* so that it has access to its static containers, shared by all the tasks.
+	* It is instantiated for each task.
+	* @author Inferapp
+	* @version 1.0
+	*/
+	static struct ProcessScanTask
+	{
+		/** The scan to be processed by the task.*/
+		string sourceScanPath;
+		int sourceScanID;
+
+		/** The library the task matches with from start to end, even when another one is published meanwhile.*/
+		shared_ptr<DiscoveryLibrary> library;
+
+		/** Owns the field bytes of discoveryMachineSources.*/
+		DiscoveryArena arena;
+
+		/** Total size of the scans loaded by all the tasks and the time it took, for scan parsing throughput.*/
+		static atomic<size_t> scanBytesParsed;
+		static atomic<size_t> scanSourcesParsed;
+		static atomic<long long> scanParseNanoseconds;
+
+		/** Written by read, only so that the compiler cannot drop the reads which bring the scan into memory.*/
+		static atomic<char> prefetchedPages;
+
+		/**
+		* Input scan data, i.e. addremoves/files/pkginsts, limited to those matching at least one rule on all attributes but the file path,
+		* which are found as the scan is parsed, so the sources kept are in proportion to the matches rather than to the scan.
+		* We just need one simple iteration in any order so ArrayList is sufficient.
+		*/
+		vector<DiscoverySource> discoveryMachineSources;
+		/** The rules found for each of discoveryMachineSources, as the first index and number of its rules in discoveryMachineSourceRules.*/
+		vector<pair<size_t, size_t>> discoveryMachineSourceRuleRanges;
+		vector<const DiscoveryRule*> discoveryMachineSourceRules;
+
+		/** The container to build discovery results for the scan, see the container's class definition for details.*/
+		DiscoveryResults discoveryMachineResults;
+
+		/** The whole scan is memory mapped, both for hashing and for tokenizing in place, from read until the end of match.*/
+		boost::iostreams::mapped_file_source scan;
+
+		/** The output of the scan as saved to or replayed from scanCache.*/
+		DiscoveryHash128 contentHash;
+		DiscoveryScanCacheEntry cacheEntry;
+		bool isCachingResults;
+		bool isCacheHit;
+
+		/** Added to metrics once the task is done.*/
+		DiscoveryScanMetrics scanMetrics;
+
+		/** Reused for every result added to the aggregate results, so that looking them up does not allocate.*/
+		DiscoveryAggregateResultKey aggregateResultKey;
+
+		/** What the scan adds to the aggregates, only collected while aggregateProvenance is open, which it is handed to once the task is done.*/
+		DiscoveryScanContribution contribution;
+
+		/** Reused for every matched source of the normalized output, see saveNormalizedMatch, and the sources already in cacheEntry.*/
+		string normalizedSource;
+		unordered_set<DiscoveryHash128, DiscoveryHash128Hash> cachedSourceIDs;
+
+		ProcessScanTask(int sourceScanID) : sourceScanPath(scanPaths[sourceScanID]), sourceScanID(sourceScanID), library(currentDiscoveryLibrary()),
+			isCachingResults(false), isCacheHit(false) {}
+
+		/**
+		* The task runs in three stages, which either run one after the other on the same thread,
+		* or on separate threads in the pipeline of processAllScansPipelined.
+		*/
+		void operator () ()
 		{
-			loadScan();
+			if (!read())
+				return;
 
-			processScan();
+			match();
 
-			saveDiscoveryMachineResults();
+			write();
 		}
 
-		void loadScan()
+		/**
+		* Maps the scan and reads it through, looks it up in scanCache, returns false when the scan cannot be opened, e.g. it is still being copied,
+		* in which case it is skipped without waiting for a key, as the daemon's workers run this too.
+		*/
+		bool read()
 		{
-			ifstream ifs(sourceScanPath);
-			if (!ifs)
+			auto start = chrono::steady_clock::now();
+			try {
+				if (filesystem::file_size(sourceScanPath) > 0)
+					scan.open(sourceScanPath);
+			}
+			catch (const std::exception&)
 			{
-				cout << "Error opening scan file" << endl;
-				std::system("pause");
-				return;
+				cout << "Error opening scan file " << sourceScanPath << ", it is skipped" << endl;
+				return false;
+			}
+
+			// an unchanged scan replays its cached output, its sources are still loaded though,
+			// because which scan an aggregate source comes from depends on all the other scans
+			if (scanCache.isOpen())
+			{
+				contentHash = DiscoveryHash128::of(scan.data(), scan.size());
+				isCacheHit = scanCache.load(cacheVersion(), contentHash, cacheEntry);
+				isCachingResults = !isCacheHit;
+			}
+			else
+			{
+				// touch every page, so that match does not wait for the disk
+				char pages = 0;
+				for (size_t i = 0; i < scan.size(); i += 4096)
+					pages ^= scan.data()[i];
+				prefetchedPages ^= pages;
+			}
+			scanMetrics.bytes = scan.size();
+			addStage(DiscoveryMetrics::read, start);
+			return true;
+		}
+
+		/** Loads the scan and matches it against the rules, after which the scan is no longer needed.*/
+		void match()
+		{
+			auto start = chrono::steady_clock::now();
+			loadScan(scan, !isCacheHit);
+			addStage(DiscoveryMetrics::loadScan, start);
+
+			if (!isCacheHit)
+				processScan();
+
+			if (scan.is_open())
+				scan.close();
+		}
+
+		/** Writes the results, either freshly matched or from scanCache.*/
+		void write()
+		{
+			auto start = chrono::steady_clock::now();
+			if (isCacheHit)
+			{
+				replayCachedResults();
+				scanMetrics.results = count(cacheEntry.results.begin(), cacheEntry.results.end(), '\n');
+			}
+			else
+			{
+				saveDiscoveryMachineResults();
+
+				if (isCachingResults)
+					scanCache.save(cacheVersion(), contentHash, cacheEntry);
+				scanMetrics.results = discoveryMachineResults.size();
 			}
+			addStage(DiscoveryMetrics::write, start);
+
+			scanMetrics.isCacheHit = isCacheHit;
+			metrics.addScan(sourceScanID, scanMetrics);
+
+			if (aggregateProvenance.isOpen)
+				aggregateProvenance.ingest(sourceScanID, contribution);
+		}
+
+		// entries are only replayed with the library and the output mode they were made with
+		DiscoveryHash128 cacheVersion() const
+		{
+			return isNormalizedOutput ? DiscoveryHash128::of("normalized", 10, library->version) : library->version;
+		}
+
+		// adds the time since start to the stage and to the scan, returns the end time, where the next stage starts
+		chrono::steady_clock::time_point addStage(DiscoveryMetrics::Stage stage, chrono::steady_clock::time_point start)
+		{
+			auto end = chrono::steady_clock::now();
+			long long nanoseconds = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+			metrics.stageNanoseconds[stage] += nanoseconds;
+			scanMetrics.nanoseconds += nanoseconds;
+			return end;
+		}
+
+		// owned strings are only made for the sources that are kept by the task or are new to the aggregate,
+		// the sources are only kept when they are going to be matched
+		void loadScan(const boost::iostreams::mapped_file_source& scan, bool isMatching)
+		{
+			auto start = chrono::steady_clock::now();
+
+			// one more than the longest record, so that lines with too many fields are detected as corrupted
+			boost::string_ref fields[9];
+			// reused for every line to avoid allocations
+			string keyUpperCase;
+			string memoKey;
+
+			size_t sources = 0;
 
-			string line;
+			const char* position = scan.is_open() ? scan.data() : nullptr;
+			const char* end = position + scan.size();
 			int mode = -1; // 0 for files, 1 for addremoves
-			while (getline(ifs, line))
+			while (position < end)
 			{
-				if (boost::starts_with(line, "<SourceName=AddRemoves>")) {
+				const char* lineEnd = static_cast<const char*>(memchr(position, '\n', end - position));
+				if (lineEnd == nullptr)
+					lineEnd = end;
+				boost::string_ref line(position, lineEnd - position);
+				position = lineEnd == end ? end : lineEnd + 1;
+				if (!line.empty() && line.back() == '\r')
+					line.remove_suffix(1);
+
+				if (line.starts_with("<SourceName=AddRemoves>")) {
 					mode = 1;
 					continue;
 				}
-				else if (boost::starts_with(line, "<SourceName=Files>")) {
+				else if (line.starts_with("<SourceName=Files>")) {
 					mode = 0;
 					continue;
 				}
 
 				if (mode == 1) {
 					// <Fields=DisplayName		DisplayVersion	Publisher	InstallLocation	UninstallString		SystemComponent>
-					vector<string> fields;
-					boost::split(fields, line, boost::is_any_of("\t"));
-
-					if (fields.size() != 6) {
+					if (splitFields(line, fields) != 6) {
 						cout << "In the scan: \n" + sourceScanPath + "\nthe following line is corrupted:" << endl;
-						for (auto it = fields.begin(); it != fields.end(); it++)
-							cout << (*it) << "\t";
-						cout << endl;
+						cout << line << "\t" << endl;
 						continue;
 					}
+					sources++;
 
-					// see DiscoverySource constructor for addremoves
-					DiscoverySource source(fields[0], fields[1], fields[2]);
-
-					string key = source.sourceKeyUpperCase + source.sourceProductVersion + source.sourceCompanyName;
+					DiscoveryCaseFolding::assignUpper(keyUpperCase, fields[0]);
 
-					mutex::scoped_lock lock(mutexDiscoveryAggregateSources);
-					if (discoveryAggregateSources.find(key) == discoveryAggregateSources.end())
+					DiscoveryHash128 sourceKey = discoveryAggregateSources.insert(viewAddremoveSource(fields, keyUpperCase), sourceScanID);
+					if (aggregateProvenance.isOpen)
 					{
-						source.sourceScanPath = sourceScanPath;
-						discoveryAggregateSources.insert(make_pair(key, source));
+						contribution.sourceKeys.push_back(sourceKey);
+						contribution.sourceFields.push_back(DiscoveryScanSourceFields());
+						contribution.sourceFields.back().sourceKeyOriginal.assign(fields[0].data(), fields[0].size());
 					}
 
-					discoveryMachineSources.push_back(std::move(source));
+					// sources without any rule for their key cannot match, so there is no need to even look at the rest of them
+					if (isMatching && hasCandidateRules(1, keyUpperCase))
+						retainMatchingSource(viewAddremoveSource(fields, keyUpperCase), memoKey);
 				}
 				else if (mode == 0) {
 					// <Fields=FilePath	FileName	ProductVersion	CompanyName	ProductName	FileDescription	FileVersion	FileSize>
-					vector<string> fields;
-					boost::split(fields, line, boost::is_any_of("\t"));
-
-					if (fields.size() != 8) {
+					if (splitFields(line, fields) != 8) {
 						cout << "In the scan: \n" + sourceScanPath + "\nthe following line is corrupted:\n";
-						for (auto it = fields.begin(); it != fields.end(); it++)
-							cout << (*it) << "\t";
-						cout << "\n";
+						cout << line << "\t" << "\n";
 						continue;
 					}
+					sources++;
 
-					// see DiscoverySource constructor for files
-					DiscoverySource source(fields[1], fields[2], fields[3], fields[4], fields[5], fields[6], fields[7], fields[0]);
-
-					string key = source.sourceKeyUpperCase + source.sourceProductVersion + source.sourceCompanyName + source.sourceProductName
-						+ source.sourceFileDescription + source.sourceFileVersion + source.sourceFileSize;
+					DiscoveryCaseFolding::assignUpper(keyUpperCase, fields[1]);
 
-					mutex::scoped_lock lock(mutexDiscoveryAggregateSources);
-					if (discoveryAggregateSources.find(key) == discoveryAggregateSources.end())
+					DiscoveryHash128 sourceKey = discoveryAggregateSources.insert(viewFileSource(fields, keyUpperCase), sourceScanID);
+					if (aggregateProvenance.isOpen)
 					{
-						source.sourceScanPath = sourceScanPath;
-						discoveryAggregateSources.insert(make_pair(key, source));
+						contribution.sourceKeys.push_back(sourceKey);
+						contribution.sourceFields.push_back(DiscoveryScanSourceFields());
+						contribution.sourceFields.back().sourceKeyOriginal.assign(fields[1].data(), fields[1].size());
+						contribution.sourceFields.back().sourceFilePath.assign(fields[0].data(), fields[0].size());
 					}
 
-					discoveryMachineSources.push_back(std::move(source));
+					// sources without any rule for their key cannot match, so there is no need to even look at the rest of them
+					if (isMatching && hasCandidateRules(0, keyUpperCase))
+						retainMatchingSource(viewFileSource(fields, keyUpperCase), memoKey);
 				}
 			}
-			ifs.close();
+
+			scanBytesParsed += scan.size();
+			scanSourcesParsed += sources;
+			scanMetrics.sources = sources;
+			scanParseNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
 		}
 
-		void processScan()
+		// splits a tab separated line in place, returns the number of fields, of which at most 9 are stored
+		static size_t splitFields(boost::string_ref line, boost::string_ref* fields)
 		{
-			// build matches between sources and rules
-			for (auto itSource = discoveryMachineSources.begin(); itSource != discoveryMachineSources.end(); itSource++)
+			size_t count = 0;
+			for (;;)
 			{
-				// find all rules matching the source on sourceTypeID and sourceKeyUpperCase
-				auto range = discoveryRules.get<BySourceTypeIDRuleKey>().equal_range(boost::make_tuple(itSource->sourceTypeID, itSource->sourceKeyUpperCase));
-				for (auto itRule = range.first; itRule != range.second; itRule++)
-				{
-					// eliminate rules whose remaining non-empty attributes do not match the source
-					if (!itRule->ruleProductVersion.empty())
-						if (!itRule->isRuleProductVersionRegex	&& itSource->sourceProductVersion != itRule->ruleProductVersion)
-							continue;
-						else if (itRule->isRuleProductVersionRegex && !std::regex_match(itSource->sourceProductVersion, std::regex(itRule->ruleProductVersion)))
-							continue;
+				size_t tab = line.find('\t');
+				if (count < 9)
+					fields[count] = line.substr(0, tab);
+				count++;
+				if (tab == boost::string_ref::npos)
+					return count;
+				line.remove_prefix(tab + 1);
+			}
+		}
 
-					if (!itRule->ruleProductName.empty())
-						if (!itRule->isRuleProductNameRegex && !boost::iequals(itSource->sourceProductName, itRule->ruleProductName))
-							continue;
-						else if (itRule->isRuleProductNameRegex && !std::regex_match(itSource->sourceProductName, std::regex(itRule->ruleProductName, ECMAScript | icase)))
-							continue;
+		bool hasCandidateRules(int sourceTypeID, boost::string_ref sourceKeyUpperCase) const
+		{
+			return library->ruleIndex.contains(sourceTypeID, sourceKeyUpperCase);
+		}
 
-					if (!itRule->ruleFileVersion.empty())
-						if (!itRule->isRuleFileVersionRegex && itSource->sourceFileVersion != itRule->ruleFileVersion)
-							continue;
-						else if (itRule->isRuleFileVersionRegex && !std::regex_match(itSource->sourceFileVersion, std::regex(itRule->ruleFileVersion)))
-							continue;
+		/**
+		* Finds the rules matching the source on all attributes but the file path, remembered across the fleet,
+		* and keeps the source, stored in the task's arena, along with its rules when there are any.
+		*/
+		void retainMatchingSource(const DiscoverySource& view, string& memoKey)
+		{
+			size_t firstRule = discoveryMachineSourceRules.size();
+			buildMatchMemoKey(view, memoKey);
+			if (!library->matchMemo.find(memoKey, discoveryMachineSourceRules))
+			{
+				vector<const DiscoveryRule*> sourceRules;
+				findMatchingRules(view, sourceRules);
+				library->matchMemo.insert(memoKey, sourceRules);
+				discoveryMachineSourceRules.insert(discoveryMachineSourceRules.end(), sourceRules.begin(), sourceRules.end());
+			}
+			if (discoveryMachineSourceRules.size() == firstRule)
+				return;
 
-					if (!itRule->ruleFileSize.empty() && itSource->sourceFileSize != itRule->ruleFileSize)
-						continue;
+			discoveryMachineSources.push_back(view.storedIn(arena));
+			discoveryMachineSources.back().sourceScanID = sourceScanID;
+			discoveryMachineSourceRuleRanges.push_back(make_pair(firstRule, discoveryMachineSourceRules.size() - firstRule));
+		}
 
-					if (!itRule->ruleFilePath.empty() && !std::regex_match(itSource->sourceFilePath, std::regex(itRule->ruleFilePath, ECMAScript | icase)))
-						continue;
+		// a source whose fields point into the scan, valid while the scan is mapped and the line's fields and keyUpperCase are unchanged
+		static DiscoverySource viewAddremoveSource(const boost::string_ref* fields, boost::string_ref keyUpperCase)
+		{
+			DiscoverySource source;
+			source.sourceTypeID = 1;
+			source.sourceKeyOriginal = fields[0];
+			source.sourceKeyUpperCase = keyUpperCase;
+			source.sourceProductVersion = fields[1];
+			source.sourceCompanyName = fields[2];
+			return source;
+		}
+
+		// as above, for files
+		static DiscoverySource viewFileSource(const boost::string_ref* fields, boost::string_ref keyUpperCase)
+		{
+			DiscoverySource source;
+			source.sourceTypeID = 0;
+			source.sourceFilePath = fields[0];
+			source.sourceKeyOriginal = fields[1];
+			source.sourceKeyUpperCase = keyUpperCase;
+			source.sourceProductVersion = fields[2];
+			source.sourceCompanyName = fields[3];
+			source.sourceProductName = fields[4];
+			source.sourceFileDescription = fields[5];
+			source.sourceFileVersion = fields[6];
+			source.sourceFileSizeText = fields[7];
+			source.sourceFileSize = DiscoverySource::parseFileSize(fields[7]);
+			return source;
+		}
+
+		void processScan()
+		{
+			auto start = chrono::steady_clock::now();
+			matchSources();
+			start = addStage(DiscoveryMetrics::matchSources, start);
+
+			multiplyMatches();
+			start = addStage(DiscoveryMetrics::multiplyMatches, start);
+
+			pruneResults();
+			start = addStage(DiscoveryMetrics::pruneResults, start);
+
+			excludeVersions();
+			start = addStage(DiscoveryMetrics::excludeVersions, start);
+
+			addAggregateResults();
+			addStage(DiscoveryMetrics::addAggregateResults, start);
+		}
+
+		void matchSources()
+		{
+			// build matches between sources and the rules found for them by loadScan
+			size_t predicates = 0;
+			for (size_t i = 0; i < discoveryMachineSources.size(); i++)
+			{
+				auto itSource = discoveryMachineSources.begin() + i;
+				auto itFirstRule = discoveryMachineSourceRules.begin() + discoveryMachineSourceRuleRanges[i].first;
+				for (auto itRuleRef = itFirstRule; itRuleRef != itFirstRule + discoveryMachineSourceRuleRanges[i].second; itRuleRef++)
+				{
+					const DiscoveryRule* itRule = *itRuleRef;
+
+					// the file path is different for each occurrence of the source, hence checked every time
+					if (!itRule->ruleFilePath.empty())
+					{
+						predicates++;
+						if (!DiscoveryRule::matchGlob(itSource->sourceFilePath, itRule->ruleFilePathGlob))
+							continue;
+					}
 
 					// if it gets to this point then the rule matches the source on all attributes
 					// and we will add a new DiscoveryMatch to discoveryMachineResults
 					// for an existing DiscoveryResult with current sourceFilePath, versionID and buildID
 					// or to a such newly added DiscoveryResult if it does not yet exist
-					auto itResult = discoveryMachineResults.find(boost::make_tuple(itSource->sourceFilePath, itRule->versionID, itRule->buildID));
+					string sourceFilePath = itSource->sourceFilePath.to_string();
+					auto itResult = discoveryMachineResults.find(boost::make_tuple(sourceFilePath, itRule->versionID, itRule->buildID));
 					if (itResult == discoveryMachineResults.end())
 					{
 						// if it does not exist yet, then create a new DiscoveryResult
-						DiscoveryResult result(itSource->sourceFilePath, itRule->versionID, itRule->buildID);
+						DiscoveryResult result(sourceFilePath, itRule->versionID, itRule->buildID);
 						// then add the new DiscoveryMatch to it
-						result.discoveryMatches.insert(DiscoveryMatch(const_cast<DiscoveryRule*>(&(*itRule)), &(*itSource)));
+						result.discoveryMatches.insert(DiscoveryMatch(const_cast<DiscoveryRule*>(itRule), &(*itSource)));
 						// and add the new DiscoveryResult to discoveryMachineResults
 						discoveryMachineResults.insert(result);
 					}
 					else
 					{
 						// if it does exist, then just add a new DiscoveryMatch to the existing DiscoveryResult
-						// while natural ordering of DiscoveryMatch by ruleID in the discoveryMatches set prevents
-						// adding more than one DiscoveryMatch with same DiscoveryRule.ruleID under given DiscoveryResult
-						set<DiscoveryMatch>* discoveryMatches = const_cast<set<DiscoveryMatch>*>(&(itResult->discoveryMatches));
-						discoveryMatches->insert(DiscoveryMatch(const_cast<DiscoveryRule*>(&(*itRule)), &(*itSource)));
+						// while DiscoveryMatches prevents adding more than one DiscoveryMatch with same DiscoveryRule.ruleID under given DiscoveryResult
+						DiscoveryMatches* discoveryMatches = const_cast<DiscoveryMatches*>(&(itResult->discoveryMatches));
+						discoveryMatches->insert(DiscoveryMatch(const_cast<DiscoveryRule*>(itRule), &(*itSource)));
 					}
 				}
 			}
+			metrics.predicateEvaluations += predicates;
+		}
 
+		void multiplyMatches()
+		{
 			// discovery match multiplication for path based results
 			// which allows to combine non-file and file based detection on concrete paths
 			// and also multiple files living in the same subtree to trigger the same buildID
+			// path based results are grouped by buildID, since matches are only ever combined within the same buildID
 			// note we start with equal_range("").second which is the first path based result
+			unordered_map<int, vector<DiscoveryResult*>> pathResultsByBuildID;
 			for (auto itPathResult = discoveryMachineResults.equal_range("").second; itPathResult != discoveryMachineResults.end(); itPathResult++)
+				pathResultsByBuildID[itPathResult->buildID].push_back(const_cast<DiscoveryResult*>(&(*itPathResult)));
+
+			for (auto itGroup = pathResultsByBuildID.begin(); itGroup != pathResultsByBuildID.end(); itGroup++)
 			{
+				// for each path based match we will add subpath matches provided their buildIDs match
+				// which allows multiple files living in the same subtree to trigger the same buildID
+				if (itGroup->second.size() > 1)
+					multiplySubpathMatches(itGroup->second);
+
 				// for each path based match, add all matches of the non-path detection result with matching buildID
 				// which allows to combine non-file and file based detection on concrete paths
-				auto itNonPathResult = discoveryMachineResults.find(boost::make_tuple("", itPathResult->versionID, itPathResult->buildID));
+				auto itNonPathResult = discoveryMachineResults.find(boost::make_tuple("", itGroup->second.front()->versionID, itGroup->first));
 				if (itNonPathResult != discoveryMachineResults.end())
-				{
-					set<DiscoveryMatch>* discoveryMatches = const_cast<set<DiscoveryMatch>*>(&(itPathResult->discoveryMatches));
-					discoveryMatches->insert(itNonPathResult->discoveryMatches.begin(), itNonPathResult->discoveryMatches.end());
-				}
-
-				// for each path based match we will add subpath matches provided their buildIDs match
-				// which allows multiple files living in the same subtree to trigger the same buildID
-				auto itSubPathResult = itPathResult;
-				for (itSubPathResult++; itSubPathResult != discoveryMachineResults.end(); itSubPathResult++)
-				{
-					// find first different path
-					if (itSubPathResult->path == itPathResult->path)
-						continue;
-					// if it is different, then check if it is in fact a subpath of path
-					else if (itSubPathResult->path.find(itPathResult->path) == 0)
-					{
-						// if yes, check if the buildIDs match
-						if (itSubPathResult->buildID == itPathResult->buildID)
-						{
-							// if yes, add all the subpath matches to those in the path
-							set<DiscoveryMatch>* discoveryMatches = const_cast<set<DiscoveryMatch>*>(&(itPathResult->discoveryMatches));
-							discoveryMatches->insert(itSubPathResult->discoveryMatches.begin(), itSubPathResult->discoveryMatches.end());
-						}
-					}
-					// discoveryMachineResults is sorted by path first so if it is diferent and not a subpath of path then that's it
-					else
-						break;
-				}
+					for (auto itPathResult = itGroup->second.begin(); itPathResult != itGroup->second.end(); itPathResult++)
+						(*itPathResult)->discoveryMatches.insert(itNonPathResult->discoveryMatches);
 			}
+		}
 
+		void pruneResults()
+		{
 			// prune the discovery results down to those whose matched rule count for given buildID equals discovery rule count for this buildID
+			size_t pruned = 0;
 			for (auto itResult = discoveryMachineResults.begin(); itResult != discoveryMachineResults.end();)
-				if (itResult->discoveryMatches.size() != discoveryRules.get<ByBuildID>().count(itResult->buildID))
+				if (!itResult->discoveryMatches.isComplete())
+				{
 					itResult = discoveryMachineResults.erase(itResult);
+					pruned++;
+				}
 				else
 					itResult++;
+			metrics.resultsPruned += pruned;
+		}
 
+		void excludeVersions()
+		{
 			// apply version exclusion rules, erase excluded versions
+			// per path, intersect each version's excluders with the versions still present on that path
+			vector<int> presentVersionIDs;
+			size_t excluded = 0;
 			for (auto itResult = discoveryMachineResults.begin(); itResult != discoveryMachineResults.end();)
-				if (isVersionExcluded(itResult->path, itResult->versionID))
-					itResult = discoveryMachineResults.erase(itResult);
-				else
-					itResult++;
+			{
+				auto itPathEnd = discoveryMachineResults.upper_bound(boost::make_tuple(itResult->path));
+				presentVersionIDs.clear();
+				for (auto it = itResult; it != itPathEnd; it++)
+					presentVersionIDs.push_back(it->versionID);
+
+				// results are ordered by versionID within the path, so presentVersionIDs is already sorted
+				while (itResult != itPathEnd)
+					if (library->discoveryVERClosure.isExcluded(itResult->versionID, presentVersionIDs))
+					{
+						presentVersionIDs.erase(lower_bound(presentVersionIDs.begin(), presentVersionIDs.end(), itResult->versionID));
+						itResult = discoveryMachineResults.erase(itResult);
+						excluded++;
+					}
+					else
+						itResult++;
+			}
+			metrics.versionExclusions += excluded;
+		}
 
-			// add to global discovered aggregate results
-			mutexDiscoveryAggregateResults.lock();
+		void addAggregateResults()
+		{
+			// add to this worker thread's aggregate results, merged into the global ones at the end of processAllScans
+			DiscoveryWorkerAggregateResults& aggregateResults = getWorkerDiscoveryAggregateResults();
 			for (auto itResult = discoveryMachineResults.begin(); itResult != discoveryMachineResults.end(); itResult++)
+				addAggregateResult(aggregateResults, itResult->path, itResult->versionID, itResult->buildID);
+		}
+
+		void addAggregateResult(DiscoveryWorkerAggregateResults& aggregateResults, boost::string_ref path, int versionID, int buildID)
+		{
+			aggregateResultKey.assign(buildID, path);
+			auto it = aggregateResults.find(aggregateResultKey);
+			if (it != aggregateResults.end())
+				it->second.add(path, sourceScanPath);
+			else
+				aggregateResults.insert(make_pair(aggregateResultKey, DiscoveryAggregateResult(path.to_string(), versionID, buildID, 1, sourceScanPath)));
+
+			// the same line as the scan cache keeps, whether the result has just been matched or is replayed
+			if (aggregateProvenance.isOpen)
+				contribution.results.append(to_string(versionID)).append(1, '\t').append(to_string(buildID)).append(1, '\t').append(path.data(), path.size()).append(1, '\n');
+		}
+
+		// finds the rules with the source's sourceTypeID and sourceKeyUpperCase whose other non-empty attributes, except the file path, match the source
+		void findMatchingRules(const DiscoverySource& source, vector<const DiscoveryRule*>& rules) const
+		{
+			auto range = library->ruleIndex.equal_range(source.sourceTypeID, source.sourceKeyUpperCase);
+			size_t candidates = 0, predicates = 0;
+			for (auto itRule = range.first; itRule != range.second; itRule++)
 			{
-				string key = to_string(itResult->buildID) + to_upper_copy(itResult->path);
-				auto it = discoveryAggregateResults.find(key);
-				if (it != discoveryAggregateResults.end())
-					it->second.count++;
-				else
-					discoveryAggregateResults.insert(make_pair(key, DiscoveryAggregateResult(itResult->path, itResult->versionID, itResult->buildID, 1, sourceScanPath)));
+				const DiscoveryRule& rule = **itRule;
+				candidates++;
+
+				// eliminate rules whose remaining non-empty attributes do not match the source
+				if (!rule.ruleProductVersion.empty())
+				{
+					predicates++;
+					if (!rule.isRuleProductVersionGlob && source.sourceProductVersion != rule.ruleProductVersion)
+						continue;
+					else if (rule.isRuleProductVersionGlob && !DiscoveryRule::matchGlob(source.sourceProductVersion, rule.ruleProductVersionGlob))
+						continue;
+				}
+
+				if (!rule.ruleProductName.empty())
+				{
+					predicates++;
+					if (!rule.isRuleProductNameGlob && !DiscoveryCaseFolding::iequals(source.sourceProductName, rule.ruleProductName))
+						continue;
+					else if (rule.isRuleProductNameGlob && !DiscoveryRule::matchGlob(source.sourceProductName, rule.ruleProductNameGlob))
+						continue;
+				}
+
+				if (!rule.ruleFileVersion.empty())
+				{
+					predicates++;
+					if (!rule.isRuleFileVersionGlob && source.sourceFileVersion != rule.ruleFileVersion)
+						continue;
+					else if (rule.isRuleFileVersionGlob && !DiscoveryRule::matchGlob(source.sourceFileVersion, rule.ruleFileVersionGlob))
+						continue;
+				}
+
+				if (!rule.ruleFileSizeText.empty())
+				{
+					predicates++;
+					if (!rule.matchesFileSize(source))
+						continue;
+				}
+
+				rules.push_back(*itRule);
 			}
-			mutexDiscoveryAggregateResults.unlock();
+			metrics.candidateRules += candidates;
+			metrics.predicateEvaluations += predicates;
 		}
 
-		// recursive, because a version may be excluded via a chain of version exclusion rules
-		bool isVersionExcluded(const string& path, int oldVersionID)
+		/**
+		* Builds the matchMemo key of the source from the attributes findMatchingRules checks, each prefixed with its length.
+		* The product name is only ever compared case insensitively, so it is uppercased, which lets more sources share an entry.
+		*/
+		static void buildMatchMemoKey(const DiscoverySource& source, string& key)
 		{
-			bool returnValue = false;
-			auto range = discoveryVERs.equal_range(oldVersionID);
-			for (auto itVER = range.first; itVER != range.second; itVER++)
+			key.assign(1, static_cast<char>(source.sourceTypeID));
+			appendMatchMemoKeyField(key, source.sourceKeyUpperCase);
+			appendMatchMemoKeyField(key, source.sourceProductVersion);
+			size_t productName = key.size() + sizeof(uint32_t);
+			appendMatchMemoKeyField(key, source.sourceProductName);
+			DiscoveryCaseFolding::toUpper(&key[productName], key.size() - productName);
+			appendMatchMemoKeyField(key, source.sourceFileVersion);
+			appendMatchMemoKeyField(key, source.sourceFileSizeText);
+		}
+
+		static void appendMatchMemoKeyField(string& key, boost::string_ref field)
+		{
+			uint32_t size = static_cast<uint32_t>(field.size());
+			key.append(reinterpret_cast<const char*>(&size), sizeof(size)).append(field.data(), field.size());
+		}
+
+		/**
+		* Adds to each of the path based results all the matches of the results in its subtree, i.e. on its path or below.
+		* The results must all have the same buildID and come in path order. They are arranged into a trie of path components,
+		* so C:\App is the parent of C:\App\Bin but not of C:\Apple, and empty components are skipped, so C:\App and C:\App\ are the same path.
+		* Where several paths of a subtree match the same rule, the match kept is the one of the first of them in path order.
+		*/
+		static void multiplySubpathMatches(const vector<DiscoveryResult*>& pathResults)
+		{
+			struct PathNode
 			{
-				if (discoveryMachineResults.find(boost::make_tuple(path, itVER->second)) != discoveryMachineResults.end())
+				int parent;
+				map<boost::string_ref, int> children;
+				DiscoveryMatches discoveryMatches;
+				PathNode(int parent) : parent(parent) {}
+			};
+
+			vector<PathNode> nodes(1, PathNode(-1));
+			vector<int> pathResultNodes;
+			for (auto itPathResult = pathResults.begin(); itPathResult != pathResults.end(); itPathResult++)
+			{
+				int node = 0;
+				boost::string_ref path((*itPathResult)->path);
+				while (!path.empty())
 				{
-					returnValue = true;
-					break;
+					size_t separator = path.find_first_of("\\/");
+					boost::string_ref component = path.substr(0, separator);
+					path.remove_prefix(separator == boost::string_ref::npos ? path.size() : separator + 1);
+					if (component.empty())
+						continue;
+
+					auto itChild = nodes[node].children.find(component);
+					if (itChild != nodes[node].children.end())
+						node = itChild->second;
+					else
+					{
+						nodes.push_back(PathNode(node));
+						nodes[node].children.insert(make_pair(component, static_cast<int>(nodes.size() - 1)));
+						node = static_cast<int>(nodes.size() - 1);
+					}
 				}
-				else
-					returnValue = isVersionExcluded(path, itVER->second);
+				pathResultNodes.push_back(node);
 			}
-			return returnValue;
+
+			// in path order, each result's matches go to its node and every node above it, where the first match of a rule stays
+			for (size_t i = 0; i < pathResults.size(); i++)
+				for (int node = pathResultNodes[i]; node >= 0; node = nodes[node].parent)
+					nodes[node].discoveryMatches.insert(pathResults[i]->discoveryMatches);
+
+			for (size_t i = 0; i < pathResults.size(); i++)
+				pathResults[i]->discoveryMatches = nodes[pathResultNodes[i]].discoveryMatches;
 		}
 
 		void saveDiscoveryMachineResults()
 		{
-			mutex::scoped_lock lock(mutexDiscoveryResults);
-
-			ofstream ofsResults("s:\\results\\results.txt", fstream::app | fstream::out);
-			ofstream ofsResultsVerboseAddremoves("s:\\results\\results_verbose_addremoves.txt", fstream::app | fstream::out);
-			ofstream ofsResultsVerboseFiles("s:\\results\\results_verbose_files.txt", fstream::app | fstream::out);
+			DiscoveryResultWriter& writer = getWorkerResultWriter();
+			cachedSourceIDs.clear();
 
+			// when caching, whatever is formatted after the scan path is copied into the cache entry as well
 			for (auto itResult = discoveryMachineResults.begin(); itResult != discoveryMachineResults.end(); itResult++)
 			{
-				ofsResults << itResult->versionID << "\t" << itResult->buildID << "\t" << itResult->path << "\t" << sourceScanPath << endl;
-
-				auto itSignature = discoverySignatures.find(itResult->versionID);
-				if (itSignature != discoverySignatures.end())
-					for (auto itMatch = itResult->discoveryMatches.begin(); itMatch != itResult->discoveryMatches.end(); itMatch++)
+				size_t start = writer.results.buffer.size();
+				writer.results.append(itResult->versionID).append('\t').append(itResult->buildID).append('\t').append(itResult->path);
+				if (isCachingResults)
+					cacheEntry.results.append(writer.results.buffer, start, string::npos).push_back('\n');
+				writer.results.append('\t').append(sourceScanPath).append('\n');
+
+				auto itSignature = library->discoverySignatures.find(itResult->versionID);
+				if (itSignature != library->discoverySignatures.end())
+					for (auto itMatch = itResult->discoveryMatches.matches.begin(); itMatch != itResult->discoveryMatches.matches.end(); itMatch++)
 					{
-						if (itMatch->rule->sourceTypeID == 0)
-							ofsResultsVerboseFiles << sourceScanPath << "\t"
-							<< itSignature->second.publisherID << "\t" << itSignature->second.publisherName << "\t" << itSignature->second.webPage << "\t"
-							<< itSignature->second.productID << "\t" << itSignature->second.productName << "\t" << itSignature->second.productLicensable << "\t"
-							<< itSignature->second.productCategory << "\t" << itSignature->second.versionID << "\t" << itSignature->second.uniqueVersion << "\t"
-							<< itSignature->second.build << "\t" << itSignature->second.major << "\t" << itSignature->second.minor << "\t"
-							<< itSignature->second.edition << "\t" << itSignature->second.variation << "\t" << itSignature->second.licenseVersion << "\t"
-							<< "file" << "\t" << itMatch->source->sourceCompanyName << "\t"
-							<< itMatch->source->sourceKeyOriginal << "\t" << itMatch->source->sourceFileDescription << "\t" << itMatch->source->sourceProductName << "\t"
-							<< itMatch->source->sourceProductVersion << endl;
+						if (itMatch->rule == nullptr)
+							continue;
+						else if (isNormalizedOutput)
+							saveNormalizedMatch(writer, *itResult, *itMatch);
+						else if (itMatch->rule->sourceTypeID == 0)
+						{
+							start = writer.resultsVerboseFiles.append(sourceScanPath).append('\t').buffer.size();
+							appendSignature(writer.resultsVerboseFiles, itSignature->second)
+							.append("file").append('\t').append(itMatch->source->sourceCompanyName).append('\t')
+							.append(itMatch->source->sourceKeyOriginal).append('\t').append(itMatch->source->sourceFileDescription).append('\t').append(itMatch->source->sourceProductName).append('\t')
+							.append(itMatch->source->sourceProductVersion).append('\n');
+							if (isCachingResults)
+								cacheEntry.resultsVerboseFiles.append(writer.resultsVerboseFiles.buffer, start, string::npos);
+						}
 						else if (itMatch->rule->sourceTypeID == 1)
-							ofsResultsVerboseAddremoves << sourceScanPath << "\t"
-							<< itSignature->second.publisherID << "\t" << itSignature->second.publisherName << "\t" << itSignature->second.webPage << "\t"
-							<< itSignature->second.productID << "\t" << itSignature->second.productName << "\t" << itSignature->second.productLicensable << "\t"
-							<< itSignature->second.productCategory << "\t" << itSignature->second.versionID << "\t" << itSignature->second.uniqueVersion << "\t"
-							<< itSignature->second.build << "\t" << itSignature->second.major << "\t" << itSignature->second.minor << "\t"
-							<< itSignature->second.edition << "\t" << itSignature->second.variation << "\t" << itSignature->second.licenseVersion << "\t"
-							<< "addremove" << "\t" << itMatch->source->sourceCompanyName << "\t" << itMatch->source->sourceKeyOriginal << "\t"
-							<< itMatch->source->sourceProductVersion << endl;
+						{
+							start = writer.resultsVerboseAddremoves.append(sourceScanPath).append('\t').buffer.size();
+							appendSignature(writer.resultsVerboseAddremoves, itSignature->second)
+							.append("addremove").append('\t').append(itMatch->source->sourceCompanyName).append('\t').append(itMatch->source->sourceKeyOriginal).append('\t')
+							.append(itMatch->source->sourceProductVersion).append('\n');
+							if (isCachingResults)
+								cacheEntry.resultsVerboseAddremoves.append(writer.resultsVerboseAddremoves.buffer, start, string::npos);
+						}
 					}
 				else
 				{
-					cout << "The signature for versionID: " << itResult->versionID << " is missing.";
-					std::system("pause");
+					cout << "The signature for versionID: " << itResult->versionID << " is missing." << endl;
 				}
 			}
+
+			writer.results.commit();
+			writer.resultsVerboseAddremoves.commit();
+			writer.resultsVerboseFiles.commit();
+			writer.normalizedMatches.commit();
+			writer.normalizedSources.commit();
+		}
+
+		/**
+		* Writes the normalized output of a match: scan ID, versionID, buildID and source ID to the matches,
+		* and the source to the sources dimension unless it is already there.
+		* The source ID is the hash of the source as the verbose results show it, so a source has the same ID in every scan, run and shard,
+		* and the tasks only need to agree on whether it has been written yet.
+		*/
+		void saveNormalizedMatch(DiscoveryResultWriter& writer, const DiscoveryResult& result, const DiscoveryMatch& match)
+		{
+			if (!formatNormalizedSource(match))
+				return;
+			DiscoveryHash128 sourceID = DiscoveryHash128::of(normalizedSource.data(), normalizedSource.size());
+
+			size_t start = writer.normalizedMatches.append(sourceScanID).append('\t').buffer.size();
+			writer.normalizedMatches.append(result.versionID).append('\t').append(result.buildID).append('\t')
+				.appendHex(sourceID.high).appendHex(sourceID.low).append('\n');
+			if (isCachingResults)
+				cacheEntry.normalizedMatches.append(writer.normalizedMatches.buffer, start, string::npos);
+
+			if (normalizedSourceIDs.insert(sourceID))
+				writer.normalizedSources.appendHex(sourceID.high).appendHex(sourceID.low).append('\t').append(normalizedSource).append('\n');
+			// a cache hit replays the sources as well, they may not have been written yet when it is the only scan with them
+			if (isCachingResults && cachedSourceIDs.insert(sourceID).second)
+				cacheEntry.normalizedSources.append(sourceID.toHex()).append(1, '\t').append(normalizedSource).append(1, '\n');
+		}
+
+		// formats the source of the match the way the verbose results show it, from the source type on, into normalizedSource, false for pkginsts
+		bool formatNormalizedSource(const DiscoveryMatch& match)
+		{
+			const DiscoverySource& source = *match.source;
+			normalizedSource.clear();
+			if (match.rule->sourceTypeID == 0)
+			{
+				boost::string_ref fields[] = { "file", source.sourceCompanyName, source.sourceKeyOriginal, source.sourceFileDescription, source.sourceProductName, source.sourceProductVersion };
+				appendFields(normalizedSource, fields, sizeof(fields) / sizeof(fields[0]));
+			}
+			else if (match.rule->sourceTypeID == 1)
+			{
+				boost::string_ref fields[] = { "addremove", source.sourceCompanyName, source.sourceKeyOriginal, source.sourceProductVersion };
+				appendFields(normalizedSource, fields, sizeof(fields) / sizeof(fields[0]));
+			}
+			else
+				return false;
+			return true;
+		}
+
+		static void appendFields(string& line, const boost::string_ref* fields, size_t fieldCount)
+		{
+			for (size_t i = 0; i < fieldCount; i++)
+			{
+				if (i > 0)
+					line.push_back('\t');
+				line.append(fields[i].data(), fields[i].size());
+			}
+		}
+
+		// writes the cached output of an unchanged scan as if it had just been processed
+		void replayCachedResults()
+		{
+			DiscoveryResultWriter& writer = getWorkerResultWriter();
+			DiscoveryWorkerAggregateResults& aggregateResults = getWorkerDiscoveryAggregateResults();
+
+			boost::string_ref fields[9];
+			for (boost::string_ref lines(cacheEntry.results); !lines.empty();)
+			{
+				boost::string_ref line = nextLine(lines);
+				writer.results.append(line).append('\t').append(sourceScanPath).append('\n');
+
+				// versionID, buildID and path
+				if (splitFields(line, fields) == 3)
+					addAggregateResult(aggregateResults, fields[2], stol(fields[0].to_string()), stol(fields[1].to_string()));
+			}
+
+			for (boost::string_ref lines(cacheEntry.resultsVerboseFiles); !lines.empty();)
+				writer.resultsVerboseFiles.append(sourceScanPath).append('\t').append(nextLine(lines)).append('\n');
+			for (boost::string_ref lines(cacheEntry.resultsVerboseAddremoves); !lines.empty();)
+				writer.resultsVerboseAddremoves.append(sourceScanPath).append('\t').append(nextLine(lines)).append('\n');
+
+			for (boost::string_ref lines(cacheEntry.normalizedMatches); !lines.empty();)
+				writer.normalizedMatches.append(sourceScanID).append('\t').append(nextLine(lines)).append('\n');
+			for (boost::string_ref lines(cacheEntry.normalizedSources); !lines.empty();)
+			{
+				// source ID and source, whose hash the source ID is
+				boost::string_ref line = nextLine(lines);
+				boost::string_ref source = line.substr(line.find('\t') + 1);
+				if (normalizedSourceIDs.insert(DiscoveryHash128::of(source.data(), source.size())))
+					writer.normalizedSources.append(line).append('\n');
+			}
+
+			writer.results.commit();
+			writer.resultsVerboseAddremoves.commit();
+			writer.resultsVerboseFiles.commit();
+			writer.normalizedMatches.commit();
+			writer.normalizedSources.commit();
+		}
+
+		// removes the first line from lines and returns it without its line end
+		static boost::string_ref nextLine(boost::string_ref& lines)
+		{
+			size_t lineEnd = lines.find('\n');
+			boost::string_ref line = lines.substr(0, lineEnd);
+			lines.remove_prefix(lineEnd == boost::string_ref::npos ? lines.size() : lineEnd + 1);
+			return line;
+		}
+
+		static DiscoveryOutputSegment& appendSignature(DiscoveryOutputSegment& segment, const DiscoverySignature& signature)
+		{
+			return segment
+				.append(signature.publisherID).append('\t').append(signature.publisherName).append('\t').append(signature.webPage).append('\t')
+				.append(signature.productID).append('\t').append(signature.productName).append('\t').append(signature.productLicensable).append('\t')
+				.append(signature.productCategory).append('\t').append(signature.versionID).append('\t').append(signature.uniqueVersion).append('\t')
+				.append(signature.build).append('\t').append(signature.major).append('\t').append(signature.minor).append('\t')
+				.append(signature.edition).append('\t').append(signature.variation).append('\t').append(signature.licenseVersion).append('\t');
 		}
 	};
 	// end of ProcessScanTask class
 
-	static void processAllScans()
+	/**
+	* Registers the scans under the scans directory and returns their IDs, largest scan first.
+	* storedScanPaths are registered along with them without being returned, so that scan IDs follow path order across both.
+	*/
+	static vector<int> findAllScans(const vector<string>& storedScanPaths = vector<string>())
 	{
-		time_t start = time(0);
+		// all the scans are found before any is processed, so that they can be scheduled by size
+		vector<pair<string, uintmax_t>> scans;
+		try {
+			for (filesystem::recursive_directory_iterator it(rootPath + "scans\\"); it != filesystem::recursive_directory_iterator(); it++)
+				if (is_regular_file(*it) && it->path().extension() == ".scan" && isScanInShard(it->path().string()))
+					scans.push_back(make_pair(it->path().string(), filesystem::file_size(it->path())));
+		}
+		catch (boost::filesystem::filesystem_error &ex){ std::cout << ex.what() << "\n"; }
 
-		// write headers
-		ofstream ofsResultsVerboseAddremoves("s:\\results\\results_verbose_addremoves.txt", fstream::out);
+		// scan IDs are given in path order
+		sort(scans.begin(), scans.end());
+		if (!storedScanPaths.empty())
+		{
+			vector<string> allScanPaths(storedScanPaths);
+			for (auto it = scans.begin(); it != scans.end(); it++)
+				allScanPaths.push_back(it->first);
+			sort(allScanPaths.begin(), allScanPaths.end());
+			for (auto it = allScanPaths.begin(); it != allScanPaths.end(); it++)
+				registerScanPath(*it);
+		}
+		vector<pair<uintmax_t, int>> scanSizes;
+		for (auto it = scans.begin(); it != scans.end(); it++)
+			scanSizes.push_back(make_pair(it->second, registerScanPath(it->first)));
+
+		// largest scans first, so that a big one picked up late cannot leave the other workers idle at the end
+		sort(scanSizes.begin(), scanSizes.end(), [](const pair<uintmax_t, int>& a, const pair<uintmax_t, int>& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+
+		vector<int> orderedScanIDs;
+		for (auto it = scanSizes.begin(); it != scanSizes.end(); it++)
+			orderedScanIDs.push_back(it->second);
+		return orderedScanIDs;
+	}
+	/** Starts the verbose results files with their headers.*/
+	static void saveResultsVerboseHeaders()
+	{
+		ofstream ofsResultsVerboseAddremoves(resultsPath + "results_verbose_addremoves.txt", fstream::out);
 		ofsResultsVerboseAddremoves << "SourceScanPath" << "\t"
 			<< "PublisherID" << "\t" << "PublisherName" << "\t" << "WebPage" << "\t"
 			<< "ProductID" << "\t" << "ProductName" << "\t" << "Licensable" << "\t"
@@ -638,7 +1855,7 @@ struct DiscoveryEngine
 			<< "SourceSoftwareVersion" << endl;
 		ofsResultsVerboseAddremoves.close();
 
-		ofstream ofsResultsVerboseFiles("s:\\results\\results_verbose_files.txt", fstream::out);
+		ofstream ofsResultsVerboseFiles(resultsPath + "results_verbose_files.txt", fstream::out);
 		ofsResultsVerboseFiles << "SourceScanPath" << "\t"
 			<< "PublisherID" << "\t" << "PublisherName" << "\t" << "WebPage" << "\t"
 			<< "ProductID" << "\t" << "ProductName" << "\t" << "Licensable" << "\t"
@@ -648,50 +1865,820 @@ struct DiscoveryEngine
 			<< "SourceType" << "\t" << "\t" << "SourceManufacturer" << "\t" << "SourceFileName" << "\t"
 			<< "SourceFileDescription" << "\t" << "SourceProductName" << "\t" << "SourceProductVersion" << endl;
 		ofsResultsVerboseFiles.close();
+	}
+
+	static void processAllScans()
+	{
+		time_t start = time(0);
+		auto runStart = chrono::steady_clock::now();
+
+		scanCache.open(rootPath + "cache\\");
+
+		if (isNormalizedOutput)
+			saveNormalizedSignatures();
+		else
+			saveResultsVerboseHeaders();
 
 		int noOfWorkerThreads = thread::hardware_concurrency();
 		cout << "Detected " << noOfWorkerThreads << " processors!" << endl;
 
-		boost::asio::io_service ioService;
-		asio::io_service::work work(ioService);
-		boost::thread_group threadGroup;
+		int workerThreadCount = noOfWorkerThreads > 1 ? noOfWorkerThreads / 2 : 1;
+		if (configuredWorkerThreadCount > 0)
+			workerThreadCount = configuredWorkerThreadCount;
+		// the pipeline runs one reader and one writer at least
+		if (isPipelined)
+			cout << "Processing scans with " << max(pipelineReaderCount, 1) << " reader, " << workerThreadCount << " matcher and " << max(pipelineWriterCount, 1) << " writer threads!" << endl;
+		else
+			cout << "Processing scans with " << workerThreadCount << " worker threads" << (isPinningWorkerThreads ? " pinned to processors" : "") << "!" << endl;
+
+		// the scans of the previous runs are registered before their aggregates are loaded, which refer to them by scan ID
+		DiscoveryAggregateStore store;
+		vector<string> storedScanPaths;
+		if (isIncremental && !openDiscoveryAggregateStore(store, storedScanPaths))
+		{
+			std::system("pause");
+			return;
+		}
+		vector<int> orderedScanIDs = findAllScans(storedScanPaths);
+		if (isIncremental)
+			loadDiscoveryAggregateStore(store);
 
-		// start thread pool
-		for (int i = 0; i < (noOfWorkerThreads > 1 ? noOfWorkerThreads / 2 : 1); ++i)
-			threadGroup.create_thread(boost::bind(&boost::asio::io_service::run, &ioService));
-		cout << "Processing scans with " << (noOfWorkerThreads > 1 ? noOfWorkerThreads / 2 : 1) << " worker threads!" << endl;
+		if (isNormalizedOutput)
+			saveNormalizedScans();
 
-		// submit tasks to the thread pool
-		try {
-			for (filesystem::recursive_directory_iterator it("s:\\scans\\"); it != filesystem::recursive_directory_iterator(); it++)
-				if (is_regular_file(*it) && it->path().extension() == ".scan")
-					ioService.post(ProcessScanTask(it->path().string()));
+		// the merge needs the scans of every shard, to give out scan IDs as a single run would
+		if (shardCount > 1)
+		{
+			ofstream ofsScans(resultsPath + "scans.txt", fstream::out);
+			for (auto it = scanPaths.begin(); it != scanPaths.end(); it++)
+				ofsScans << *it << endl;
 		}
-		catch (boost::filesystem::filesystem_error &ex){ std::cout << ex.what() << "\n"; }
 
-		// wait for the tasks to finish
-		ioService.stop();
-		threadGroup.join_all();
+		// the metrics are of this run only
+		metrics.clear(scanPaths.size());
+		discoveryAggregateSources.lockStats.clear();
+		lockStatsDiscoveryAggregateResults.clear();
+		lockStatsDiscoveryResults.clear();
+		normalizedSourceIDs.clear();
+		normalizedSourceIDs.lockStats.clear();
+		size_t globEvaluations = DiscoveryRule::globEvaluations;
+
+		if (isPipelined)
+			processAllScansPipelined(orderedScanIDs, workerThreadCount);
+		else
+		{
+			DiscoveryWorkStealingPool pool(workerThreadCount, isPinningWorkerThreads);
+			for (auto it = orderedScanIDs.begin(); it != orderedScanIDs.end(); it++)
+				pool.post(ProcessScanTask(*it));
+			pool.run();
+
+			ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+			for (size_t i = 0; i < pool.workers.size(); i++)
+			{
+				const DiscoveryWorkerStats& stats = pool.stats(i);
+				metrics.workers.push_back(stats);
+				ofs << "worker " << i << ": tasks: " << stats.tasks << ", steals: " << stats.steals
+					<< ", busy (ms): " << stats.busyNanoseconds / 1000000 << ", idle (ms): " << stats.idleNanoseconds / 1000000 << endl;
+			}
+			ofs.close();
+		}
+
+		mergeWorkerDiscoveryAggregateResults();
+		stitchWorkerResults();
+		if (isIncremental)
+		{
+			mergeIngestedScans();
+			saveDiscoveryAggregateStore();
+		}
+
+		saveMetricsReport(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - runStart).count(), DiscoveryRule::globEvaluations - globEvaluations);
 
 		// log execution time
-		ofstream ofs("s:\\logs\\execution_times.txt", fstream::app | fstream::out);
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
 		ofs << "processAllScans (C++): " << time(0) - start << endl;
 		ofs.close();
 	}
 
-	static void loadDiscoveryRules()
+	/**
+	* Runs until the process is stopped: watches the scans directory and processes the scans as they land, new or changed,
+	* with the library, the aggregates and the worker threads kept between them.
+	* A changed library is loaded and published while the workers go on, the scans queued before it are still matched with the previous one.
+	* A library which cannot be loaded completely, e.g. with a file missing while it is replaced, is not published, the previous one is kept.
+	* Every daemonCheckpointSeconds the workers are let run out of scans, so that the results files can be brought up to date
+	* and the aggregate files replaced with the aggregates so far.
+	* With isIncremental the aggregate store is loaded at start and brought up to date at each checkpoint, and a changed scan is processed again,
+	* with what it added before replaced. Otherwise a changed scan is skipped with a warning, since nothing could take back what it added before.
+	* Scans are registered as they land, so the scan ID order is the order in which they landed, not the path order of a batch run.
+	* The aggregate sources therefore keep the copy of each source from the first scan to land with it, and their file path and scan path columns
+	* may name a different scan than a batch run over the same scans would, while the aggregate results still keep the first scan path in order.
+	* The scan paths cannot be compared instead, since the workers would read them while this thread registers new ones.
+	*/
+	static void runDaemon()
+	{
+		if (isIncremental)
+		{
+			DiscoveryAggregateStore store;
+			vector<string> storedScanPaths;
+			if (!openDiscoveryAggregateStore(store, storedScanPaths))
+				return;
+			loadDiscoveryAggregateStore(store);
+		}
+
+		scanCache.open(rootPath + "cache\\");
+		if (isNormalizedOutput)
+			saveNormalizedSignatures();
+		else
+			saveResultsVerboseHeaders();
+		metrics.clear(0);
+
+		// unbounded, so that a burst of scans landing does not hold back reloads and checkpoints
+		DiscoveryBoundedQueue<shared_ptr<ProcessScanTask>> taskQueue(numeric_limits<size_t>::max());
+		mutex mutexPendingTasks;
+		boost::condition_variable noPendingTasks;
+		size_t pendingTaskCount = 0;
+
+		auto runWorker = [&]()
+		{
+			shared_ptr<ProcessScanTask> task;
+			while (taskQueue.pop(task))
+			{
+				(*task)();
+				task.reset();
+
+				mutex::scoped_lock lock(mutexPendingTasks);
+				if (--pendingTaskCount == 0)
+					noPendingTasks.notify_all();
+			}
+		};
+
+		int workerThreadCount = configuredWorkerThreadCount > 0 ? configuredWorkerThreadCount : max<int>(thread::hardware_concurrency() / 2, 1);
+		boost::thread_group threadGroup;
+		for (int i = 0; i < workerThreadCount; i++)
+			threadGroup.create_thread(runWorker);
+		cout << "Watching " << rootPath << "scans\\ with " << workerThreadCount << " worker threads!" << endl;
+
+		DiscoveryScanWatcher watcher(rootPath + "scans\\");
+		DiscoveryHash128 pendingLibraryVersion = currentDiscoveryLibrary()->version;
+		DiscoveryHash128 failedLibraryVersion = pendingLibraryVersion;
+		auto lastCheckpoint = chrono::steady_clock::now();
+		size_t scansSinceCheckpoint = 0;
+		for (;;)
+		{
+			// like the scans, the library files are only taken once they have not changed since the previous poll,
+			// and files which have failed to load are only tried again once they change
+			DiscoverySnapshotStamp stamps[DiscoveryLibrarySnapshot::stampCount];
+			DiscoveryHash128 libraryVersion = discoveryLibraryVersion(stamps);
+			if (libraryVersion != currentDiscoveryLibrary()->version && libraryVersion == pendingLibraryVersion && libraryVersion != failedLibraryVersion)
+			{
+				cout << "Reloading the library" << endl;
+				if (reloadDiscoveryLibrary())
+				{
+					if (isNormalizedOutput)
+						saveNormalizedSignatures();
+				}
+				else
+					failedLibraryVersion = libraryVersion;
+			}
+			pendingLibraryVersion = libraryVersion;
+
+			// the tasks are made here, since registering the scans may move the scan paths the task constructor reads
+			vector<string> landedScanPaths = watcher.poll();
+			for (auto it = landedScanPaths.begin(); it != landedScanPaths.end(); it++)
+				if (!isIncremental && scanIDs.find(*it) != scanIDs.end())
+					cout << "Warning: skipped " << *it << ", which has changed since it was processed, run with /incremental to process changed scans again" << endl;
+				else if (isScanInShard(*it))
+				{
+					{
+						mutex::scoped_lock lock(mutexPendingTasks);
+						pendingTaskCount++;
+					}
+					taskQueue.push(make_shared<ProcessScanTask>(registerScanPath(*it)));
+					scansSinceCheckpoint++;
+				}
+
+			if (scansSinceCheckpoint > 0 && chrono::steady_clock::now() - lastCheckpoint >= chrono::seconds(daemonCheckpointSeconds))
+			{
+				{
+					mutex::scoped_lock lock(mutexPendingTasks);
+					while (pendingTaskCount > 0)
+						noPendingTasks.wait(lock);
+				}
+				checkpointDiscoveryAggregates(scansSinceCheckpoint);
+				lastCheckpoint = chrono::steady_clock::now();
+				scansSinceCheckpoint = 0;
+			}
+
+			boost::this_thread::sleep_for(boost::chrono::seconds(daemonPollSeconds));
+		}
+	}
+
+	// brings the results files up to date and replaces the aggregate files, must not run concurrently with processing tasks
+	static void checkpointDiscoveryAggregates(size_t scanCount)
+	{
+		auto start = chrono::steady_clock::now();
+		mergeWorkerDiscoveryAggregateResults();
+		stitchWorkerResults();
+		if (isNormalizedOutput)
+			saveNormalizedScans();
+		if (isIncremental)
+		{
+			mergeIngestedScans();
+			saveDiscoveryAggregateStore();
+		}
+
+		// the aggregate files are written aside and renamed over the previous ones, so a stopped daemon leaves complete files behind
+		string checkpointPath = resultsPath + "checkpoint\\";
+		boost::system::error_code error;
+		filesystem::remove_all(checkpointPath, error);
+		filesystem::create_directories(checkpointPath, error);
+		saveDiscoveryAggregateResults(checkpointPath);
+		saveDiscoveryAggregateSources(checkpointPath);
+		const char* aggregateFiles[] = { "results_aggregate.txt", "aggregate_addremoves.txt", "aggregate_addremoves_unused.txt", "aggregate_files.txt", "aggregate_files_unused.txt" };
+		for (size_t i = 0; i < sizeof(aggregateFiles) / sizeof(aggregateFiles[0]); i++)
+		{
+			filesystem::rename(checkpointPath + aggregateFiles[i], resultsPath + aggregateFiles[i], error);
+			if (error)
+				cout << "Error replacing " << resultsPath << aggregateFiles[i] << " file: " << error.message() << endl;
+		}
+		filesystem::remove_all(checkpointPath, error);
+
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+		ofs << "daemonCheckpoint: scans: " << scanCount << ", scans in total: " << scanPaths.size()
+			<< ", checkpoint (ms): " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << endl;
+	}
+
+	/** Saves metrics and the lock statistics of the run as JSON to logs\metrics.json, replacing the report of the previous run.*/
+	static void saveMetricsReport(long long runNanoseconds, size_t globEvaluations)
+	{
+		ofstream ofs(rootPath + "logs\\metrics.json", fstream::out | fstream::trunc);
+		ofs << "{" << endl;
+		ofs << "\t\"runNanoseconds\": " << runNanoseconds << "," << endl;
+		ofs << "\t\"mode\": " << (isPipelined ? "\"pipelined\"" : "\"workStealing\"") << "," << endl;
+
+		ofs << "\t\"counters\": { \"scans\": " << metrics.scans.size() << ", \"candidateRules\": " << metrics.candidateRules
+			<< ", \"predicateEvaluations\": " << metrics.predicateEvaluations << ", \"globEvaluations\": " << globEvaluations
+			<< ", \"resultsPruned\": " << metrics.resultsPruned << ", \"versionExclusions\": " << metrics.versionExclusions << " }," << endl;
+
+		ofs << "\t\"stageNanoseconds\": {";
+		for (int i = 0; i < DiscoveryMetrics::stageCount; i++)
+			ofs << (i == 0 ? " " : ", ") << "\"" << DiscoveryMetrics::stageName(i) << "\": " << metrics.stageNanoseconds[i];
+		ofs << " }," << endl;
+
+		ofs << "\t\"scanLatency\": ";
+		metrics.scanLatency.writeJson(ofs);
+		ofs << "," << endl;
+
+		ofs << "\t\"locks\": {" << endl;
+		ofs << "\t\t\"discoveryAggregateSources\": ";
+		discoveryAggregateSources.lockStats.writeJson(ofs);
+		ofs << "," << endl << "\t\t\"discoveryAggregateResults\": ";
+		lockStatsDiscoveryAggregateResults.writeJson(ofs);
+		ofs << "," << endl << "\t\t\"discoveryResults\": ";
+		lockStatsDiscoveryResults.writeJson(ofs);
+		ofs << endl << "\t}," << endl;
+
+		ofs << "\t\"workers\": [";
+		for (size_t i = 0; i < metrics.workers.size(); i++)
+			ofs << (i == 0 ? "" : ",") << endl << "\t\t{ \"worker\": " << i << ", \"tasks\": " << metrics.workers[i].tasks << ", \"steals\": " << metrics.workers[i].steals
+				<< ", \"busyNanoseconds\": " << metrics.workers[i].busyNanoseconds << ", \"idleNanoseconds\": " << metrics.workers[i].idleNanoseconds << " }";
+		ofs << (metrics.workers.empty() ? "" : "\n\t") << "]," << endl;
+
+		ofs << "\t\"pipelineStages\": [";
+		for (size_t i = 0; i < metrics.pipelineStages.size(); i++)
+		{
+			const DiscoveryPipelineStageMetrics& stage = metrics.pipelineStages[i];
+			ofs << (i == 0 ? "" : ",") << endl << "\t\t{ \"stage\": " << toJsonString(stage.stage) << ", \"threads\": " << stage.threads << ", \"tasks\": " << stage.tasks
+				<< ", \"bytes\": " << stage.bytes << ", \"busyNanoseconds\": " << stage.busyNanoseconds << " }";
+		}
+		ofs << (metrics.pipelineStages.empty() ? "" : "\n\t") << "]," << endl;
+
+		// scans which could not be opened are left out
+		ofs << "\t\"scans\": [";
+		bool isFirst = true;
+		for (size_t i = 0; i < metrics.scans.size(); i++)
+		{
+			const DiscoveryScanMetrics& scan = metrics.scans[i];
+			if (scan.nanoseconds == 0)
+				continue;
+			ofs << (isFirst ? "" : ",") << endl << "\t\t{ \"path\": " << toJsonString(scanPaths[i]) << ", \"bytes\": " << scan.bytes << ", \"sources\": " << scan.sources
+				<< ", \"results\": " << scan.results << ", \"cacheHit\": " << (scan.isCacheHit ? "true" : "false") << ", \"nanoseconds\": " << scan.nanoseconds << " }";
+			isFirst = false;
+		}
+		ofs << (isFirst ? "" : "\n\t") << "]" << endl;
+		ofs << "}" << endl;
+		ofs.close();
+	}
+
+	/**
+	* Runs the scans through a pipeline of reader, matcher and writer threads, in the given order,
+	* so that reading the scans from disk, matching them and writing their results overlap.
+	* The stages are connected by bounded queues, so that a slow stage holds back the one before it
+	* and only a limited number of scans is in memory at any time.
+	*/
+	static void processAllScansPipelined(const vector<int>& orderedScanIDs, int matcherCount)
+	{
+		DiscoveryBoundedQueue<shared_ptr<ProcessScanTask>> readQueue(pipelineQueueDepth);
+		DiscoveryBoundedQueue<shared_ptr<ProcessScanTask>> matchQueue(pipelineQueueDepth);
+		DiscoveryStageStats readStats, matchStats, writeStats;
+		int readerCount = pipelineReaderCount > 0 ? pipelineReaderCount : 1;
+		int writerCount = pipelineWriterCount > 0 ? pipelineWriterCount : 1;
+		matcherCount = matcherCount > 0 ? matcherCount : 1;
+		atomic<size_t> nextScan(0);
+		atomic<int> activeReaders(readerCount);
+		atomic<int> activeMatchers(matcherCount);
+
+		auto runReader = [&]()
+		{
+			for (size_t i = nextScan++; i < orderedScanIDs.size(); i = nextScan++)
+			{
+				auto start = chrono::steady_clock::now();
+				shared_ptr<ProcessScanTask> task = make_shared<ProcessScanTask>(orderedScanIDs[i]);
+				bool isRead = task->read();
+				addStageTask(readStats, start, isRead ? task->scan.size() : 0);
+				if (isRead)
+					readQueue.push(task);
+			}
+			// the last reader to finish lets the matchers know there are no more scans
+			if (--activeReaders == 0)
+				readQueue.close();
+		};
+
+		auto runMatcher = [&]()
+		{
+			shared_ptr<ProcessScanTask> task;
+			while (readQueue.pop(task))
+			{
+				auto start = chrono::steady_clock::now();
+				size_t bytes = task->scan.size();
+				task->match();
+				addStageTask(matchStats, start, bytes);
+				matchQueue.push(task);
+				task.reset();
+			}
+			if (--activeMatchers == 0)
+				matchQueue.close();
+		};
+
+		auto runWriter = [&]()
+		{
+			shared_ptr<ProcessScanTask> task;
+			while (matchQueue.pop(task))
+			{
+				auto start = chrono::steady_clock::now();
+				task->write();
+				addStageTask(writeStats, start, 0);
+				task.reset();
+			}
+		};
+
+		auto start = chrono::steady_clock::now();
+		boost::thread_group threadGroup;
+		for (int i = 0; i < readerCount; i++)
+			threadGroup.create_thread(runReader);
+		for (int i = 0; i < matcherCount; i++)
+			threadGroup.create_thread(runMatcher);
+		for (int i = 0; i < writerCount; i++)
+			threadGroup.create_thread(runWriter);
+		threadGroup.join_all();
+		long long runNanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+		logStage(ofs, "read", readStats, runNanoseconds);
+		logStage(ofs, "match", matchStats, runNanoseconds);
+		logStage(ofs, "write", writeStats, runNanoseconds);
+		addPipelineStageMetrics("read", readerCount, readStats);
+		addPipelineStageMetrics("match", matcherCount, matchStats);
+		addPipelineStageMetrics("write", writerCount, writeStats);
+		logQueue(ofs, "readQueue", readQueue);
+		logQueue(ofs, "matchQueue", matchQueue);
+		ofs.close();
+	}
+
+	static void addStageTask(DiscoveryStageStats& stats, chrono::steady_clock::time_point start, size_t bytes)
+	{
+		stats.busyNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		stats.bytes += bytes;
+		stats.tasks++;
+	}
+
+	static void addPipelineStageMetrics(const char* stage, int threads, const DiscoveryStageStats& stats)
+	{
+		DiscoveryPipelineStageMetrics stageMetrics = { stage, static_cast<size_t>(threads), stats.tasks, stats.bytes, stats.busyNanoseconds };
+		metrics.pipelineStages.push_back(stageMetrics);
+	}
+
+	static void logStage(ofstream& ofs, const char* stage, const DiscoveryStageStats& stats, long long runNanoseconds)
+	{
+		ofs << "pipeline " << stage << ": scans: " << stats.tasks << ", busy (ms): " << stats.busyNanoseconds / 1000000
+			<< ", scans/s: " << (runNanoseconds > 0 ? stats.tasks * 1e9 / runNanoseconds : 0)
+			<< ", MB/s: " << (runNanoseconds > 0 ? stats.bytes * 1000.0 / runNanoseconds : 0) << endl;
+	}
+
+	template <typename T>
+	static void logQueue(ofstream& ofs, const char* queue, const DiscoveryBoundedQueue<T>& boundedQueue)
+	{
+		ofs << "pipeline " << queue << ": capacity: " << boundedQueue.capacity << ", max depth: " << boundedQueue.maxDepth
+			<< ", producer wait (ms): " << boundedQueue.pushWaitNanoseconds / 1000000 << ", consumer wait (ms): " << boundedQueue.popWaitNanoseconds / 1000000 << endl;
+	}
+
+	/**
+	* Generates a synthetic library and fleet under rootPath and measures the library load, each phase of processing a scan on a single thread,
+	* the aggregate output, and processAllScans end to end with a cold and a warm scan cache, reporting to the console and logs\benchmark.txt.
+	*/
+	static void runBenchmark(const DiscoveryBenchmarkParameters& parameters)
+	{
+		resultsPath = rootPath + "results\\";
+
+		cout << "Generating " << parameters.machineCount << " scans and " << parameters.productCount << " products under " << rootPath << endl;
+		DiscoveryBenchmarkGenerator::generate(rootPath, parameters);
+
+		ofstream ofs(rootPath + "logs\\benchmark.txt", fstream::app | fstream::out);
+		ostringstream report;
+		report << "machines: " << parameters.machineCount << ", products: " << parameters.productCount << ", versions: " << parameters.versionsPerProduct
+			<< ", addremoves: " << parameters.addremovesPerScan << ", files: " << parameters.filesPerScan << ", wildcards (%): " << parameters.wildcardPercentage
+			<< ", depth: " << parameters.pathDepth << ", iterations: " << parameters.iterations << ", seed: " << parameters.seed << endl;
+
+		// the library from the text files and then from the snapshot compiled by the first load
+		boost::system::error_code error;
+		filesystem::remove(rootPath + "library\\DiscoveryLibrary.snapshot", error);
+		for (int i = 0; i < 2; i++)
+		{
+			emptyDiscoveryEngineGlobalContainers();
+			loadDiscoveryLibrary();
+			report << "libraryLoad (" << (currentDiscoveryLibrary()->isLoadedFromSnapshot ? "snapshot" : "text") << "): " << currentDiscoveryLibrary()->loadNanoseconds / 1000000.0 << " ms" << endl;
+		}
+
+		// the case folding kernels on the rule strings the scans are matched against, along with a few which are not ASCII
+		vector<string> corpus;
+		const DiscoveryRules& discoveryRules = currentDiscoveryLibrary()->discoveryRules;
+		for (auto it = discoveryRules.begin(); it != discoveryRules.end(); it++)
+		{
+			corpus.push_back(it->ruleKeyOriginal.to_string());
+			corpus.push_back(it->ruleProductName.to_string());
+			corpus.push_back(it->ruleFilePath.to_string());
+		}
+		const char* nonAsciiStrings[] = { "Microsoft\xc2\xae Office Professionnel \xc3\x89" "dition", "\xe3\x83\x9e\xe3\x82\xa4\xe3\x82\xaf\xe3\x83\xad\xe3\x82\xbd\xe3\x83\x95\xe3\x83\x88 Word", "caf\xe9 latin-1 \xff\x80 bytes" };
+		corpus.insert(corpus.end(), nonAsciiStrings, nonAsciiStrings + sizeof(nonAsciiStrings) / sizeof(nonAsciiStrings[0]));
+		DiscoveryCaseFoldingBenchmark::run(report, corpus, parameters.iterations);
+
+		// the frozen rule index against the container index it replaced, with the keys of the rules and keys close to them
+		vector<pair<int, string>> ruleKeys;
+		auto& ruleKeyIndex = discoveryRules.get<BySourceTypeIDRuleKey>();
+		for (auto it = ruleKeyIndex.begin(); it != ruleKeyIndex.end(); it++)
+			if (ruleKeys.empty() || ruleKeys.back().first != it->sourceTypeID || ruleKeys.back().second != it->ruleKeyUpperCase)
+				ruleKeys.push_back(make_pair(it->sourceTypeID, it->ruleKeyUpperCase.to_string()));
+		DiscoveryRuleIndexBenchmark::run(report, ruleKeyIndex, currentDiscoveryLibrary()->ruleIndex, ruleKeys, parameters.iterations);
+
+		// each phase on its own, on this thread and without the scan cache, which emptyDiscoveryEngineGlobalContainers closed
+		vector<int> orderedScanIDs = findAllScans();
+		DiscoveryBenchmarkTimings timings;
+		size_t bytesParsed = ProcessScanTask::scanBytesParsed;
+		size_t sourcesParsed = ProcessScanTask::scanSourcesParsed;
+		for (size_t iteration = 0; iteration < parameters.iterations; iteration++)
+		{
+			emptyDiscoveryAggregates();
+			currentDiscoveryLibrary()->matchMemo.clear();
+			for (auto it = orderedScanIDs.begin(); it != orderedScanIDs.end(); it++)
+			{
+				ProcessScanTask task(*it);
+				auto start = chrono::steady_clock::now();
+				if (!task.read())
+					continue;
+				start = addBenchmarkPhase(timings, "read", start);
+				task.loadScan(task.scan, true);
+				start = addBenchmarkPhase(timings, "loadScan", start);
+				task.matchSources();
+				start = addBenchmarkPhase(timings, "matchSources", start);
+				task.multiplyMatches();
+				start = addBenchmarkPhase(timings, "multiplyMatches", start);
+				task.pruneResults();
+				start = addBenchmarkPhase(timings, "pruneResults", start);
+				task.excludeVersions();
+				start = addBenchmarkPhase(timings, "excludeVersions", start);
+				task.addAggregateResults();
+				start = addBenchmarkPhase(timings, "addAggregateResults", start);
+				task.saveDiscoveryMachineResults();
+				addBenchmarkPhase(timings, "saveDiscoveryMachineResults", start);
+				if (task.scan.is_open())
+					task.scan.close();
+			}
+
+			auto start = chrono::steady_clock::now();
+			mergeWorkerDiscoveryAggregateResults();
+			start = addBenchmarkPhase(timings, "mergeWorkerDiscoveryAggregateResults", start);
+			stitchWorkerResults();
+			start = addBenchmarkPhase(timings, "stitchWorkerResults", start);
+			saveDiscoveryAggregateResults(resultsPath);
+			start = addBenchmarkPhase(timings, "saveDiscoveryAggregateResults", start);
+			saveDiscoveryAggregateSources(resultsPath);
+			addBenchmarkPhase(timings, "saveDiscoveryAggregateSources", start);
+		}
+		report << "scans: " << orderedScanIDs.size() << ", sources per iteration: " << (ProcessScanTask::scanSourcesParsed - sourcesParsed) / max<size_t>(parameters.iterations, 1)
+			<< ", bytes per iteration: " << (ProcessScanTask::scanBytesParsed - bytesParsed) / max<size_t>(parameters.iterations, 1) << endl;
+		timings.report(report, parameters.iterations, orderedScanIDs.size());
+
+		// end to end as configured, first with an empty scan cache, which the second run then finds filled
+		filesystem::remove_all(rootPath + "cache\\", error);
+		for (int i = 0; i < 2; i++)
+		{
+			emptyDiscoveryAggregates();
+			currentDiscoveryLibrary()->matchMemo.clear();
+			filesystem::remove_all(resultsPath, error);
+			filesystem::create_directory(resultsPath, error);
+
+			sourcesParsed = ProcessScanTask::scanSourcesParsed;
+			size_t hits = scanCache.hits;
+			auto start = chrono::steady_clock::now();
+			processAllScans();
+			saveDiscoveryAggregateResults(resultsPath);
+			saveDiscoveryAggregateSources(resultsPath);
+			double seconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 1000000000.0;
+
+			report << "endToEnd (" << (i == 0 ? "cold" : "warm") << " cache): " << seconds * 1000 << " ms, "
+				<< (seconds > 0 ? orderedScanIDs.size() / seconds : 0) << " scans/s, "
+				<< (seconds > 0 ? (ProcessScanTask::scanSourcesParsed - sourcesParsed) / seconds : 0) << " sources/s, "
+				<< "cache hits: " << scanCache.hits - hits << endl;
+		}
+
+		cout << report.str();
+		ofs << report.str() << endl;
+		ofs.close();
+	}
+
+	static chrono::steady_clock::time_point addBenchmarkPhase(DiscoveryBenchmarkTimings& timings, const string& phase, chrono::steady_clock::time_point start)
+	{
+		auto end = chrono::steady_clock::now();
+		timings.add(phase, chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+		return end;
+	}
+
+	/**
+	* Loads the rules, the version exclusion rules and the signatures from the library snapshot, or from the text files
+	* whenever the snapshot is missing, damaged or stale, in which case the snapshot is compiled again for the next run.
+	*/
+	static void loadDiscoveryLibrary()
+	{
+		shared_ptr<DiscoveryLibrary> library = make_shared<DiscoveryLibrary>();
+		if (!loadDiscoveryLibrary(*library))
+			std::system("pause");
+		publishDiscoveryLibrary(library);
+	}
+
+	/**
+	* Loads the library again and publishes it, unless any of the text files cannot be read or has a line which cannot be parsed,
+	* in which case the current library is kept and false returned, e.g. when a file is being replaced.
+	* Neither pauses nor throws, so that a daemon keeps running.
+	*/
+	static bool reloadDiscoveryLibrary()
+	{
+		shared_ptr<DiscoveryLibrary> library = make_shared<DiscoveryLibrary>();
+		try {
+			if (!loadDiscoveryLibrary(*library))
+			{
+				cout << "Keeping the current library, the new one is incomplete" << endl;
+				return false;
+			}
+		}
+		catch (const std::exception& e) {
+			cout << "Keeping the current library, the new one cannot be parsed: " << e.what() << endl;
+			return false;
+		}
+		publishDiscoveryLibrary(library);
+		return true;
+	}
+
+	/** The library the processing tasks starting now are going to use.*/
+	static shared_ptr<DiscoveryLibrary> currentDiscoveryLibrary()
+	{
+		return atomic_load(&discoveryLibrary);
+	}
+
+	/** Makes the library the one new processing tasks use, the previous one is freed once the last task using it is done.*/
+	static void publishDiscoveryLibrary(const shared_ptr<DiscoveryLibrary>& library)
+	{
+		atomic_store(&discoveryLibrary, library);
+	}
+
+	/** Identifies the library text files by their size and modification time, see DiscoveryLibrary::version.*/
+	static DiscoveryHash128 discoveryLibraryVersion(DiscoverySnapshotStamp (&stamps)[DiscoveryLibrarySnapshot::stampCount])
+	{
+		stamps[0] = DiscoverySnapshotStamp::of(rootPath + "library\\DiscoveryRules.txt");
+		stamps[1] = DiscoverySnapshotStamp::of(rootPath + "library\\DiscoveryVERs.txt");
+		stamps[2] = DiscoverySnapshotStamp::of(rootPath + "library\\DiscoverySignatures.txt");
+		return DiscoveryHash128::of(stamps, sizeof(stamps));
+	}
+
+	/** Returns false when any of the text files the library is loaded from could not be opened, the library then lacks what they have.*/
+	static bool loadDiscoveryLibrary(DiscoveryLibrary& library)
+	{
+		auto start = chrono::steady_clock::now();
+
+		// the scan cache has to be rebuilt whenever any of the library text files changes
+		DiscoverySnapshotStamp stamps[DiscoveryLibrarySnapshot::stampCount];
+		library.version = discoveryLibraryVersion(stamps);
+
+		library.isLoadedFromSnapshot = library.snapshot.open(rootPath + "library\\DiscoveryLibrary.snapshot", stamps) && loadDiscoveryLibrarySnapshot(library);
+		bool isLibraryComplete = true;
+		if (!library.isLoadedFromSnapshot)
+		{
+			library.snapshot.close();
+			isLibraryComplete = loadDiscoveryRules(library);
+			isLibraryComplete = loadDiscoverySignatures(library) && isLibraryComplete;
+			buildDiscoveryRuleIndex(library);
+
+			// a snapshot is only compiled from a complete library, so that a missing text file keeps being reported
+			if (isLibraryComplete)
+				saveDiscoveryLibrarySnapshot(library, stamps);
+		}
+		buildDiscoveryVERClosure(library);
+
+		library.loadNanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		return isLibraryComplete;
+	}
+
+	/**
+	* Returns false when the snapshot is damaged, in which case nothing has been loaded.
+	* Anything which is used as an index, i.e. buildRuleIndex against buildRuleCount, sourceTypeID and the rule index, is checked,
+	* the rest can only make the rules wrong, not the engine run off its containers.
+	*/
+	static bool loadDiscoveryLibrarySnapshot(DiscoveryLibrary& library)
+	{
+		const DiscoveryLibrarySnapshot& snapshot = library.snapshot;
+		const DiscoverySnapshotHeader& header = *snapshot.header;
+		bool isValid = header.ruleIndexRuleCount == header.ruleCount;
+
+		vector<DiscoveryRule> rules(static_cast<size_t>(header.ruleCount));
+		unordered_map<int, int> buildRuleCounts;
+		const DiscoverySnapshotRule* ruleRecords = snapshot.rules();
+		for (size_t i = 0; i < rules.size() && isValid; i++)
+			buildRuleCounts[ruleRecords[i].buildID]++;
+		for (size_t i = 0; i < rules.size() && isValid; i++)
+		{
+			const DiscoverySnapshotRule& record = ruleRecords[i];
+			DiscoveryRule& rule = rules[i];
+			rule.versionID = record.versionID;
+			rule.buildID = record.buildID;
+			rule.ruleID = record.ruleID;
+			rule.buildRuleIndex = record.buildRuleIndex;
+			rule.buildRuleCount = record.buildRuleCount;
+			rule.sourceTypeID = record.sourceTypeID;
+			isValid = rule.sourceTypeID >= 0 && rule.sourceTypeID <= 2 && rule.buildRuleCount == buildRuleCounts[rule.buildID]
+				&& rule.buildRuleIndex >= 0 && rule.buildRuleIndex < rule.buildRuleCount
+				&& loadSnapshotString(snapshot, record.ruleKeyUpperCase, rule.ruleKeyUpperCase) && loadSnapshotString(snapshot, record.ruleKeyOriginal, rule.ruleKeyOriginal)
+				&& loadSnapshotString(snapshot, record.ruleProductVersion, rule.ruleProductVersion) && loadSnapshotString(snapshot, record.ruleProductName, rule.ruleProductName)
+				&& loadSnapshotString(snapshot, record.ruleFileVersion, rule.ruleFileVersion) && loadSnapshotString(snapshot, record.ruleFilePath, rule.ruleFilePath)
+				&& loadSnapshotString(snapshot, record.ruleFileSize, rule.ruleFileSizeText);
+			rule.ruleFileSize = DiscoverySource::parseFileSize(rule.ruleFileSizeText);
+		}
+
+		vector<DiscoverySignature> signatures(static_cast<size_t>(header.signatureCount));
+		const DiscoverySnapshotSignature* signatureRecords = snapshot.signatures();
+		for (size_t i = 0; i < signatures.size() && isValid; i++)
+		{
+			const DiscoverySnapshotSignature& record = signatureRecords[i];
+			DiscoverySignature& signature = signatures[i];
+			signature.publisherID = record.publisherID;
+			signature.productID = record.productID;
+			signature.versionID = record.versionID;
+			isValid = loadSnapshotString(snapshot, record.publisherName, signature.publisherName) && loadSnapshotString(snapshot, record.webPage, signature.webPage)
+				&& loadSnapshotString(snapshot, record.productName, signature.productName) && loadSnapshotString(snapshot, record.productLicensable, signature.productLicensable)
+				&& loadSnapshotString(snapshot, record.productCategory, signature.productCategory) && loadSnapshotString(snapshot, record.uniqueVersion, signature.uniqueVersion)
+				&& loadSnapshotString(snapshot, record.build, signature.build) && loadSnapshotString(snapshot, record.major, signature.major)
+				&& loadSnapshotString(snapshot, record.minor, signature.minor) && loadSnapshotString(snapshot, record.edition, signature.edition)
+				&& loadSnapshotString(snapshot, record.variation, signature.variation) && loadSnapshotString(snapshot, record.licenseVersion, signature.licenseVersion);
+		}
+
+		const uint32_t* ruleIndexRules = snapshot.ruleIndexRules();
+		for (size_t i = 0; i < header.ruleIndexRuleCount && isValid; i++)
+			isValid = ruleIndexRules[i] < rules.size();
+
+		if (!isValid)
+			return false;
+
+		vector<const DiscoveryRule*> insertedRules;
+		insertedRules.reserve(rules.size());
+		for (auto it = rules.begin(); it != rules.end(); it++)
+		{
+			it->compileGlobs();
+			insertedRules.push_back(&(*library.discoveryRules.insert(*it).first));
+		}
+
+		vector<DiscoveryRuleIndex::Entry> entries;
+		entries.reserve(rules.size());
+		for (size_t i = 0; i < header.ruleIndexRuleCount; i++)
+		{
+			const DiscoveryRule* rule = insertedRules[ruleIndexRules[i]];
+			DiscoveryRuleIndex::Entry entry = { rule->sourceTypeID, rule->ruleKeyUpperCase, rule };
+			entries.push_back(entry);
+		}
+		if (!library.ruleIndex.assign(snapshot.ruleIndexSlots(), static_cast<size_t>(header.ruleIndexSlotCount), entries))
+		{
+			library.discoveryRules.clear();
+			return false;
+		}
+
+		const DiscoverySnapshotVER* verRecords = snapshot.vers();
+		for (size_t i = 0; i < header.verCount; i++)
+			library.discoveryVERs.insert(make_pair(static_cast<int>(verRecords[i].excludedVersionID), static_cast<int>(verRecords[i].versionID)));
+
+		for (auto it = signatures.begin(); it != signatures.end(); it++)
+			library.discoverySignatures.insert(make_pair(it->versionID, *it));
+
+		return true;
+	}
+
+	static bool loadSnapshotString(const DiscoveryLibrarySnapshot& snapshot, const DiscoverySnapshotString& value, boost::string_ref& target)
+	{
+		if (!snapshot.isStringValid(value))
+			return false;
+		target = snapshot.stringAt(value);
+		return true;
+	}
+
+	static void saveDiscoveryLibrarySnapshot(const DiscoveryLibrary& library, const DiscoverySnapshotStamp (&stamps)[DiscoveryLibrarySnapshot::stampCount])
+	{
+		DiscoveryLibrarySnapshotWriter writer;
+
+		// in ruleID order, so that loading the snapshot inserts the rules in the same order as loading the text files does
+		vector<const DiscoveryRule*> rules;
+		for (auto it = library.discoveryRules.begin(); it != library.discoveryRules.end(); it++)
+			rules.push_back(&(*it));
+		sort(rules.begin(), rules.end(), [](const DiscoveryRule* a, const DiscoveryRule* b) { return a->ruleID < b->ruleID; });
+		unordered_map<const DiscoveryRule*, uint32_t> rulePositions;
+		for (auto it = rules.begin(); it != rules.end(); it++)
+		{
+			rulePositions.insert(make_pair(*it, static_cast<uint32_t>(writer.rules.size())));
+			DiscoverySnapshotRule record;
+			record.ruleFileSize = writer.addString((*it)->ruleFileSizeText);
+			record.versionID = (*it)->versionID;
+			record.buildID = (*it)->buildID;
+			record.ruleID = (*it)->ruleID;
+			record.buildRuleIndex = (*it)->buildRuleIndex;
+			record.buildRuleCount = (*it)->buildRuleCount;
+			record.sourceTypeID = (*it)->sourceTypeID;
+			record.ruleKeyUpperCase = writer.addString((*it)->ruleKeyUpperCase);
+			record.ruleKeyOriginal = writer.addString((*it)->ruleKeyOriginal);
+			record.ruleProductVersion = writer.addString((*it)->ruleProductVersion);
+			record.ruleProductName = writer.addString((*it)->ruleProductName);
+			record.ruleFileVersion = writer.addString((*it)->ruleFileVersion);
+			record.ruleFilePath = writer.addString((*it)->ruleFilePath);
+			writer.rules.push_back(record);
+		}
+
+		writer.ruleIndexSlots = library.ruleIndex.slotTable();
+		const vector<const DiscoveryRule*>& ruleTable = library.ruleIndex.ruleTable();
+		for (auto it = ruleTable.begin(); it != ruleTable.end(); it++)
+			writer.ruleIndexRules.push_back(rulePositions[*it]);
+
+		for (auto it = library.discoveryVERs.begin(); it != library.discoveryVERs.end(); it++)
+		{
+			DiscoverySnapshotVER record = { it->first, it->second };
+			writer.vers.push_back(record);
+		}
+
+		for (auto it = library.discoverySignatures.begin(); it != library.discoverySignatures.end(); it++)
+		{
+			const DiscoverySignature& signature = it->second;
+			DiscoverySnapshotSignature record;
+			record.publisherID = signature.publisherID;
+			record.productID = signature.productID;
+			record.versionID = signature.versionID;
+			record.reserved = 0;
+			record.publisherName = writer.addString(signature.publisherName);
+			record.webPage = writer.addString(signature.webPage);
+			record.productName = writer.addString(signature.productName);
+			record.productLicensable = writer.addString(signature.productLicensable);
+			record.productCategory = writer.addString(signature.productCategory);
+			record.uniqueVersion = writer.addString(signature.uniqueVersion);
+			record.build = writer.addString(signature.build);
+			record.major = writer.addString(signature.major);
+			record.minor = writer.addString(signature.minor);
+			record.edition = writer.addString(signature.edition);
+			record.variation = writer.addString(signature.variation);
+			record.licenseVersion = writer.addString(signature.licenseVersion);
+			writer.signatures.push_back(record);
+		}
+
+		if (!writer.write(rootPath + "library\\DiscoveryLibrary.snapshot", stamps))
+			cout << "Error writing " << rootPath << "library\\DiscoveryLibrary.snapshot file" << endl;
+	}
+
+	// returns false when either of the files cannot be opened
+	static bool loadDiscoveryRules(DiscoveryLibrary& library)
 	{
 		// getline only assigns strings so we need this tmp before we convert to int
 		string tmp;
 
 		// load discovery rules
-		ifstream ifs("s:\\library\\DiscoveryRules.txt");
+		ifstream ifs(rootPath + "library\\DiscoveryRules.txt");
 		if (!ifs)
 		{
 			cout << "Error opening DiscoveryRules.txt" << endl;
-			std::system("pause");
-			return;
+			return false;
 		}
+		// rules are collected first, since buildRuleCount is only known once all of them are loaded
+		vector<DiscoveryRule> rules;
+		unordered_map<int, int> buildRuleCounts;
 		int ruleID = 1;
 		while (getline(ifs, tmp, '\t'))
 		{
@@ -702,63 +2689,47 @@ struct DiscoveryEngine
 			rule.versionID = stol(tmp);
 			getline(ifs, tmp, '\t');
 			rule.buildID = stol(tmp);
+			rule.buildRuleIndex = buildRuleCounts[rule.buildID]++;
 			getline(ifs, tmp, '\t');
 			rule.sourceTypeID = stol(tmp);
 
 			// uppercased for key usage
-			getline(ifs, rule.ruleKeyUpperCase, '\t');
-			rule.ruleKeyOriginal = rule.ruleKeyUpperCase;
-			to_upper(rule.ruleKeyUpperCase);
-
-			// simple glob style wildcard allowed, replace with .* for regex matching
-			getline(ifs, rule.ruleProductVersion, '\t');
-			if (rule.ruleProductVersion.find("*") != string::npos) {
-				replaceStringInPlace(rule.ruleProductVersion, "*", ".*");
-				rule.isRuleProductVersionRegex = true;
-			}
-			else
-				rule.isRuleProductVersionRegex = false;
-
-			// simple glob style wildcard allowed, replace with .* for regex matching
-			// Case insensitivity is provided by ECMAScript | icase switch in regex constructor.
-			getline(ifs, rule.ruleProductName, '\t');
-			if (rule.ruleProductName.find("*") != string::npos) {
-				replaceStringInPlace(rule.ruleProductName, "*", ".*");
-				rule.isRuleProductNameRegex = true;
-			}
-			else
-				rule.isRuleProductNameRegex = false;
+			getline(ifs, tmp, '\t');
+			rule.ruleKeyOriginal = library.arena.store(tmp);
+			DiscoveryCaseFolding::toUpper(tmp);
+			rule.ruleKeyUpperCase = library.arena.store(tmp);
 
-			// simple glob style wildcard allowed, replace with .* for regex matching
-			getline(ifs, rule.ruleFileVersion, '\t');
-			if (rule.ruleFileVersion.find("*") != string::npos) {
-				replaceStringInPlace(rule.ruleFileVersion, "*", ".*");
-				rule.isRuleFileVersionRegex = true;
-			}
-			else
-				rule.isRuleFileVersionRegex = false;
+			getline(ifs, tmp, '\t');
+			rule.ruleProductVersion = library.arena.store(tmp);
+			getline(ifs, tmp, '\t');
+			rule.ruleProductName = library.arena.store(tmp);
+			getline(ifs, tmp, '\t');
+			rule.ruleFileVersion = library.arena.store(tmp);
 
-			getline(ifs, rule.ruleFileSize, '\t');
+			getline(ifs, tmp, '\t');
+			rule.ruleFileSizeText = library.arena.store(tmp);
+			rule.ruleFileSize = DiscoverySource::parseFileSize(tmp);
 
-			// simple glob style wildcard allowed, replace with .* for regex matching
-			// Case insensitivity is provided by ECMAScript | icase switch in regex constructor.
-			getline(ifs, rule.ruleFilePath);
-			if (rule.ruleFilePath.find("*") != string::npos) {
-				replaceStringInPlace(rule.ruleFilePath, "*", ".*");
-				// rule file path is always a regex whenever present so no need to set a separate boolean as in the previous ones
-			}
+			getline(ifs, tmp);
+			rule.ruleFilePath = library.arena.store(tmp);
 
-			discoveryRules.insert(rule);
+			rule.compileGlobs();
+			rules.push_back(rule);
 		}
 		ifs.close();
 
+		for (auto it = rules.begin(); it != rules.end(); it++)
+		{
+			it->buildRuleCount = buildRuleCounts[it->buildID];
+			library.discoveryRules.insert(*it);
+		}
+
 		// load discovery version exclusion rules
-		ifs.open("s:\\library\\DiscoveryVERs.txt");
+		ifs.open(rootPath + "library\\DiscoveryVERs.txt");
 		if (!ifs)
 		{
 			cout << "Error opening DiscoveryVERs.txt" << endl;
-			std::system("pause");
-			return;
+			return false;
 		}
 		while (getline(ifs, tmp, '\t'))
 		{
@@ -767,101 +2738,306 @@ struct DiscoveryEngine
 			int versionID = stol(tmp);
 			getline(ifs, tmp);
 
-			discoveryVERs.insert(make_pair(excludedVersionID, versionID));
+			library.discoveryVERs.insert(make_pair(excludedVersionID, versionID));
+		}
+		return true;
+	}
+
+	static void buildDiscoveryVERClosure(DiscoveryLibrary& library)
+	{
+		library.discoveryVERClosure.build(library.discoveryVERs);
+		for (auto it = library.discoveryVERClosure.cyclicVersionIDs.begin(); it != library.discoveryVERClosure.cyclicVersionIDs.end(); it++)
+			cout << "Warning: version exclusion rules form a cycle through versionID " << *it << endl;
+	}
+
+	// in the order of the BySourceTypeIDRuleKey index, so that the rules of a key are found in the same order as they were through the container
+	static void buildDiscoveryRuleIndex(DiscoveryLibrary& library)
+	{
+		vector<DiscoveryRuleIndex::Entry> entries;
+		entries.reserve(library.discoveryRules.size());
+		auto& index = library.discoveryRules.get<BySourceTypeIDRuleKey>();
+		for (auto it = index.begin(); it != index.end(); it++)
+		{
+			DiscoveryRuleIndex::Entry entry = { it->sourceTypeID, it->ruleKeyUpperCase, &(*it) };
+			entries.push_back(entry);
 		}
+		library.ruleIndex.build(entries);
 	}
 
-	static void loadDiscoverySignatures()
+	// returns false when the file cannot be opened
+	static bool loadDiscoverySignatures(DiscoveryLibrary& library)
 	{
-		ifstream ifs("s:\\library\\DiscoverySignatures.txt");
+		ifstream ifs(rootPath + "library\\DiscoverySignatures.txt");
 		if (!ifs)
 		{
-			cout << "Error opening s:\\library\\DiscoverySignatures.txt file" << endl;
-			std::system("pause");
-			return;
+			cout << "Error opening " << rootPath << "library\\DiscoverySignatures.txt file" << endl;
+			return false;
 		}
 
+		// a line cut short, e.g. of a file still being written, throws like a field which is not a number does
 		string line;
 		while (getline(ifs, line))
 		{
 			vector<string> fields;
 			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() < 15)
+				throw invalid_argument("DiscoverySignatures.txt has a line with " + to_string(fields.size()) + " fields instead of 15");
 
 			DiscoverySignature signature;
 			signature.publisherID = stol(fields[0]);
-			signature.publisherName = fields[1];
-			signature.webPage = fields[2];
+			signature.publisherName = library.arena.store(fields[1]);
+			signature.webPage = library.arena.store(fields[2]);
 			signature.productID = stol(fields[3]);
-			signature.productName = fields[4];
-			signature.productLicensable = fields[5];
-			signature.productCategory = fields[6];
+			signature.productName = library.arena.store(fields[4]);
+			signature.productLicensable = library.arena.store(fields[5]);
+			signature.productCategory = library.arena.store(fields[6]);
 			signature.versionID = stol(fields[7]);
-			signature.uniqueVersion = fields[8];
-			signature.build = fields[9];
-			signature.major = fields[10];
-			signature.minor = fields[11];
-			signature.edition = fields[12];
-			signature.variation = fields[13];
-			signature.licenseVersion = fields[14];
+			signature.uniqueVersion = library.arena.store(fields[8]);
+			signature.build = library.arena.store(fields[9]);
+			signature.major = library.arena.store(fields[10]);
+			signature.minor = library.arena.store(fields[11]);
+			signature.edition = library.arena.store(fields[12]);
+			signature.variation = library.arena.store(fields[13]);
+			signature.licenseVersion = library.arena.store(fields[14]);
+
+			library.discoverySignatures.insert(make_pair(signature.versionID, signature));
+		}
+		return true;
+	}
+
+	// returns the scan ID of the scan path, registering it when it is new, must not run concurrently with processing tasks
+	static int registerScanPath(const string& scanPath)
+	{
+		auto it = scanIDs.find(scanPath);
+		if (it != scanIDs.end())
+			return it->second;
+
+		scanPaths.push_back(scanPath);
+		scanIDs.insert(make_pair(scanPath, static_cast<int>(scanPaths.size() - 1)));
+		return static_cast<int>(scanPaths.size() - 1);
+	}
+
+	// returns the calling worker thread's writer of scan-specific results, registering a new one on first use
+	static DiscoveryResultWriter& getWorkerResultWriter()
+	{
+		static thread_local DiscoveryResultWriter* writer = nullptr;
+		if (writer == nullptr)
+		{
+			lockStatsDiscoveryResults.lock(mutexDiscoveryResults);
+			mutex::scoped_lock lock(mutexDiscoveryResults, boost::adopt_lock);
+			workerResultWriters.emplace_back(resultsPath, static_cast<int>(workerResultWriters.size()));
+			writer = &workerResultWriters.back();
+		}
+		return *writer;
+	}
+
+	// appends the worker threads' segments to the results files and logs output statistics, must not run concurrently with processing tasks
+	static void stitchWorkerResults()
+	{
+		size_t bytesResults = 0, bytesResultsVerboseAddremoves = 0, bytesResultsVerboseFiles = 0, bytesNormalizedMatches = 0, bytesNormalizedSources = 0;
+		long long writeNanoseconds = 0;
+		for (auto it = workerResultWriters.begin(); it != workerResultWriters.end(); it++)
+		{
+			bytesResults += it->results.stitch();
+			bytesResultsVerboseAddremoves += it->resultsVerboseAddremoves.stitch();
+			bytesResultsVerboseFiles += it->resultsVerboseFiles.stitch();
+			bytesNormalizedMatches += it->normalizedMatches.stitch();
+			bytesNormalizedSources += it->normalizedSources.stitch();
+			writeNanoseconds += it->results.writeNanoseconds + it->resultsVerboseAddremoves.writeNanoseconds + it->resultsVerboseFiles.writeNanoseconds
+				+ it->normalizedMatches.writeNanoseconds + it->normalizedSources.writeNanoseconds;
+			it->results.writeNanoseconds = it->resultsVerboseAddremoves.writeNanoseconds = it->resultsVerboseFiles.writeNanoseconds = 0;
+			it->normalizedMatches.writeNanoseconds = it->normalizedSources.writeNanoseconds = 0;
+		}
+
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+		ofs << "resultsBytesWritten: " << bytesResults << endl;
+		ofs << "resultsVerboseAddremovesBytesWritten: " << bytesResultsVerboseAddremoves << endl;
+		ofs << "resultsVerboseFilesBytesWritten: " << bytesResultsVerboseFiles << endl;
+		if (isNormalizedOutput)
+		{
+			ofs << "normalizedMatchesBytesWritten: " << bytesNormalizedMatches << endl;
+			ofs << "normalizedSourcesBytesWritten: " << bytesNormalizedSources << endl;
+		}
+		ofs << "outputThroughput (MB/s): " << (writeNanoseconds > 0 ? (bytesResults + bytesResultsVerboseAddremoves + bytesResultsVerboseFiles + bytesNormalizedMatches + bytesNormalizedSources) * 1000.0 / writeNanoseconds : 0) << endl;
+		ofs.close();
+	}
+
+	// returns the calling worker thread's partial aggregate of discovery results, registering a new one on first use
+	static DiscoveryWorkerAggregateResults& getWorkerDiscoveryAggregateResults()
+	{
+		static thread_local DiscoveryWorkerAggregateResults* aggregateResults = nullptr;
+		if (aggregateResults == nullptr)
+		{
+			lockStatsDiscoveryAggregateResults.lock(mutexDiscoveryAggregateResults);
+			mutex::scoped_lock lock(mutexDiscoveryAggregateResults, boost::adopt_lock);
+			workerDiscoveryAggregateResults.emplace_back();
+			aggregateResults = &workerDiscoveryAggregateResults.back();
+		}
+		return *aggregateResults;
+	}
 
-			discoverySignatures.insert(make_pair(signature.versionID, signature));
+	// merges and empties the worker threads' partial aggregates, must not run concurrently with processing tasks
+	static void mergeWorkerDiscoveryAggregateResults()
+	{
+		for (auto itWorker = workerDiscoveryAggregateResults.begin(); itWorker != workerDiscoveryAggregateResults.end(); itWorker++)
+		{
+			for (auto itResult = itWorker->begin(); itResult != itWorker->end(); itResult++)
+			{
+				auto it = discoveryAggregateResults.find(itResult->first);
+				if (it != discoveryAggregateResults.end())
+					it->second.merge(itResult->second);
+				else
+					discoveryAggregateResults.insert(*itResult);
+			}
+			itWorker->clear();
 		}
 	}
 
-	static void saveDiscoveryAggregateResults()
+	static void saveDiscoveryAggregateResults(const string& directory)
 	{
-		ofstream ofs("s:\\results\\results_aggregate.txt", fstream::app | fstream::out);
+		ofstream ofs(directory + "results_aggregate.txt", fstream::app | fstream::out);
 		for (auto it = discoveryAggregateResults.begin(); it != discoveryAggregateResults.end(); it++)
 			ofs << it->second.versionID << "\t" << it->second.buildID << "\t" << it->second.detectionPath << "\t" << it->second.count << "\t" << it->second.scanPath << endl;
 	}
 
-	static void saveDiscoveryAggregateSources()
+	/** Writes the signatures dimension of the normalized output: versionID and the signature the way the verbose results show it, in versionID order.*/
+	static void saveNormalizedSignatures()
+	{
+		const unordered_map<int, DiscoverySignature>& discoverySignatures = currentDiscoveryLibrary()->discoverySignatures;
+		vector<int> versionIDs;
+		for (auto it = discoverySignatures.begin(); it != discoverySignatures.end(); it++)
+			versionIDs.push_back(it->first);
+		sort(versionIDs.begin(), versionIDs.end());
+
+		// formatted by the same code as the verbose results, whose trailing tab becomes the line end
+		DiscoveryOutputSegment segment(resultsPath + "normalized_signatures.txt", 0);
+		for (auto it = versionIDs.begin(); it != versionIDs.end(); it++)
+			ProcessScanTask::appendSignature(segment.append(*it).append('\t'), discoverySignatures.at(*it)).buffer.back() = '\n';
+
+		ofstream ofs(segment.outputPath, fstream::out | fstream::trunc);
+		ofs.write(segment.buffer.data(), segment.buffer.size());
+	}
+
+	/** Writes the scans dimension of the normalized output: scan ID and scan path.*/
+	static void saveNormalizedScans()
+	{
+		ofstream ofs(resultsPath + "normalized_scans.txt", fstream::out | fstream::trunc);
+		for (size_t i = 0; i < scanPaths.size(); i++)
+			ofs << i << "\t" << scanPaths[i] << endl;
+	}
+
+	/**
+	* Rebuilds the verbose results from the normalized output in resultsPath,
+	* the same lines a run without normalized output would have written, in the order of the matches.
+	*/
+	static void expandNormalizedResults()
+	{
+		unordered_map<string, string> signatures;
+		unordered_map<string, string> sources;
+		unordered_map<string, string> scans;
+		if (!loadNormalizedDimension(resultsPath, "normalized_signatures.txt", signatures) || !loadNormalizedDimension(resultsPath, "normalized_sources.txt", sources)
+			|| !loadNormalizedDimension(resultsPath, "normalized_scans.txt", scans))
+			return;
+
+		saveResultsVerboseHeaders();
+		ofstream ofsResultsVerboseAddremoves(resultsPath + "results_verbose_addremoves.txt", fstream::app | fstream::out);
+		ofstream ofsResultsVerboseFiles(resultsPath + "results_verbose_files.txt", fstream::app | fstream::out);
+
+		// <Fields=ScanID	VersionID	BuildID	SourceID>
+		ifstream ifs(resultsPath + "normalized_matches.txt");
+		string line;
+		vector<string> fields;
+		while (getline(ifs, line))
+		{
+			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() != 4)
+				continue;
+
+			auto itScan = scans.find(fields[0]);
+			auto itSignature = signatures.find(fields[1]);
+			auto itSource = sources.find(fields[3]);
+			if (itScan == scans.end() || itSignature == signatures.end() || itSource == sources.end())
+			{
+				cout << "The scan, signature or source of the match " << line << " is missing." << endl;
+				continue;
+			}
+
+			ofstream& ofs = boost::starts_with(itSource->second, "file\t") ? ofsResultsVerboseFiles : ofsResultsVerboseAddremoves;
+			ofs << itScan->second << "\t" << itSignature->second << "\t" << itSource->second << "\n";
+		}
+	}
+
+	// loads a dimension of the normalized output, the first field of each line is the key, the rest of the line is the value
+	static bool loadNormalizedDimension(const string& directory, const string& fileName, unordered_map<string, string>& dimension)
 	{
-		ofstream ofsAggregateAddremoves("s:\\results\\aggregate_addremoves.txt", fstream::app | fstream::out);
-		ofstream ofsAggregateAddremovesUnused("s:\\results\\aggregate_addremoves_unused.txt", fstream::app | fstream::out);
-		ofstream ofsAggregateFiles("s:\\results\\aggregate_files.txt", fstream::app | fstream::out);
-		ofstream ofsAggregateFilesUnused("s:\\results\\aggregate_files_unused.txt", fstream::app | fstream::out);
+		ifstream ifs(directory + fileName);
+		if (!ifs)
+		{
+			cout << "Error opening " << directory << fileName << " file" << endl;
+			std::system("pause");
+			return false;
+		}
+
+		string line;
+		while (getline(ifs, line))
+		{
+			size_t tab = line.find('\t');
+			if (tab != string::npos)
+				dimension[line.substr(0, tab)] = line.substr(tab + 1);
+		}
+		return true;
+	}
 
-		for (auto it = discoveryAggregateSources.begin(); it != discoveryAggregateSources.end(); it++)
+	static void saveDiscoveryAggregateSources(const string& directory)
+	{
+		ofstream ofsAggregateAddremoves(directory + "aggregate_addremoves.txt", fstream::app | fstream::out);
+		ofstream ofsAggregateAddremovesUnused(directory + "aggregate_addremoves_unused.txt", fstream::app | fstream::out);
+		ofstream ofsAggregateFiles(directory + "aggregate_files.txt", fstream::app | fstream::out);
+		ofstream ofsAggregateFilesUnused(directory + "aggregate_files_unused.txt", fstream::app | fstream::out);
+		const DiscoveryRules& discoveryRules = currentDiscoveryLibrary()->discoveryRules;
+
+		for (size_t i = 0; i < DiscoveryAggregateSources::shardCount; i++)
+		for (auto it = discoveryAggregateSources.shards[i].sources.begin(); it != discoveryAggregateSources.shards[i].sources.end(); it++)
 		{
 			if (it->second.sourceTypeID == 0)
 			{
 				ofsAggregateFiles << it->second.sourceKeyOriginal << "\t" << it->second.sourceProductVersion << "\t" << it->second.sourceCompanyName << "\t"
-					<< it->second.sourceProductName << "\t" << it->second.sourceFileDescription << "\t" << it->second.sourceFileVersion << "\t" << it->second.sourceFileSize << "\t"
-					<< it->second.sourceFilePath << "\t" << it->second.sourceScanPath << endl;
+					<< it->second.sourceProductName << "\t" << it->second.sourceFileDescription << "\t" << it->second.sourceFileVersion << "\t" << it->second.sourceFileSizeText << "\t"
+					<< it->second.sourceFilePath << "\t" << scanPaths[it->second.sourceScanID] << endl;
 
 				auto match = discoveryRules.get<BySourceTypeIDRuleKeyRuleProductVersion>().find(boost::make_tuple(0, it->second.sourceKeyUpperCase, it->second.sourceProductVersion));
 				if (match == discoveryRules.get<BySourceTypeIDRuleKeyRuleProductVersion>().end())
 				{
 					ofsAggregateFilesUnused << it->second.sourceKeyOriginal << "\t" << it->second.sourceProductVersion << "\t" << it->second.sourceCompanyName << "\t"
-						<< it->second.sourceProductName << "\t" << it->second.sourceFileDescription << "\t" << it->second.sourceFileVersion << "\t" << it->second.sourceFileSize << "\t"
-						<< it->second.sourceFilePath << "\t" << it->second.sourceScanPath << endl;
+						<< it->second.sourceProductName << "\t" << it->second.sourceFileDescription << "\t" << it->second.sourceFileVersion << "\t" << it->second.sourceFileSizeText << "\t"
+						<< it->second.sourceFilePath << "\t" << scanPaths[it->second.sourceScanID] << endl;
 				}
 			}
 			else if (it->second.sourceTypeID == 1)
 			{
 				ofsAggregateAddremoves << it->second.sourceKeyOriginal << "\t" << it->second.sourceProductVersion << "\t" << it->second.sourceCompanyName << "\t"
 					//<< it->second.sourceInstalledLocation << "\t" << it->second.sourceUninstallString << "\t" << it->second.sourceOSComponent << "\t"
-					<< it->second.sourceScanPath << endl;
+					<< scanPaths[it->second.sourceScanID] << endl;
 
 				auto match = discoveryRules.get<BySourceTypeIDRuleKeyRuleProductVersion>().find(boost::make_tuple(1, it->second.sourceKeyUpperCase, it->second.sourceProductVersion));
 				if (match == discoveryRules.get<BySourceTypeIDRuleKeyRuleProductVersion>().end())
 				{
 					ofsAggregateAddremovesUnused << it->second.sourceKeyOriginal << "\t" << it->second.sourceProductVersion << "\t" << it->second.sourceCompanyName << "\t"
 						//<< it->second.sourceInstalledLocation << "\t" << it->second.sourceUninstallString << "\t" << it->second.sourceOSComponent << "\t" 
-						<< it->second.sourceScanPath << endl;
+						<< scanPaths[it->second.sourceScanID] << endl;
 				}
 			}
 		}
 	}
 
-	static void loadDiscoveryAggregateSources()
+	/** Loads aggregate sources saved by saveDiscoveryAggregateSources to the directory, the scans they refer to are registered if they are new.*/
+	static void loadDiscoveryAggregateSources(const string& directory)
 	{
 		// load aggregate addremoves
-		ifstream ifs_ma("s:\\results\\aggregate_addremoves.txt");
+		ifstream ifs_ma(directory + "aggregate_addremoves.txt");
 		if (!ifs_ma)
 		{
-			cout << "Error opening s:\\results\\aggregate_addremoves.txt file" << endl;
+			cout << "Error opening " << directory << "aggregate_addremoves.txt file" << endl;
 			std::system("pause");
 			return;
 		}
@@ -872,26 +3048,22 @@ struct DiscoveryEngine
 		{
 			vector<string> fields;
 			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() != 4)
+				continue;
 
-			DiscoverySource source;
-			source.sourceTypeID = 1;
-			source.sourceKeyUpperCase = fields[0];
-			to_upper(source.sourceKeyUpperCase);
-			source.sourceKeyOriginal = fields[0];
-			source.sourceProductVersion = fields[1];
-			source.sourceCompanyName = fields[2];
-			source.sourceScanPath = fields[3];
-
-			discoveryAggregateSources.insert(make_pair(to_upper_copy(source.sourceKeyUpperCase + source.sourceProductVersion + source.sourceCompanyName), source));
+			// the same key as for a scan line, see ProcessScanTask::loadScan
+			boost::string_ref scanFields[] = { fields[0], fields[1], fields[2] };
+			string keyUpperCase = DiscoveryCaseFolding::toUpperCopy(fields[0]);
+			discoveryAggregateSources.insert(ProcessScanTask::viewAddremoveSource(scanFields, keyUpperCase), registerScanPath(fields[3]));
 		}
 
 		ifs_ma.close();
 
 		// load aggregate files
-		ifstream ifs_mf("s:\\results\\aggregate_files.txt");
+		ifstream ifs_mf(directory + "aggregate_files.txt");
 		if (!ifs_mf)
 		{
-			cout << "Error opening s:\\results\\aggregate_files.txt file" << endl;
+			cout << "Error opening " << directory << "aggregate_files.txt file" << endl;
 			std::system("pause");
 			return;
 		}
@@ -901,43 +3073,511 @@ struct DiscoveryEngine
 		{
 			vector<string> fields;
 			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() != 9)
+				continue;
+
+			// the same key as for a scan line, see ProcessScanTask::loadScan, the fields are in the order of the scan
+			boost::string_ref scanFields[] = { fields[7], fields[0], fields[1], fields[2], fields[3], fields[4], fields[5], fields[6] };
+			string keyUpperCase = DiscoveryCaseFolding::toUpperCopy(fields[0]);
+			discoveryAggregateSources.insert(ProcessScanTask::viewFileSource(scanFields, keyUpperCase), registerScanPath(fields[8]));
+		}
+
+		ifs_mf.close();
+	}
+
+	/** Loads aggregate results saved by saveDiscoveryAggregateResults to the directory, adding them up with the ones already loaded.*/
+	static void loadDiscoveryAggregateResults(const string& directory)
+	{
+		ifstream ifs(directory + "results_aggregate.txt");
+		if (!ifs)
+		{
+			cout << "Error opening " << directory << "results_aggregate.txt file" << endl;
+			std::system("pause");
+			return;
+		}
+
+		// <Fields=VersionID	BuildID	DetectionPath	Count	ScanPath>
+		string line;
+		while (getline(ifs, line))
+		{
+			vector<string> fields;
+			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() != 5)
+				continue;
+
+			DiscoveryAggregateResult result(fields[2], stol(fields[0]), stol(fields[1]), stol(fields[3]), fields[4]);
+			DiscoveryAggregateResultKey key(result.buildID, result.detectionPath);
+			auto it = discoveryAggregateResults.find(key);
+			if (it != discoveryAggregateResults.end())
+				it->second.merge(result);
+			else
+				discoveryAggregateResults.insert(make_pair(key, result));
+		}
+	}
+
+	/** The aggregate store of incremental runs, outside of the results directory, which every run empties.*/
+	static string aggregateStorePath()
+	{
+		return rootPath + "store\\aggregates.store";
+	}
+
+	/**
+	* Maps the aggregate store and returns the paths of its scans, which are to be registered before it is loaded, and opens aggregateProvenance.
+	* A missing store is an empty one, while a store which cannot be used is an error rather than replaced with the scans of a single run.
+	* Does not pause on an error, the daemon runs this too, the batch run pauses itself.
+	*/
+	static bool openDiscoveryAggregateStore(DiscoveryAggregateStore& store, vector<string>& storedScanPaths)
+	{
+		boost::system::error_code error;
+		if (filesystem::exists(aggregateStorePath(), error) && !store.open(aggregateStorePath()))
+		{
+			cout << "Error opening " << aggregateStorePath() << " file, it is damaged or of another format version" << endl;
+			return false;
+		}
+
+		if (store.header != nullptr)
+		{
+			const DiscoveryStoreScan* scanRecords = store.scans();
+			for (uint64_t i = 0; i < store.header->scanCount; i++)
+			{
+				if (!store.isScanValid(scanRecords[i]))
+				{
+					cout << "Error opening " << aggregateStorePath() << " file, it is damaged" << endl;
+					store.close();
+					return false;
+				}
+				storedScanPaths.push_back(store.stringAt(scanRecords[i].scanPath).to_string());
+			}
+		}
+		aggregateProvenance.isOpen = true;
+		return true;
+	}
+
+	/** Loads the aggregates and what each scan contributed to them from the aggregate store opened by openDiscoveryAggregateStore, then closes it.*/
+	static void loadDiscoveryAggregateStore(DiscoveryAggregateStore& store)
+	{
+		if (store.header == nullptr)
+			return;
+		auto start = chrono::steady_clock::now();
+		// a copy, since the store is closed before the counts are logged
+		DiscoveryAggregateStoreHeader header = *store.header;
+		if (header.libraryVersion != currentDiscoveryLibrary()->version)
+			cout << "The aggregate store was built with another library, the scans which are not processed again keep the results they were matched with" << endl;
+
+		// the scans, with their paths and source fields, have been validated by openDiscoveryAggregateStore
+		vector<int> storedScanIDs;
+		const DiscoveryStoreScan* scanRecords = store.scans();
+		for (uint64_t i = 0; i < header.scanCount; i++)
+		{
+			const DiscoveryStoreScan& record = scanRecords[i];
+			storedScanIDs.push_back(registerScanPath(store.stringAt(record.scanPath).to_string()));
+			DiscoveryScanContribution& contribution = aggregateProvenance.scans[storedScanIDs.back()];
+			boost::string_ref results = store.stringAt(record.results);
+			contribution.results.assign(results.data(), results.size());
+			contribution.sourceKeys.assign(store.sourceKeys() + record.sourceKeyOffset, store.sourceKeys() + record.sourceKeyOffset + record.sourceKeyCount);
+			contribution.sourceFields.resize(contribution.sourceKeys.size());
+			for (uint64_t j = 0; j < record.sourceKeyCount; j++)
+			{
+				const DiscoveryStoreSourceFields& fieldsRecord = store.sourceFields()[record.sourceKeyOffset + j];
+				store.stringAt(fieldsRecord.sourceKeyOriginal).to_string().swap(contribution.sourceFields[j].sourceKeyOriginal);
+				store.stringAt(fieldsRecord.sourceFilePath).to_string().swap(contribution.sourceFields[j].sourceFilePath);
+			}
+		}
 
+		// the sources are views of the mapped file until insert copies them
+		bool isValid = true;
+		const DiscoveryStoreSource* sourceRecords = store.sources();
+		for (uint64_t i = 0; i < header.sourceCount && isValid; i++)
+		{
+			const DiscoveryStoreSource& record = sourceRecords[i];
 			DiscoverySource source;
-			source.sourceTypeID = 0;
-			source.sourceKeyUpperCase = fields[0];
-			to_upper(source.sourceKeyUpperCase);
-			source.sourceKeyOriginal = fields[0];
-			source.sourceProductVersion = fields[1];
-			source.sourceCompanyName = fields[2];
-			source.sourceProductName = fields[3];
-			source.sourceFileDescription = fields[4];
-			source.sourceFileVersion = fields[5];
-			source.sourceFileSize = fields[6];
-			source.sourceFilePath = fields[7];
-			source.sourceScanPath = fields[8];
+			source.sourceTypeID = record.sourceTypeID;
+			isValid = record.scanIndex < storedScanIDs.size()
+				&& loadStoreString(store, record.sourceKeyOriginal, source.sourceKeyOriginal) && loadStoreString(store, record.sourceKeyUpperCase, source.sourceKeyUpperCase)
+				&& loadStoreString(store, record.sourceProductVersion, source.sourceProductVersion) && loadStoreString(store, record.sourceCompanyName, source.sourceCompanyName)
+				&& loadStoreString(store, record.sourceProductName, source.sourceProductName) && loadStoreString(store, record.sourceFileDescription, source.sourceFileDescription)
+				&& loadStoreString(store, record.sourceFileVersion, source.sourceFileVersion) && loadStoreString(store, record.sourceFileSize, source.sourceFileSizeText)
+				&& loadStoreString(store, record.sourceFilePath, source.sourceFilePath);
+			source.sourceFileSize = DiscoverySource::parseFileSize(source.sourceFileSizeText);
+			if (isValid)
+				aggregateProvenance.sourceScanCounts[discoveryAggregateSources.insert(source, storedScanIDs[record.scanIndex])] = record.scanCount;
+		}
 
-			discoveryAggregateSources.insert(make_pair(to_upper_copy(source.sourceKeyUpperCase + source.sourceProductVersion + source.sourceCompanyName + source.sourceProductName + source.sourceFileDescription + source.sourceFileVersion + source.sourceFileSize), source));
+		// saved in key order, so each result goes at the end of the map
+		const DiscoveryStoreResult* resultRecords = store.results();
+		for (uint64_t i = 0; i < header.resultCount && isValid; i++)
+		{
+			const DiscoveryStoreResult& record = resultRecords[i];
+			boost::string_ref detectionPath;
+			isValid = record.scanIndex < storedScanIDs.size() && loadStoreString(store, record.detectionPath, detectionPath);
+			if (isValid)
+			{
+				DiscoveryAggregateResult result(detectionPath.to_string(), record.versionID, record.buildID, record.count, scanPaths[storedScanIDs[record.scanIndex]]);
+				discoveryAggregateResults.insert(discoveryAggregateResults.end(), make_pair(DiscoveryAggregateResultKey(result.buildID, detectionPath), result));
+			}
 		}
+		store.close();
+		if (!isValid)
+			cout << "The aggregate store " << aggregateStorePath() << " is damaged, its aggregates are incomplete" << endl;
 
-		ifs_mf.close();
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+		ofs << "aggregateStoreLoad: scans: " << header.scanCount << ", sources: " << header.sourceCount << ", results: " << header.resultCount
+			<< ", load (ms): " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << endl;
 	}
 
-	static void emptyDiscoveryEngineGlobalContainers()
+	// false when the string lies outside the store's string table
+	static bool loadStoreString(const DiscoveryAggregateStore& store, const DiscoveryStoreString& value, boost::string_ref& target)
 	{
-		discoveryRules.clear();
-		discoveryVERs.clear();
-		discoverySignatures.clear();
-		discoveryAggregateSources.clear();
-		discoveryAggregateResults.clear();
+		if (!store.isStringValid(value))
+			return false;
+		target = store.stringAt(value);
+		return true;
+	}
+
+	/**
+	* Applies the contributions handed in by the tasks since the last time to aggregateProvenance, after mergeWorkerDiscoveryAggregateResults,
+	* which has already added them to the aggregates. Whatever a scan processed again had contributed before is taken back:
+	* its results by count, its sources once no scan has them anymore. The results and sources which were kept from its previous version
+	* are then kept from the first scan which still has them, with the fields of that scan's copy which are not part of their key, e.g. the file path,
+	* the same as if all the scans had been processed in a single run.
+	* Must not run concurrently with processing tasks.
+	*/
+	static void mergeIngestedScans()
+	{
+		vector<pair<int, DiscoveryScanContribution>> ingested;
+		ingested.swap(aggregateProvenance.ingested);
+
+		unordered_set<int> replacedScanIDs;
+		vector<DiscoveryHash128> takenBackSourceKeys;
+		boost::string_ref fields[9];
+		DiscoveryAggregateResultKey key;
+		for (auto it = ingested.begin(); it != ingested.end(); it++)
+		{
+			auto itScan = aggregateProvenance.scans.find(it->first);
+			if (itScan != aggregateProvenance.scans.end())
+			{
+				replacedScanIDs.insert(it->first);
+				for (boost::string_ref lines(itScan->second.results); !lines.empty();)
+					// versionID, buildID and path
+					if (ProcessScanTask::splitFields(ProcessScanTask::nextLine(lines), fields) == 3)
+					{
+						key.assign(stol(fields[1].to_string()), fields[2]);
+						auto itResult = discoveryAggregateResults.find(key);
+						if (itResult != discoveryAggregateResults.end() && --itResult->second.count <= 0)
+							discoveryAggregateResults.erase(itResult);
+					}
+				for (auto itKey = itScan->second.sourceKeys.begin(); itKey != itScan->second.sourceKeys.end(); itKey++)
+					--aggregateProvenance.sourceScanCounts[*itKey];
+				takenBackSourceKeys.insert(takenBackSourceKeys.end(), itScan->second.sourceKeys.begin(), itScan->second.sourceKeys.end());
+			}
+
+			for (auto itKey = it->second.sourceKeys.begin(); itKey != it->second.sourceKeys.end(); itKey++)
+				++aggregateProvenance.sourceScanCounts[*itKey];
+			DiscoveryScanContribution& contribution = aggregateProvenance.scans[it->first];
+			contribution.results.swap(it->second.results);
+			contribution.sourceKeys.swap(it->second.sourceKeys);
+			contribution.sourceFields.swap(it->second.sourceFields);
+		}
+		if (replacedScanIDs.empty())
+			return;
+
+		unordered_set<DiscoveryHash128, DiscoveryHash128Hash> droppedSourceKeys;
+		for (auto it = takenBackSourceKeys.begin(); it != takenBackSourceKeys.end(); it++)
+		{
+			auto itCount = aggregateProvenance.sourceScanCounts.find(*it);
+			if (itCount != aggregateProvenance.sourceScanCounts.end() && itCount->second == 0)
+			{
+				droppedSourceKeys.insert(*it);
+				aggregateProvenance.sourceScanCounts.erase(itCount);
+			}
+		}
+
+		keepDiscoveryAggregateResultsFromFirstScan(replacedScanIDs);
+		keepDiscoveryAggregateSourcesFromFirstScan(replacedScanIDs, droppedSourceKeys);
+	}
+
+	// the results kept from one of the scans are kept again from the first scan in path order which has them, with its first line which has them
+	static void keepDiscoveryAggregateResultsFromFirstScan(const unordered_set<int>& scanIDs)
+	{
+		unordered_set<string> replacedScanPaths;
+		for (auto it = scanIDs.begin(); it != scanIDs.end(); it++)
+			replacedScanPaths.insert(scanPaths[*it]);
+
+		unordered_map<DiscoveryAggregateResultKey, DiscoveryAggregateResult*, DiscoveryAggregateResultKeyHash> pendingResults;
+		for (auto it = discoveryAggregateResults.begin(); it != discoveryAggregateResults.end(); it++)
+			if (replacedScanPaths.count(it->second.scanPath) > 0)
+				pendingResults.insert(make_pair(it->first, &it->second));
+
+		vector<pair<string, int>> storedScans;
+		for (auto it = aggregateProvenance.scans.begin(); it != aggregateProvenance.scans.end(); it++)
+			storedScans.push_back(make_pair(scanPaths[it->first], it->first));
+		sort(storedScans.begin(), storedScans.end());
+
+		boost::string_ref fields[9];
+		DiscoveryAggregateResultKey key;
+		for (auto itScan = storedScans.begin(); itScan != storedScans.end() && !pendingResults.empty(); itScan++)
+			for (boost::string_ref lines(aggregateProvenance.scans[itScan->second].results); !lines.empty();)
+				if (ProcessScanTask::splitFields(ProcessScanTask::nextLine(lines), fields) == 3)
+				{
+					key.assign(stol(fields[1].to_string()), fields[2]);
+					auto it = pendingResults.find(key);
+					if (it != pendingResults.end())
+					{
+						it->second->detectionPath.assign(fields[2].data(), fields[2].size());
+						it->second->scanPath = itScan->first;
+						pendingResults.erase(it);
+					}
+				}
+	}
+
+	// removes the dropped sources, the ones kept from one of the scans are kept again from the first scan by scan ID which has them,
+	// which may be the same scan, with the fields of its copy, as its copy may have changed as well
+	static void keepDiscoveryAggregateSourcesFromFirstScan(const unordered_set<int>& scanIDs, const unordered_set<DiscoveryHash128, DiscoveryHash128Hash>& droppedSourceKeys)
+	{
+		// with the arena of their shard, which the fields they take are stored in
+		unordered_map<DiscoveryHash128, pair<DiscoverySource*, DiscoveryArena*>, DiscoveryHash128Hash> pendingSources;
+		for (size_t i = 0; i < DiscoveryAggregateSources::shardCount; i++)
+		{
+			DiscoveryAggregateSources::Shard& shard = discoveryAggregateSources.shards[i];
+			for (auto it = shard.sources.begin(); it != shard.sources.end();)
+				if (droppedSourceKeys.count(it->first.hash) > 0)
+					it = shard.sources.erase(it);
+				else
+				{
+					if (scanIDs.count(it->second.sourceScanID) > 0)
+						pendingSources.insert(make_pair(it->first.hash, make_pair(&it->second, &shard.arena)));
+					it++;
+				}
+		}
+
+		vector<int> storedScanIDs;
+		for (auto it = aggregateProvenance.scans.begin(); it != aggregateProvenance.scans.end(); it++)
+			storedScanIDs.push_back(it->first);
+		sort(storedScanIDs.begin(), storedScanIDs.end());
+
+		for (auto itScan = storedScanIDs.begin(); itScan != storedScanIDs.end() && !pendingSources.empty(); itScan++)
+		{
+			const DiscoveryScanContribution& contribution = aggregateProvenance.scans[*itScan];
+			for (auto it = pendingSources.begin(); it != pendingSources.end();)
+			{
+				auto itKey = lower_bound(contribution.sourceKeys.begin(), contribution.sourceKeys.end(), it->first);
+				if (itKey != contribution.sourceKeys.end() && *itKey == it->first)
+				{
+					const DiscoveryScanSourceFields& fields = contribution.sourceFields[itKey - contribution.sourceKeys.begin()];
+					DiscoverySource& source = *it->second.first;
+					source.sourceScanID = *itScan;
+					if (source.sourceKeyOriginal != fields.sourceKeyOriginal)
+						source.sourceKeyOriginal = it->second.second->store(fields.sourceKeyOriginal);
+					if (source.sourceFilePath != fields.sourceFilePath)
+						source.sourceFilePath = it->second.second->store(fields.sourceFilePath);
+					it = pendingSources.erase(it);
+				}
+				else
+					it++;
+			}
+		}
+	}
+
+	/** Saves the aggregates and aggregateProvenance to the aggregate store, replacing the previous one.*/
+	static void saveDiscoveryAggregateStore()
+	{
+		auto start = chrono::steady_clock::now();
+		DiscoveryAggregateStoreWriter writer;
+
+		// in path order, the order the next run registers them in
+		vector<pair<string, int>> storedScans;
+		for (auto it = aggregateProvenance.scans.begin(); it != aggregateProvenance.scans.end(); it++)
+			storedScans.push_back(make_pair(scanPaths[it->first], it->first));
+		sort(storedScans.begin(), storedScans.end());
+
+		unordered_map<int, uint32_t> scanIndexes;
+		for (auto it = storedScans.begin(); it != storedScans.end(); it++)
+		{
+			const DiscoveryScanContribution& contribution = aggregateProvenance.scans[it->second];
+			scanIndexes[it->second] = static_cast<uint32_t>(writer.scans.size());
+			DiscoveryStoreScan record;
+			record.scanPath = writer.addUniqueString(it->first);
+			record.results = writer.addUniqueString(contribution.results);
+			record.sourceKeyOffset = writer.sourceKeys.size();
+			record.sourceKeyCount = contribution.sourceKeys.size();
+			writer.sourceKeys.insert(writer.sourceKeys.end(), contribution.sourceKeys.begin(), contribution.sourceKeys.end());
+			for (auto itFields = contribution.sourceFields.begin(); itFields != contribution.sourceFields.end(); itFields++)
+			{
+				DiscoveryStoreSourceFields fieldsRecord;
+				fieldsRecord.sourceKeyOriginal = writer.addString(itFields->sourceKeyOriginal);
+				fieldsRecord.sourceFilePath = writer.addString(itFields->sourceFilePath);
+				writer.sourceFields.push_back(fieldsRecord);
+			}
+			writer.scans.push_back(record);
+		}
+
+		// every source and result comes from a scan which has handed in its contribution
+		for (size_t i = 0; i < DiscoveryAggregateSources::shardCount; i++)
+		for (auto it = discoveryAggregateSources.shards[i].sources.begin(); it != discoveryAggregateSources.shards[i].sources.end(); it++)
+		{
+			auto itScanIndex = scanIndexes.find(it->second.sourceScanID);
+			auto itCount = aggregateProvenance.sourceScanCounts.find(it->first.hash);
+			if (itScanIndex == scanIndexes.end() || itCount == aggregateProvenance.sourceScanCounts.end())
+				continue;
+
+			DiscoveryStoreSource record;
+			record.sourceTypeID = it->second.sourceTypeID;
+			record.scanIndex = itScanIndex->second;
+			record.scanCount = itCount->second;
+			record.reserved = 0;
+			record.sourceKeyOriginal = writer.addString(it->second.sourceKeyOriginal);
+			record.sourceKeyUpperCase = writer.addString(it->second.sourceKeyUpperCase);
+			record.sourceProductVersion = writer.addString(it->second.sourceProductVersion);
+			record.sourceCompanyName = writer.addString(it->second.sourceCompanyName);
+			record.sourceProductName = writer.addString(it->second.sourceProductName);
+			record.sourceFileDescription = writer.addString(it->second.sourceFileDescription);
+			record.sourceFileVersion = writer.addString(it->second.sourceFileVersion);
+			record.sourceFileSize = writer.addString(it->second.sourceFileSizeText);
+			record.sourceFilePath = writer.addString(it->second.sourceFilePath);
+			writer.sources.push_back(record);
+		}
+
+		for (auto it = discoveryAggregateResults.begin(); it != discoveryAggregateResults.end(); it++)
+		{
+			auto itScanID = scanIDs.find(it->second.scanPath);
+			auto itScanIndex = itScanID != scanIDs.end() ? scanIndexes.find(itScanID->second) : scanIndexes.end();
+			if (itScanIndex == scanIndexes.end())
+				continue;
+
+			DiscoveryStoreResult record;
+			record.versionID = it->second.versionID;
+			record.buildID = it->second.buildID;
+			record.count = it->second.count;
+			record.scanIndex = itScanIndex->second;
+			record.detectionPath = writer.addString(it->second.detectionPath);
+			writer.results.push_back(record);
+		}
+
+		if (!writer.write(aggregateStorePath(), currentDiscoveryLibrary()->version))
+			cout << "Error saving " << aggregateStorePath() << " file" << endl;
+
+		ofstream ofs(rootPath + "logs\\execution_times.txt", fstream::app | fstream::out);
+		ofs << "aggregateStoreSave: scans: " << writer.scans.size() << ", sources: " << writer.sources.size() << ", results: " << writer.results.size()
+			<< ", save (ms): " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << endl;
+	}
+
+	/** Whether the scan belongs to the shard of this run, by the hash of its path within the scans directory, so that it does not depend on rootPath.*/
+	static bool isScanInShard(const string& scanPath)
+	{
+		if (shardCount <= 1)
+			return true;
+		string relativePath = scanPath.substr(min(scanPath.size(), (rootPath + "scans\\").size()));
+		return DiscoveryHash128::of(relativePath.data(), relativePath.size()).low % shardCount == static_cast<uint64_t>(shardIndex);
+	}
+
+	/** The directory with the partial results of the shard.*/
+	static string shardResultsPath(int shard)
+	{
+		return rootPath + "shards\\" + to_string(shard) + "\\";
+	}
+
+	/**
+	* Combines the partial results of the shardCount shards, each of them run with /shard:i/N, into the results a single run over all the scans saves:
+	* the scan-specific results are concatenated, the aggregates are added up keeping the first scan path, the unused sources follow from the rules.
+	* The rule library has to be loaded.
+	*/
+	static void mergeShards(int shardCount)
+	{
+		// scan IDs are given in path order over all the shards, as a single run would, which decides the scan an aggregate source comes from
+		vector<string> allScanPaths;
+		for (int shard = 0; shard < shardCount; shard++)
+		{
+			ifstream ifs(shardResultsPath(shard) + "scans.txt");
+			if (!ifs)
+			{
+				cout << "Error opening " << shardResultsPath(shard) << "scans.txt file, shard " << shard << " has not been run" << endl;
+				std::system("pause");
+				return;
+			}
+			string scanPath;
+			while (getline(ifs, scanPath))
+				allScanPaths.push_back(scanPath);
+		}
+		sort(allScanPaths.begin(), allScanPaths.end());
+		for (auto it = allScanPaths.begin(); it != allScanPaths.end(); it++)
+			registerScanPath(*it);
+
+		// with normalized output the shards have no verbose results
+		const char* resultsFiles[] = { "results.txt", "results_verbose_addremoves.txt", "results_verbose_files.txt" };
+		for (size_t i = 0; i < (isNormalizedOutput ? 1 : sizeof(resultsFiles) / sizeof(resultsFiles[0])); i++)
+		{
+			ofstream ofs(resultsPath + resultsFiles[i], fstream::out | fstream::binary);
+			for (int shard = 0; shard < shardCount; shard++)
+			{
+				ifstream ifs(shardResultsPath(shard) + resultsFiles[i], fstream::in | fstream::binary);
+				// the verbose results start with a header, which is only written once
+				string header;
+				if (shard > 0 && i > 0)
+					getline(ifs, header);
+				if (ifs.peek() != char_traits<char>::eof())
+					ofs << ifs.rdbuf();
+			}
+		}
 
+		if (isNormalizedOutput)
+			mergeNormalizedShards(shardCount);
+
+		for (int shard = 0; shard < shardCount; shard++)
+		{
+			loadDiscoveryAggregateSources(shardResultsPath(shard));
+			loadDiscoveryAggregateResults(shardResultsPath(shard));
+		}
+		saveDiscoveryAggregateResults(resultsPath);
+		saveDiscoveryAggregateSources(resultsPath);
 	}
 
-	static void replaceStringInPlace(string& subject, const string& search, const string& replace)
+	// merges the normalized output of the shards: sources are unique by source ID over all the shards, matches get the scan IDs of the merge
+	static void mergeNormalizedShards(int shardCount)
 	{
-		size_t pos = 0;
-		while ((pos = subject.find(search, pos)) != std::string::npos) {
-			subject.replace(pos, search.length(), replace);
-			pos += replace.length();
+		saveNormalizedSignatures();
+		saveNormalizedScans();
+
+		unordered_set<string> sourceIDs;
+		ofstream ofsSources(resultsPath + "normalized_sources.txt", fstream::out | fstream::trunc);
+		ofstream ofsMatches(resultsPath + "normalized_matches.txt", fstream::out | fstream::trunc);
+		string line;
+		for (int shard = 0; shard < shardCount; shard++)
+		{
+			ifstream ifsSources(shardResultsPath(shard) + "normalized_sources.txt");
+			while (getline(ifsSources, line))
+				if (sourceIDs.insert(line.substr(0, line.find('\t'))).second)
+					ofsSources << line << "\n";
+
+			unordered_map<string, string> shardScans;
+			if (!loadNormalizedDimension(shardResultsPath(shard), "normalized_scans.txt", shardScans))
+				return;
+			ifstream ifsMatches(shardResultsPath(shard) + "normalized_matches.txt");
+			while (getline(ifsMatches, line))
+			{
+				size_t tab = line.find('\t');
+				auto itScan = shardScans.find(line.substr(0, tab));
+				if (tab != string::npos && itScan != shardScans.end())
+					ofsMatches << scanIDs[itScan->second] << line.substr(tab) << "\n";
+			}
 		}
 	}
+
+	static void emptyDiscoveryEngineGlobalContainers()
+	{
+		publishDiscoveryLibrary(make_shared<DiscoveryLibrary>());
+		scanCache.close();
+		aggregateProvenance.clear();
+		emptyDiscoveryAggregates();
+		scanPaths.clear();
+		scanIDs.clear();
+	}
+	/** Empties what the scans added to the aggregates, so that the same scans can be processed again.*/
+	static void emptyDiscoveryAggregates()
+	{
+		discoveryAggregateSources.clear();
+		discoveryAggregateResults.clear();
+		normalizedSourceIDs.clear();
+		for (auto it = workerDiscoveryAggregateResults.begin(); it != workerDiscoveryAggregateResults.end(); it++)
+			it->clear();
+	}
 };
\ No newline at end of file
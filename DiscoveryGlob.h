@@ -0,0 +1,135 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryCaseFolding.h"
+
+/**
+* The <code>DiscoveryGlob</code> class is a compiled simple glob style wildcard pattern, where * matches any sequence of characters
+* and every other character, including regex metacharacters such as . + ( \, matches itself.
+* The pattern is compiled once into literal segments plus start/end anchors, so that matching does not backtrack and does not allocate.
+* Case folding, when requested, is ASCII only, any other bytes have to match exactly.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryGlob
+{
+	/** The pattern with the wildcards removed, uppercased when case insensitive. The segments point into it.*/
+	string literals;
+
+	/** Offset/length of each literal segment within literals, in pattern order, empty segments are skipped.*/
+	vector<pair<size_t, size_t>> segments;
+
+	/** True when the pattern contains at least one *, otherwise it is a plain comparison.*/
+	bool hasWildcard;
+
+	/** True when the pattern does not start with *, i.e. the first segment has to be a prefix.*/
+	bool anchoredStart;
+
+	/** True when the pattern does not end with *, i.e. the last segment has to be a suffix.*/
+	bool anchoredEnd;
+
+	bool caseInsensitive;
+
+	DiscoveryGlob() : hasWildcard(false), anchoredStart(true), anchoredEnd(true), caseInsensitive(false) {}
+
+	DiscoveryGlob(boost::string_ref pattern, bool caseInsensitive) : hasWildcard(false), anchoredStart(true), anchoredEnd(true), caseInsensitive(caseInsensitive)
+	{
+		literals.reserve(pattern.size());
+		size_t segmentStart = 0;
+		for (size_t i = 0; i < pattern.size(); i++)
+		{
+			if (pattern[i] == '*')
+			{
+				hasWildcard = true;
+				if (literals.size() > segmentStart)
+					segments.push_back(make_pair(segmentStart, literals.size() - segmentStart));
+				segmentStart = literals.size();
+			}
+			else
+				literals.push_back(caseInsensitive ? DiscoveryCaseFolding::toUpper(pattern[i]) : pattern[i]);
+		}
+		if (literals.size() > segmentStart || !hasWildcard)
+			segments.push_back(make_pair(segmentStart, literals.size() - segmentStart));
+
+		anchoredStart = pattern.empty() || pattern.front() != '*';
+		anchoredEnd = pattern.empty() || pattern.back() != '*';
+	}
+
+	bool matches(const string& value) const
+	{
+		return matches(value.data(), value.size());
+	}
+
+	bool matches(const char* value, size_t size) const
+	{
+		if (!hasWildcard)
+			return size == literals.size() && equalsAt(value, 0, segments.front());
+
+		size_t begin = 0;
+		size_t end = size;
+		size_t first = 0;
+		size_t last = segments.size();
+
+		// the first and the last segment are pinned to the start and the end of the value, unless there is a * in front of/after them
+		if (anchoredStart)
+		{
+			if (segments[first].second > end || !equalsAt(value, 0, segments[first]))
+				return false;
+			begin = segments[first].second;
+			first++;
+		}
+		if (anchoredEnd)
+		{
+			if (first == last || segments[last - 1].second > end - begin || !equalsAt(value, end - segments[last - 1].second, segments[last - 1]))
+				return false;
+			end -= segments[last - 1].second;
+			last--;
+		}
+
+		// the segments in between are matched leftmost, which is sufficient since * is the only wildcard
+		for (size_t i = first; i < last; i++)
+		{
+			size_t position = find(value, begin, end, segments[i]);
+			if (position == string::npos)
+				return false;
+			begin = position + segments[i].second;
+		}
+		return true;
+	}
+
+private:
+	bool equalsAt(const char* value, size_t position, const pair<size_t, size_t>& segment) const
+	{
+		const char* literal = literals.data() + segment.first;
+		if (caseInsensitive)
+			return DiscoveryCaseFolding::equalsUpperCase(value + position, literal, segment.second);
+		return memcmp(value + position, literal, segment.second) == 0;
+	}
+
+	size_t find(const char* value, size_t begin, size_t end, const pair<size_t, size_t>& segment) const
+	{
+		for (size_t position = begin; position + segment.second <= end; position++)
+			if (equalsAt(value, position, segment))
+				return position;
+		return string::npos;
+	}
+};
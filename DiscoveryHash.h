@@ -0,0 +1,150 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+/**
+* The <code>DiscoveryHash128</code> class is a 128 bit non-cryptographic hash, MurmurHash3 x64 128, of a byte range.
+* Good enough to address scan contents by their hash, not meant to resist deliberate collisions.
+* Hashes can be chained by passing the hash of the previous range as the seed of the next one.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryHash128
+{
+	uint64_t low;
+	uint64_t high;
+
+	DiscoveryHash128() : low(0), high(0) {}
+	DiscoveryHash128(uint64_t low, uint64_t high) : low(low), high(high) {}
+
+	bool operator==(const DiscoveryHash128& other) const
+	{
+		return low == other.low && high == other.high;
+	}
+
+	bool operator!=(const DiscoveryHash128& other) const
+	{
+		return !(*this == other);
+	}
+
+	bool operator<(const DiscoveryHash128& other) const
+	{
+		return high < other.high || (high == other.high && low < other.low);
+	}
+
+	/** 32 lowercase hex digits, high half first.*/
+	string toHex() const
+	{
+		static const char digits[] = "0123456789abcdef";
+		string hex(32, '0');
+		for (int i = 0; i < 16; i++)
+		{
+			hex[15 - i] = digits[(high >> (4 * i)) & 0xf];
+			hex[31 - i] = digits[(low >> (4 * i)) & 0xf];
+		}
+		return hex;
+	}
+
+	static DiscoveryHash128 of(const void* data, size_t size, const DiscoveryHash128& seed = DiscoveryHash128())
+	{
+		const uint64_t c1 = 0x87c37b91114253d5ULL;
+		const uint64_t c2 = 0x4cf5ad432745937fULL;
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		const size_t blockCount = size / 16;
+
+		uint64_t h1 = seed.low;
+		uint64_t h2 = seed.high;
+
+		for (size_t i = 0; i < blockCount; i++)
+		{
+			uint64_t k1;
+			uint64_t k2;
+			memcpy(&k1, bytes + i * 16, 8);
+			memcpy(&k2, bytes + i * 16 + 8, 8);
+
+			k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+			h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+			k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+			h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+		}
+
+		// the last 0-15 bytes
+		const unsigned char* tail = bytes + blockCount * 16;
+		uint64_t k1 = 0;
+		uint64_t k2 = 0;
+		switch (size & 15)
+		{
+		case 15: k2 ^= static_cast<uint64_t>(tail[14]) << 48; // fall through
+		case 14: k2 ^= static_cast<uint64_t>(tail[13]) << 40; // fall through
+		case 13: k2 ^= static_cast<uint64_t>(tail[12]) << 32; // fall through
+		case 12: k2 ^= static_cast<uint64_t>(tail[11]) << 24; // fall through
+		case 11: k2 ^= static_cast<uint64_t>(tail[10]) << 16; // fall through
+		case 10: k2 ^= static_cast<uint64_t>(tail[9]) << 8; // fall through
+		case 9: k2 ^= static_cast<uint64_t>(tail[8]);
+			k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2; // fall through
+		case 8: k1 ^= static_cast<uint64_t>(tail[7]) << 56; // fall through
+		case 7: k1 ^= static_cast<uint64_t>(tail[6]) << 48; // fall through
+		case 6: k1 ^= static_cast<uint64_t>(tail[5]) << 40; // fall through
+		case 5: k1 ^= static_cast<uint64_t>(tail[4]) << 32; // fall through
+		case 4: k1 ^= static_cast<uint64_t>(tail[3]) << 24; // fall through
+		case 3: k1 ^= static_cast<uint64_t>(tail[2]) << 16; // fall through
+		case 2: k1 ^= static_cast<uint64_t>(tail[1]) << 8; // fall through
+		case 1: k1 ^= static_cast<uint64_t>(tail[0]);
+			k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		}
+
+		h1 ^= size;
+		h2 ^= size;
+		h1 += h2;
+		h2 += h1;
+		h1 = finalMix(h1);
+		h2 = finalMix(h2);
+		h1 += h2;
+		h2 += h1;
+
+		return DiscoveryHash128(h1, h2);
+	}
+
+private:
+	static uint64_t rotl(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	static uint64_t finalMix(uint64_t k)
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+};
+
+/** For unordered containers keyed by DiscoveryHash128, whose bits are already well mixed.*/
+struct DiscoveryHash128Hash
+{
+	size_t operator()(const DiscoveryHash128& hash) const
+	{
+		return static_cast<size_t>(hash.low);
+	}
+};
@@ -0,0 +1,353 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryArena.h"
+#include "DiscoveryRuleIndex.h"
+
+/** A string stored in the snapshot's string table.*/
+struct DiscoverySnapshotString
+{
+	uint32_t offset;
+	uint32_t size;
+};
+
+/** Size and modification time of one of the library text files the snapshot was compiled from.*/
+struct DiscoverySnapshotStamp
+{
+	int64_t fileSize;
+	int64_t lastWriteTime;
+
+	bool operator==(const DiscoverySnapshotStamp& other) const
+	{
+		return fileSize == other.fileSize && lastWriteTime == other.lastWriteTime;
+	}
+
+	/** The stamp of a missing file never matches the stamp of an existing one.*/
+	static DiscoverySnapshotStamp of(const string& path)
+	{
+		DiscoverySnapshotStamp stamp = { -1, -1 };
+		boost::system::error_code error;
+		uintmax_t fileSize = filesystem::file_size(path, error);
+		if (error)
+			return stamp;
+		stamp.fileSize = static_cast<int64_t>(fileSize);
+		stamp.lastWriteTime = static_cast<int64_t>(filesystem::last_write_time(path, error));
+		return stamp;
+	}
+};
+
+/** See DiscoveryRule, the glob flags and the compiled globs are derived from the patterns when loading.*/
+struct DiscoverySnapshotRule
+{
+	/** The text, see DiscoveryRule::ruleFileSizeText.*/
+	DiscoverySnapshotString ruleFileSize;
+	int32_t versionID;
+	int32_t buildID;
+	int32_t ruleID;
+	int32_t buildRuleIndex;
+	int32_t buildRuleCount;
+	int32_t sourceTypeID;
+	DiscoverySnapshotString ruleKeyUpperCase;
+	DiscoverySnapshotString ruleKeyOriginal;
+	DiscoverySnapshotString ruleProductVersion;
+	DiscoverySnapshotString ruleProductName;
+	DiscoverySnapshotString ruleFileVersion;
+	DiscoverySnapshotString ruleFilePath;
+};
+
+/** See DiscoveryEngine::discoveryVERs.*/
+struct DiscoverySnapshotVER
+{
+	int32_t excludedVersionID;
+	int32_t versionID;
+};
+
+/** See DiscoverySignature.*/
+struct DiscoverySnapshotSignature
+{
+	int32_t publisherID;
+	int32_t productID;
+	int32_t versionID;
+	int32_t reserved;
+	DiscoverySnapshotString publisherName;
+	DiscoverySnapshotString webPage;
+	DiscoverySnapshotString productName;
+	DiscoverySnapshotString productLicensable;
+	DiscoverySnapshotString productCategory;
+	DiscoverySnapshotString uniqueVersion;
+	DiscoverySnapshotString build;
+	DiscoverySnapshotString major;
+	DiscoverySnapshotString minor;
+	DiscoverySnapshotString edition;
+	DiscoverySnapshotString variation;
+	DiscoverySnapshotString licenseVersion;
+};
+
+/**
+* The snapshot file starts with this header, followed by the rule records, the slots of the rule index and the rule record index of each of its rules,
+* the VER and signature records and then the string table, each section at the offset recorded here.
+* Records are fixed size and are used in place, straight from the mapped file.
+*/
+struct DiscoverySnapshotHeader
+{
+	char magic[8];
+	uint32_t formatVersion;
+	uint32_t stampCount;
+	DiscoverySnapshotStamp stamps[3];
+	uint64_t ruleOffset;
+	uint64_t ruleCount;
+	uint64_t ruleIndexSlotOffset;
+	uint64_t ruleIndexSlotCount;
+	uint64_t ruleIndexRuleOffset;
+	uint64_t ruleIndexRuleCount;
+	uint64_t verOffset;
+	uint64_t verCount;
+	uint64_t signatureOffset;
+	uint64_t signatureCount;
+	uint64_t stringOffset;
+	uint64_t stringSize;
+};
+
+/**
+* The <code>DiscoveryLibrarySnapshot</code> class is the rule library, i.e. the rules, the version exclusion rules and the signatures,
+* compiled into a single binary file which is memory mapped at startup instead of parsing the text files.
+* The rule index is saved as well, so it is assigned as it is rather than built again.
+* The snapshot records the size and modification time of the text files it was compiled from, as well as its format version,
+* so open refuses it as soon as either has changed and the library is then loaded from the text files again.
+* Strings handed out by stringAt point into the mapped file and stay valid until close.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryLibrarySnapshot
+{
+	/** To be incremented whenever any of the record layouts changes.*/
+	static const uint32_t formatVersion = 3;
+	static const size_t stampCount = 3;
+
+	boost::iostreams::mapped_file_source file;
+	const DiscoverySnapshotHeader* header;
+
+	DiscoveryLibrarySnapshot() : header(nullptr) {}
+
+	static const char* magic()
+	{
+		return "DESNAP\0\0";
+	}
+
+	/** Maps the snapshot, returns false when it is missing, damaged, of another format version or compiled from other text files.*/
+	bool open(const string& path, const DiscoverySnapshotStamp (&stamps)[stampCount])
+	{
+		close();
+
+		boost::system::error_code error;
+		if (!filesystem::exists(path, error) || filesystem::file_size(path, error) < sizeof(DiscoverySnapshotHeader) || error)
+			return false;
+		try
+		{
+			file.open(path);
+		}
+		catch (const ios_base::failure&)
+		{
+			return false;
+		}
+
+		header = reinterpret_cast<const DiscoverySnapshotHeader*>(file.data());
+		if (memcmp(header->magic, magic(), sizeof(header->magic)) != 0 || header->formatVersion != formatVersion || header->stampCount != stampCount
+			|| !isSectionValid(header->ruleOffset, header->ruleCount, sizeof(DiscoverySnapshotRule))
+			|| !isSectionValid(header->ruleIndexSlotOffset, header->ruleIndexSlotCount, sizeof(DiscoveryRuleIndex::Slot))
+			|| !isSectionValid(header->ruleIndexRuleOffset, header->ruleIndexRuleCount, sizeof(uint32_t))
+			|| !isSectionValid(header->verOffset, header->verCount, sizeof(DiscoverySnapshotVER))
+			|| !isSectionValid(header->signatureOffset, header->signatureCount, sizeof(DiscoverySnapshotSignature))
+			|| !isSectionValid(header->stringOffset, header->stringSize, 1))
+		{
+			close();
+			return false;
+		}
+		for (size_t i = 0; i < stampCount; i++)
+			if (!(header->stamps[i] == stamps[i]))
+			{
+				close();
+				return false;
+			}
+		return true;
+	}
+
+	void close()
+	{
+		if (file.is_open())
+			file.close();
+		header = nullptr;
+	}
+
+	const DiscoverySnapshotRule* rules() const
+	{
+		return reinterpret_cast<const DiscoverySnapshotRule*>(file.data() + header->ruleOffset);
+	}
+
+	const DiscoveryRuleIndex::Slot* ruleIndexSlots() const
+	{
+		return reinterpret_cast<const DiscoveryRuleIndex::Slot*>(file.data() + header->ruleIndexSlotOffset);
+	}
+
+	/** Positions within rules().*/
+	const uint32_t* ruleIndexRules() const
+	{
+		return reinterpret_cast<const uint32_t*>(file.data() + header->ruleIndexRuleOffset);
+	}
+
+	const DiscoverySnapshotVER* vers() const
+	{
+		return reinterpret_cast<const DiscoverySnapshotVER*>(file.data() + header->verOffset);
+	}
+
+	const DiscoverySnapshotSignature* signatures() const
+	{
+		return reinterpret_cast<const DiscoverySnapshotSignature*>(file.data() + header->signatureOffset);
+	}
+
+	/** False when the string lies outside the string table, i.e. the snapshot is damaged.*/
+	bool isStringValid(const DiscoverySnapshotString& value) const
+	{
+		return static_cast<uint64_t>(value.offset) + value.size <= header->stringSize;
+	}
+
+	boost::string_ref stringAt(const DiscoverySnapshotString& value) const
+	{
+		return boost::string_ref(file.data() + header->stringOffset + value.offset, value.size);
+	}
+
+private:
+	bool isSectionValid(uint64_t offset, uint64_t count, size_t recordSize) const
+	{
+		return offset % 8 == 0 && offset <= file.size() && count <= (file.size() - offset) / recordSize;
+	}
+};
+
+/**
+* The <code>DiscoveryLibrarySnapshotWriter</code> class collects the records of a snapshot and writes the snapshot file.
+* Each distinct string is stored once in the string table.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryLibrarySnapshotWriter
+{
+	vector<DiscoverySnapshotRule> rules;
+	vector<DiscoveryRuleIndex::Slot> ruleIndexSlots;
+	vector<uint32_t> ruleIndexRules;
+	vector<DiscoverySnapshotVER> vers;
+	vector<DiscoverySnapshotSignature> signatures;
+
+	string strings;
+	unordered_map<boost::string_ref, uint32_t, DiscoveryStringRefHash> stringOffsets;
+
+	/** The keys of stringOffsets, strings would invalidate them whenever it grows.*/
+	DiscoveryArena arena;
+
+	DiscoverySnapshotString addString(boost::string_ref value)
+	{
+		DiscoverySnapshotString stored = { 0, static_cast<uint32_t>(value.size()) };
+		if (value.empty())
+			return stored;
+
+		auto it = stringOffsets.find(value);
+		if (it != stringOffsets.end())
+		{
+			stored.offset = it->second;
+			return stored;
+		}
+		stored.offset = static_cast<uint32_t>(strings.size());
+		strings.append(value.data(), value.size());
+		stringOffsets.insert(make_pair(arena.store(value), stored.offset));
+		return stored;
+	}
+
+	/** Writes to a temporary file first and renames it, so a reader never maps a partially written snapshot.*/
+	bool write(const string& path, const DiscoverySnapshotStamp (&stamps)[DiscoveryLibrarySnapshot::stampCount])
+	{
+		DiscoverySnapshotHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, DiscoveryLibrarySnapshot::magic(), sizeof(header.magic));
+		header.formatVersion = DiscoveryLibrarySnapshot::formatVersion;
+		header.stampCount = DiscoveryLibrarySnapshot::stampCount;
+		for (size_t i = 0; i < DiscoveryLibrarySnapshot::stampCount; i++)
+			header.stamps[i] = stamps[i];
+
+		uint64_t offset = alignedOffset(sizeof(header));
+		header.ruleOffset = offset;
+		header.ruleCount = rules.size();
+		offset = alignedOffset(offset + rules.size() * sizeof(DiscoverySnapshotRule));
+		header.ruleIndexSlotOffset = offset;
+		header.ruleIndexSlotCount = ruleIndexSlots.size();
+		offset = alignedOffset(offset + ruleIndexSlots.size() * sizeof(DiscoveryRuleIndex::Slot));
+		header.ruleIndexRuleOffset = offset;
+		header.ruleIndexRuleCount = ruleIndexRules.size();
+		offset = alignedOffset(offset + ruleIndexRules.size() * sizeof(uint32_t));
+		header.verOffset = offset;
+		header.verCount = vers.size();
+		offset = alignedOffset(offset + vers.size() * sizeof(DiscoverySnapshotVER));
+		header.signatureOffset = offset;
+		header.signatureCount = signatures.size();
+		offset = alignedOffset(offset + signatures.size() * sizeof(DiscoverySnapshotSignature));
+		header.stringOffset = offset;
+		header.stringSize = strings.size();
+
+		// unique, since shard processes sharing the library may all compile the snapshot at once
+		string temporaryPath = filesystem::unique_path(path + ".%%%%-%%%%-%%%%.tmp").string();
+		ofstream ofs(temporaryPath, fstream::out | fstream::trunc | fstream::binary);
+		if (!ofs)
+			return false;
+		writeSection(ofs, &header, sizeof(header), header.ruleOffset);
+		writeSection(ofs, rules.data(), rules.size() * sizeof(DiscoverySnapshotRule), header.ruleIndexSlotOffset);
+		writeSection(ofs, ruleIndexSlots.data(), ruleIndexSlots.size() * sizeof(DiscoveryRuleIndex::Slot), header.ruleIndexRuleOffset);
+		writeSection(ofs, ruleIndexRules.data(), ruleIndexRules.size() * sizeof(uint32_t), header.verOffset);
+		writeSection(ofs, vers.data(), vers.size() * sizeof(DiscoverySnapshotVER), header.signatureOffset);
+		writeSection(ofs, signatures.data(), signatures.size() * sizeof(DiscoverySnapshotSignature), header.stringOffset);
+		ofs.write(strings.data(), strings.size());
+		ofs.close();
+		if (!ofs)
+		{
+			filesystem::remove(temporaryPath);
+			return false;
+		}
+
+		boost::system::error_code error;
+		filesystem::rename(temporaryPath, path, error);
+		return !error;
+	}
+
+private:
+	static uint64_t alignedOffset(uint64_t offset)
+	{
+		return (offset + 7) & ~static_cast<uint64_t>(7);
+	}
+
+	/** Writes the section and pads it up to the offset of the next one.*/
+	static void writeSection(ofstream& ofs, const void* data, size_t size, uint64_t nextOffset)
+	{
+		ofs.write(static_cast<const char*>(data), size);
+		while (static_cast<uint64_t>(ofs.tellp()) < nextOffset)
+			ofs.put('\0');
+	}
+};
@@ -0,0 +1,124 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryArena.h"
+
+struct DiscoveryRule;
+
+/**
+* The <code>DiscoveryMatchMemo</code> class remembers, for the source attributes the rules check other than the file path,
+* which rules match them, since the same file or addremove shows up on machine after machine across the fleet.
+* The key is built by the caller, see ProcessScanTask::buildMatchMemoKey, the rules are kept in the order they were found.
+* It is split into shards by hash, each with its own mutex, arena and share of the memory budget.
+* A shard which runs out of its share is emptied and starts over, which keeps the memory bounded without any bookkeeping per entry.
+* Shared by all the processing tasks.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryMatchMemo
+{
+	static const size_t shardCount = 64;
+
+	struct Entry
+	{
+		size_t firstRule;
+		size_t ruleCount;
+	};
+
+	struct Shard
+	{
+		mutex mutexShard;
+		unordered_map<boost::string_ref, Entry, DiscoveryStringRefHash> entries;
+		vector<const DiscoveryRule*> rules;
+		DiscoveryArena arena;
+		size_t bytesUsed;
+		Shard() : bytesUsed(0) {}
+	};
+
+	Shard shards[shardCount];
+
+	/** Estimated bytes the memo may use, split evenly among the shards.*/
+	size_t budgetBytes;
+
+	atomic<size_t> lookups;
+	atomic<size_t> hits;
+	/** Number of times a shard was emptied for running out of its share of the budget.*/
+	atomic<size_t> evictions;
+
+	DiscoveryMatchMemo() : budgetBytes(256 * 1024 * 1024), lookups(0), hits(0), evictions(0) {}
+
+	/** Appends the memoized rules for the key to rules, returns false when the key is not memoized.*/
+	bool find(boost::string_ref key, vector<const DiscoveryRule*>& rules)
+	{
+		++lookups;
+		Shard& shard = shards[DiscoveryStringRefHash()(key) % shardCount];
+		mutex::scoped_lock lock(shard.mutexShard);
+
+		auto it = shard.entries.find(key);
+		if (it == shard.entries.end())
+			return false;
+		++hits;
+		rules.insert(rules.end(), shard.rules.begin() + it->second.firstRule, shard.rules.begin() + it->second.firstRule + it->second.ruleCount);
+		return true;
+	}
+
+	void insert(boost::string_ref key, const vector<const DiscoveryRule*>& rules)
+	{
+		// a rough estimate of the key, the rules and a hash node
+		size_t entryBytes = key.size() + rules.size() * sizeof(const DiscoveryRule*) + sizeof(Entry) + 4 * sizeof(void*);
+		Shard& shard = shards[DiscoveryStringRefHash()(key) % shardCount];
+		mutex::scoped_lock lock(shard.mutexShard);
+
+		if (shard.entries.find(key) != shard.entries.end())
+			return;
+
+		if (shard.bytesUsed + entryBytes > budgetBytes / shardCount)
+		{
+			clear(shard);
+			++evictions;
+			if (entryBytes > budgetBytes / shardCount)
+				return;
+		}
+
+		Entry entry = { shard.rules.size(), rules.size() };
+		shard.rules.insert(shard.rules.end(), rules.begin(), rules.end());
+		shard.entries.insert(make_pair(shard.arena.store(key), entry));
+		shard.bytesUsed += entryBytes;
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < shardCount; i++)
+			clear(shards[i]);
+	}
+
+private:
+	static void clear(Shard& shard)
+	{
+		shard.entries.clear();
+		shard.rules.clear();
+		shard.arena = DiscoveryArena();
+		shard.bytesUsed = 0;
+	}
+};
@@ -0,0 +1,254 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "DiscoveryWorkStealingPool.h"
+
+/** Escapes a string for a JSON document and puts it in quotes.*/
+inline string toJsonString(const string& value)
+{
+	string json = "\"";
+	for (auto it = value.begin(); it != value.end(); it++)
+	{
+		unsigned char c = static_cast<unsigned char>(*it);
+		if (c == '"' || c == '\\')
+			json.append(1, '\\').append(1, c);
+		else if (c < 0x20)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			json.append(escaped);
+		}
+		else
+			json.append(1, c);
+	}
+	return json.append(1, '"');
+}
+
+/**
+* The <code>DiscoveryLockStats</code> class counts the acquisitions of a mutex, how many of them found it taken and how long they waited for it.
+* An uncontended acquisition costs a try_lock only, the clock is read just when the mutex is taken.
+* Thread safe.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryLockStats
+{
+	atomic<size_t> acquisitions;
+	atomic<size_t> contentions;
+	atomic<long long> waitNanoseconds;
+
+	DiscoveryLockStats() : acquisitions(0), contentions(0), waitNanoseconds(0) {}
+
+	/** Locks the mutex, to be adopted by a scoped_lock.*/
+	void lock(mutex& lockedMutex)
+	{
+		++acquisitions;
+		if (lockedMutex.try_lock())
+			return;
+		++contentions;
+		auto start = chrono::steady_clock::now();
+		lockedMutex.lock();
+		waitNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+
+	void clear()
+	{
+		acquisitions = 0;
+		contentions = 0;
+		waitNanoseconds = 0;
+	}
+
+	void writeJson(ostream& os) const
+	{
+		os << "{ \"acquisitions\": " << acquisitions << ", \"contentions\": " << contentions << ", \"waitNanoseconds\": " << waitNanoseconds << " }";
+	}
+};
+
+/**
+* The <code>DiscoveryLatencyHistogram</code> class counts durations in power of two buckets of nanoseconds,
+* bucket i has the durations of at least 2^i and less than 2^(i+1) nanoseconds, bucket 0 also has 0.
+* Percentiles are the upper bound of the bucket they fall in, so they are never understated by more than half.
+* Thread safe.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryLatencyHistogram
+{
+	static const int bucketCount = 64;
+
+	atomic<size_t> buckets[bucketCount];
+	atomic<size_t> count;
+	atomic<long long> totalNanoseconds;
+	atomic<long long> maxNanoseconds;
+
+	DiscoveryLatencyHistogram()
+	{
+		clear();
+	}
+
+	void record(long long nanoseconds)
+	{
+		uint64_t value = nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0;
+		int bucket = 0;
+		while (value >>= 1)
+			bucket++;
+		++buckets[bucket];
+		++count;
+		totalNanoseconds += nanoseconds;
+		long long observedMax = maxNanoseconds;
+		while (nanoseconds > observedMax && !maxNanoseconds.compare_exchange_weak(observedMax, nanoseconds));
+	}
+
+	/** percentile in (0, 100], 0 when nothing was recorded.*/
+	long long percentile(double percentile) const
+	{
+		size_t total = count;
+		size_t seen = 0;
+		for (int i = 0; i < bucketCount; i++)
+		{
+			seen += buckets[i];
+			if (total > 0 && seen >= total * percentile / 100)
+				return min<long long>(upperBound(i), maxNanoseconds);
+		}
+		return 0;
+	}
+
+	void clear()
+	{
+		for (int i = 0; i < bucketCount; i++)
+			buckets[i] = 0;
+		count = 0;
+		totalNanoseconds = 0;
+		maxNanoseconds = 0;
+	}
+
+	void writeJson(ostream& os) const
+	{
+		os << "{ \"count\": " << count << ", \"totalNanoseconds\": " << totalNanoseconds << ", \"maxNanoseconds\": " << maxNanoseconds
+			<< ", \"p50Nanoseconds\": " << percentile(50) << ", \"p90Nanoseconds\": " << percentile(90) << ", \"p99Nanoseconds\": " << percentile(99)
+			<< ", \"buckets\": [";
+		bool isFirst = true;
+		for (int i = 0; i < bucketCount; i++)
+			if (buckets[i] > 0)
+			{
+				os << (isFirst ? " " : ", ") << "{ \"upToNanoseconds\": " << upperBound(i) << ", \"count\": " << buckets[i] << " }";
+				isFirst = false;
+			}
+		os << " ] }";
+	}
+
+private:
+	static long long upperBound(int bucket)
+	{
+		return bucket >= 62 ? LLONG_MAX : (2LL << bucket) - 1;
+	}
+};
+
+/** What processing a single scan took, summed over its stages, so waiting between pipeline stages is not included.*/
+struct DiscoveryScanMetrics
+{
+	size_t bytes;
+	size_t sources;
+	size_t results;
+	long long nanoseconds;
+	bool isCacheHit;
+
+	DiscoveryScanMetrics() : bytes(0), sources(0), results(0), nanoseconds(0), isCacheHit(false) {}
+};
+
+/** What the threads of a single pipeline stage did, as reported once the pipeline is done.*/
+struct DiscoveryPipelineStageMetrics
+{
+	string stage;
+	size_t threads;
+	size_t tasks;
+	size_t bytes;
+	long long busyNanoseconds;
+};
+
+/**
+* The <code>DiscoveryMetrics</code> class collects the metrics of a single processAllScans run: time spent per stage of processing a scan,
+* per scan and per worker, a histogram of per-scan processing time, and counters of the matching work done.
+* The lock statistics are kept next to the mutexes they are about.
+* Stage times and counters are thread safe, each scan's metrics are only written by the task processing it.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryMetrics
+{
+	enum Stage { read, loadScan, matchSources, multiplyMatches, pruneResults, excludeVersions, addAggregateResults, write, stageCount };
+
+	static const char* stageName(int stage)
+	{
+		static const char* names[stageCount] = { "read", "loadScan", "matchSources", "multiplyMatches", "pruneResults", "excludeVersions", "addAggregateResults", "write" };
+		return names[stage];
+	}
+
+	atomic<long long> stageNanoseconds[stageCount];
+
+	/** Rules with the source's type and key whose other attributes were checked, i.e. not memoized.*/
+	atomic<size_t> candidateRules;
+	/** Comparisons of a rule attribute, exact or glob, against a source attribute.*/
+	atomic<size_t> predicateEvaluations;
+	/** Results dropped for not having all the rules of their build matched.*/
+	atomic<size_t> resultsPruned;
+	/** Results dropped by version exclusion rules.*/
+	atomic<size_t> versionExclusions;
+
+	DiscoveryLatencyHistogram scanLatency;
+
+	/** Indexed by scan ID.*/
+	vector<DiscoveryScanMetrics> scans;
+	vector<DiscoveryWorkerStats> workers;
+	vector<DiscoveryPipelineStageMetrics> pipelineStages;
+
+	DiscoveryMetrics()
+	{
+		clear(0);
+	}
+
+	/** Empties the metrics for a run over scanCount scans, must not run concurrently with processing tasks.*/
+	void clear(size_t scanCount)
+	{
+		for (int i = 0; i < stageCount; i++)
+			stageNanoseconds[i] = 0;
+		candidateRules = 0;
+		predicateEvaluations = 0;
+		resultsPruned = 0;
+		versionExclusions = 0;
+		scanLatency.clear();
+		scans.assign(scanCount, DiscoveryScanMetrics());
+		workers.clear();
+		pipelineStages.clear();
+	}
+
+	/** Records the scan, ignored for scans outside of the run, e.g. processed one phase at a time by the benchmark.*/
+	void addScan(int scanID, const DiscoveryScanMetrics& scan)
+	{
+		if (scanID < 0 || static_cast<size_t>(scanID) >= scans.size())
+			return;
+		scans[scanID] = scan;
+		scanLatency.record(scan.nanoseconds);
+	}
+};
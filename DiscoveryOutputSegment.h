@@ -0,0 +1,157 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <chrono>
+#include <cstdint>
+
+#include <boost/utility/string_ref.hpp>
+
+/**
+* The <code>DiscoveryOutputSegment</code> class is the part of an output file written by a single worker thread.
+* The worker formats into a large buffer, which is written to the worker's own segment file in big sequential chunks,
+* so there is neither locking nor a flush per line. Once all the workers are done, stitch appends the segment to the output file.
+* Not thread safe, each worker has its own segments.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryOutputSegment
+{
+	static const size_t bufferSize = 4 * 1024 * 1024;
+
+	/** The output file and the segment file, which is the output file path with the worker number appended.*/
+	string outputPath;
+	string segmentPath;
+
+	/** The worker formats directly into the buffer using the append functions below.*/
+	string buffer;
+
+	/** Opened on the first write, in text mode, so line ends are the same as when writing the output file directly.*/
+	ofstream ofsSegment;
+
+	size_t bytesWritten;
+	long long writeNanoseconds;
+
+	DiscoveryOutputSegment(const string& outputPath, int workerID) : outputPath(outputPath), segmentPath(outputPath + "." + to_string(workerID)),
+		bytesWritten(0), writeNanoseconds(0)
+	{
+		buffer.reserve(bufferSize);
+	}
+
+	/** To be called after each complete record, writes the buffer once it is full.*/
+	void commit()
+	{
+		if (buffer.size() >= bufferSize)
+			flush();
+	}
+
+	void flush()
+	{
+		if (buffer.empty())
+			return;
+
+		auto start = chrono::steady_clock::now();
+		if (!ofsSegment.is_open())
+			ofsSegment.open(segmentPath, fstream::out | fstream::trunc);
+		ofsSegment.write(buffer.data(), buffer.size());
+		writeNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+		bytesWritten += buffer.size();
+		buffer.clear();
+	}
+
+	/** Writes what is left, appends the segment file to the output file and deletes it, returns the number of bytes appended.*/
+	size_t stitch()
+	{
+		flush();
+		if (!ofsSegment.is_open())
+			return 0;
+		ofsSegment.close();
+
+		auto start = chrono::steady_clock::now();
+		ifstream ifsSegment(segmentPath, fstream::in | fstream::binary);
+		ofstream ofsOutput(outputPath, fstream::out | fstream::app | fstream::binary);
+		ofsOutput << ifsSegment.rdbuf();
+		size_t bytesStitched = static_cast<size_t>(ifsSegment.tellg());
+		ifsSegment.close();
+		ofsOutput.close();
+		filesystem::remove(segmentPath);
+		writeNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+		return bytesStitched;
+	}
+
+	DiscoveryOutputSegment& append(boost::string_ref value)
+	{
+		buffer.append(value.data(), value.size());
+		return *this;
+	}
+
+	DiscoveryOutputSegment& append(const string& value)
+	{
+		buffer.append(value);
+		return *this;
+	}
+
+	DiscoveryOutputSegment& append(const char* value)
+	{
+		buffer.append(value);
+		return *this;
+	}
+
+	DiscoveryOutputSegment& append(char value)
+	{
+		buffer.push_back(value);
+		return *this;
+	}
+
+	/** Formats the number without going through a stream or a temporary string.*/
+	DiscoveryOutputSegment& append(long long value)
+	{
+		char digits[24];
+		char* end = digits + sizeof(digits);
+		char* begin = end;
+		unsigned long long magnitude = value < 0 ? 0 - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+		do
+		{
+			*--begin = '0' + magnitude % 10;
+			magnitude /= 10;
+		} while (magnitude != 0);
+		if (value < 0)
+			*--begin = '-';
+		buffer.append(begin, end);
+		return *this;
+	}
+
+	DiscoveryOutputSegment& append(int value)
+	{
+		return append(static_cast<long long>(value));
+	}
+
+	/** Formats the number as 16 lowercase hex digits, zero padded.*/
+	DiscoveryOutputSegment& appendHex(uint64_t value)
+	{
+		static const char digits[] = "0123456789abcdef";
+		char hex[16];
+		for (int i = 15; i >= 0; i--, value >>= 4)
+			hex[i] = digits[value & 0xf];
+		buffer.append(hex, sizeof(hex));
+		return *this;
+	}
+};
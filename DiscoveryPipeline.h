@@ -0,0 +1,101 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+
+/** What the threads of a single pipeline stage did.*/
+struct DiscoveryStageStats
+{
+	atomic<size_t> tasks;
+	atomic<size_t> bytes;
+	atomic<long long> busyNanoseconds;
+
+	DiscoveryStageStats() : tasks(0), bytes(0), busyNanoseconds(0) {}
+};
+
+/**
+* The <code>DiscoveryBoundedQueue</code> class passes items from one pipeline stage to the next.
+* push blocks while the queue is full, which holds back the producing stage, so the items in flight and their memory stay bounded.
+* pop blocks while the queue is empty and returns false once the queue is closed and drained.
+* It records the deepest it got and how long its producers and consumers waited.
+* Thread safe.
+* @author Inferapp
+* @version 1.0
+*/
+template <typename T>
+struct DiscoveryBoundedQueue
+{
+	const size_t capacity;
+
+	mutex mutexItems;
+	boost::condition_variable notFull;
+	boost::condition_variable notEmpty;
+	deque<T> items;
+	bool isClosed;
+
+	size_t maxDepth;
+	long long pushWaitNanoseconds;
+	long long popWaitNanoseconds;
+
+	DiscoveryBoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), isClosed(false), maxDepth(0), pushWaitNanoseconds(0), popWaitNanoseconds(0) {}
+
+	void push(const T& item)
+	{
+		mutex::scoped_lock lock(mutexItems);
+		if (items.size() >= capacity)
+		{
+			auto start = chrono::steady_clock::now();
+			while (items.size() >= capacity)
+				notFull.wait(lock);
+			pushWaitNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		}
+		items.push_back(item);
+		maxDepth = max(maxDepth, items.size());
+		notEmpty.notify_one();
+	}
+
+	bool pop(T& item)
+	{
+		mutex::scoped_lock lock(mutexItems);
+		if (items.empty() && !isClosed)
+		{
+			auto start = chrono::steady_clock::now();
+			while (items.empty() && !isClosed)
+				notEmpty.wait(lock);
+			popWaitNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		}
+		if (items.empty())
+			return false;
+		item = items.front();
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/** No more items are going to be pushed, consumers finish once the queue is drained.*/
+	void close()
+	{
+		mutex::scoped_lock lock(mutexItems);
+		isClosed = true;
+		notEmpty.notify_all();
+	}
+};
@@ -0,0 +1,229 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstdint>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "DiscoveryHash.h"
+
+struct DiscoveryRule;
+
+/**
+* The <code>DiscoveryRuleIndex</code> class finds the rules with a given sourceTypeID and uppercased key,
+* the lookup every file and addremove of every scan goes through, most of them finding nothing.
+* It is an open addressing table with linear probing, at most half full, frozen once built from the loaded rules.
+* Each slot has the 64-bit hash of its key and the range of the key's rules within a single vector, 16 bytes in all,
+* so a lookup reads a cache line or two of slots and stops at the first empty one, and only compares keys whose hashes are equal.
+* Keys longer than the longest rule key are turned down without being hashed at all.
+* The table can be saved along with the rules and assigned back without being built again, see DiscoveryLibrarySnapshot.
+* Read only once built, so it can be shared by all the processing tasks.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryRuleIndex
+{
+	typedef const DiscoveryRule* const* iterator;
+
+	/** A slot is empty when it has no rules.*/
+	struct Slot
+	{
+		uint64_t hash;
+		uint32_t firstRule;
+		uint32_t ruleCount;
+	};
+
+	/** A rule under its sourceTypeID and uppercased key, as passed to build.*/
+	struct Entry
+	{
+		int sourceTypeID;
+		boost::string_ref key;
+		const DiscoveryRule* rule;
+	};
+
+	DiscoveryRuleIndex() : mask(0), maxKeySize(0) {}
+
+	/** Builds the index, the rules of each key are kept in the order they come in entries.*/
+	void build(const vector<Entry>& entries)
+	{
+		clear();
+
+		// sorted by hash and key, so that the rules of a key are next to each other, and by position, so that they stay in order
+		vector<pair<uint64_t, size_t>> order;
+		order.reserve(entries.size());
+		for (size_t i = 0; i < entries.size(); i++)
+			order.push_back(make_pair(hashOf(entries[i].sourceTypeID, entries[i].key), i));
+		sort(order.begin(), order.end(), [&entries](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b)
+		{
+			if (a.first != b.first)
+				return a.first < b.first;
+			const Entry& entryA = entries[a.second];
+			const Entry& entryB = entries[b.second];
+			if (entryA.sourceTypeID != entryB.sourceTypeID)
+				return entryA.sourceTypeID < entryB.sourceTypeID;
+			int compare = entryA.key.compare(entryB.key);
+			return compare != 0 ? compare < 0 : a.second < b.second;
+		});
+
+		size_t keyCount = 0;
+		for (size_t i = 0; i < order.size(); i++)
+			if (i == 0 || !isSameKey(entries[order[i - 1].second], entries[order[i].second]))
+				keyCount++;
+
+		size_t capacity = 2;
+		while (capacity < keyCount * 2)
+			capacity *= 2;
+		mask = capacity - 1;
+		slots.assign(capacity, Slot());
+		keys.assign(capacity, Key());
+		rules.reserve(entries.size());
+
+		for (size_t i = 0; i < order.size();)
+		{
+			const Entry& entry = entries[order[i].second];
+			Slot slot = { order[i].first, static_cast<uint32_t>(rules.size()), 0 };
+			for (; i < order.size() && isSameKey(entry, entries[order[i].second]); i++)
+				rules.push_back(entries[order[i].second].rule);
+			slot.ruleCount = static_cast<uint32_t>(rules.size() - slot.firstRule);
+
+			size_t position = slot.hash & mask;
+			while (slots[position].ruleCount > 0)
+				position = (position + 1) & mask;
+			slots[position] = slot;
+			Key key = { entry.sourceTypeID, entry.key };
+			keys[position] = key;
+			maxKeySize = max(maxKeySize, entry.key.size());
+		}
+	}
+
+	/**
+	* Takes over the slots and rules of an index built before, whose rules are now at the given entries, in the order of rules().
+	* Returns false, leaving the index empty, when they cannot be from an index, in which case lookups could run off the table.
+	*/
+	bool assign(const Slot* slotTable, size_t slotCount, const vector<Entry>& entries)
+	{
+		clear();
+
+		// a power of two with an empty slot at least, so that every probe ends
+		size_t usedSlotCount = 0;
+		for (size_t i = 0; i < slotCount; i++)
+			if (slotTable[i].ruleCount > 0)
+			{
+				if (slotTable[i].firstRule > entries.size() || slotTable[i].ruleCount > entries.size() - slotTable[i].firstRule)
+					return false;
+				usedSlotCount++;
+			}
+		if (slotCount < 2 || (slotCount & (slotCount - 1)) != 0 || usedSlotCount >= slotCount)
+			return false;
+
+		mask = slotCount - 1;
+		slots.assign(slotTable, slotTable + slotCount);
+		keys.assign(slotCount, Key());
+		rules.reserve(entries.size());
+		for (auto it = entries.begin(); it != entries.end(); it++)
+			rules.push_back(it->rule);
+		for (size_t i = 0; i < slotCount; i++)
+			if (slots[i].ruleCount > 0)
+			{
+				const Entry& entry = entries[slots[i].firstRule];
+				Key key = { entry.sourceTypeID, entry.key };
+				keys[i] = key;
+				maxKeySize = max(maxKeySize, entry.key.size());
+			}
+		return true;
+	}
+
+	/** The slots, to be saved and assigned back.*/
+	const vector<Slot>& slotTable() const
+	{
+		return slots;
+	}
+
+	/** The rules of all the keys, which the slots have ranges of.*/
+	const vector<const DiscoveryRule*>& ruleTable() const
+	{
+		return rules;
+	}
+
+	/** The rules with the sourceTypeID and key, an empty range when there are none.*/
+	pair<iterator, iterator> equal_range(int sourceTypeID, boost::string_ref keyUpperCase) const
+	{
+		if (keyUpperCase.size() <= maxKeySize && !slots.empty())
+		{
+			uint64_t hash = hashOf(sourceTypeID, keyUpperCase);
+			for (size_t position = hash & mask; slots[position].ruleCount > 0; position = (position + 1) & mask)
+				if (slots[position].hash == hash && keys[position].sourceTypeID == sourceTypeID && keys[position].key == keyUpperCase)
+				{
+					iterator first = rules.data() + slots[position].firstRule;
+					return make_pair(first, first + slots[position].ruleCount);
+				}
+		}
+		return pair<iterator, iterator>(nullptr, nullptr);
+	}
+
+	bool contains(int sourceTypeID, boost::string_ref keyUpperCase) const
+	{
+		pair<iterator, iterator> range = equal_range(sourceTypeID, keyUpperCase);
+		return range.first != range.second;
+	}
+
+	size_t keyCount() const
+	{
+		return count_if(slots.begin(), slots.end(), [](const Slot& slot) { return slot.ruleCount > 0; });
+	}
+
+	size_t capacity() const
+	{
+		return slots.size();
+	}
+
+	void clear()
+	{
+		slots.clear();
+		keys.clear();
+		rules.clear();
+		mask = 0;
+		maxKeySize = 0;
+	}
+
+private:
+	/** The key of the slot at the same position, kept apart from the slots as it is only read once the hashes are equal.*/
+	struct Key
+	{
+		int sourceTypeID;
+		boost::string_ref key;
+	};
+
+	vector<Slot> slots;
+	vector<Key> keys;
+	vector<const DiscoveryRule*> rules;
+	size_t mask;
+	size_t maxKeySize;
+
+	static uint64_t hashOf(int sourceTypeID, boost::string_ref key)
+	{
+		return DiscoveryHash128::of(key.data(), key.size(), DiscoveryHash128(static_cast<uint64_t>(sourceTypeID), 0)).low;
+	}
+
+	static bool isSameKey(const Entry& a, const Entry& b)
+	{
+		return a.sourceTypeID == b.sourceTypeID && a.key == b.key;
+	}
+};
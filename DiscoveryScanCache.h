@@ -0,0 +1,190 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <atomic>
+#include <cstdint>
+
+#include "DiscoveryHash.h"
+
+/**
+* The <code>DiscoveryScanCacheEntry</code> class has the output of processing a single scan, without the scan path,
+* which is the only thing in the output that does not follow from the scan contents and the rule library.
+* Each part is a sequence of lines: results are versionID, buildID and path, verbose results are what follows the scan path.
+* With normalized output the verbose results are empty, the normalized matches are what follows the scan ID instead,
+* and the normalized sources are the sources dimension lines of every source the matches refer to.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryScanCacheEntry
+{
+	string results;
+	string resultsVerboseAddremoves;
+	string resultsVerboseFiles;
+	string normalizedMatches;
+	string normalizedSources;
+
+	void clear()
+	{
+		results.clear();
+		resultsVerboseAddremoves.clear();
+		resultsVerboseFiles.clear();
+		normalizedMatches.clear();
+		normalizedSources.clear();
+	}
+};
+
+/**
+* The <code>DiscoveryScanCache</code> class keeps a DiscoveryScanCacheEntry per scan contents on disk, one file per entry,
+* named after the hash of the scan contents, so that unchanged scans do not have to be matched again on the next run.
+* Each entry also records the version it was built with, of the rule library and the output mode, an entry built with another version is a miss.
+* Entries are written to a temporary file and renamed, so concurrent tasks never see a partially written one.
+* Thread safe, shared by all the processing tasks.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryScanCache
+{
+	/** To be incremented whenever the entry layout or the meaning of processing results changes.*/
+	static const uint32_t formatVersion = 2;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t formatVersion;
+		uint32_t reserved;
+		DiscoveryHash128 libraryVersion;
+		DiscoveryHash128 contentHash;
+		uint64_t resultsSize;
+		uint64_t resultsVerboseAddremovesSize;
+		uint64_t resultsVerboseFilesSize;
+		uint64_t normalizedMatchesSize;
+		uint64_t normalizedSourcesSize;
+	};
+
+	/** Empty while the cache is closed.*/
+	string directory;
+
+	atomic<size_t> hits;
+	atomic<size_t> misses;
+	atomic<size_t> writeFailures;
+
+	DiscoveryScanCache() : hits(0), misses(0), writeFailures(0) {}
+
+	static const char* magic()
+	{
+		return "DECACHE\0";
+	}
+
+	void open(const string& directory)
+	{
+		boost::system::error_code error;
+		filesystem::create_directories(directory, error);
+		if (error)
+		{
+			cout << "Error creating the scan cache directory " << directory << ", scans will not be cached" << endl;
+			return;
+		}
+		this->directory = directory;
+	}
+
+	void close()
+	{
+		directory.clear();
+	}
+
+	bool isOpen() const
+	{
+		return !directory.empty();
+	}
+
+	/** Returns false and counts a miss when there is no entry for the contents built with the given version.*/
+	bool load(const DiscoveryHash128& libraryVersion, const DiscoveryHash128& contentHash, DiscoveryScanCacheEntry& entry)
+	{
+		entry.clear();
+
+		ifstream ifs(entryPath(contentHash), fstream::in | fstream::binary | fstream::ate);
+		uint64_t fileSize = ifs ? static_cast<uint64_t>(ifs.tellg()) : 0;
+		ifs.seekg(0);
+		Header header;
+		if (!ifs || fileSize < sizeof(header) || !ifs.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| memcmp(header.magic, magic(), sizeof(header.magic)) != 0 || header.formatVersion != formatVersion
+			|| header.libraryVersion != libraryVersion || header.contentHash != contentHash
+			|| header.resultsSize > fileSize || header.resultsVerboseAddremovesSize > fileSize || header.resultsVerboseFilesSize > fileSize
+			|| header.normalizedMatchesSize > fileSize || header.normalizedSourcesSize > fileSize
+			|| sizeof(header) + header.resultsSize + header.resultsVerboseAddremovesSize + header.resultsVerboseFilesSize
+				+ header.normalizedMatchesSize + header.normalizedSourcesSize != fileSize
+			|| !readPart(ifs, header.resultsSize, entry.results) || !readPart(ifs, header.resultsVerboseAddremovesSize, entry.resultsVerboseAddremoves)
+			|| !readPart(ifs, header.resultsVerboseFilesSize, entry.resultsVerboseFiles)
+			|| !readPart(ifs, header.normalizedMatchesSize, entry.normalizedMatches) || !readPart(ifs, header.normalizedSourcesSize, entry.normalizedSources))
+		{
+			entry.clear();
+			++misses;
+			return false;
+		}
+		++hits;
+		return true;
+	}
+
+	void save(const DiscoveryHash128& libraryVersion, const DiscoveryHash128& contentHash, const DiscoveryScanCacheEntry& entry)
+	{
+		Header header = Header();
+		memcpy(header.magic, magic(), sizeof(header.magic));
+		header.formatVersion = formatVersion;
+		header.libraryVersion = libraryVersion;
+		header.contentHash = contentHash;
+		header.resultsSize = entry.results.size();
+		header.resultsVerboseAddremovesSize = entry.resultsVerboseAddremoves.size();
+		header.resultsVerboseFilesSize = entry.resultsVerboseFiles.size();
+		header.normalizedMatchesSize = entry.normalizedMatches.size();
+		header.normalizedSourcesSize = entry.normalizedSources.size();
+
+		// identical scans of cloned machines may be saved by several tasks at once, hence a unique temporary file each
+		string temporaryPath = (filesystem::path(directory) / filesystem::unique_path("%%%%-%%%%-%%%%-%%%%.tmp")).string();
+		ofstream ofs(temporaryPath, fstream::out | fstream::trunc | fstream::binary);
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(entry.results.data(), entry.results.size());
+		ofs.write(entry.resultsVerboseAddremoves.data(), entry.resultsVerboseAddremoves.size());
+		ofs.write(entry.resultsVerboseFiles.data(), entry.resultsVerboseFiles.size());
+		ofs.write(entry.normalizedMatches.data(), entry.normalizedMatches.size());
+		ofs.write(entry.normalizedSources.data(), entry.normalizedSources.size());
+		ofs.close();
+
+		boost::system::error_code error;
+		if (ofs)
+			filesystem::rename(temporaryPath, entryPath(contentHash), error);
+		if (!ofs || error)
+		{
+			filesystem::remove(temporaryPath, error);
+			++writeFailures;
+		}
+	}
+
+private:
+	string entryPath(const DiscoveryHash128& contentHash) const
+	{
+		return (filesystem::path(directory) / (contentHash.toHex() + ".entry")).string();
+	}
+
+	static bool readPart(ifstream& ifs, uint64_t size, string& part)
+	{
+		part.resize(static_cast<size_t>(size));
+		return size == 0 || ifs.read(&part[0], part.size());
+	}
+};
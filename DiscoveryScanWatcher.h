@@ -0,0 +1,102 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <ctime>
+
+/**
+* The <code>DiscoveryScanWatcher</code> class finds the scans under a directory which are new or have changed since it last reported them,
+* by comparing the size and modification time of every scan at each poll.
+* A scan is only reported once two polls in a row have seen it unchanged, so that a scan still being copied in is not picked up half written.
+* Polling works the same on every platform and on network shares, where change notifications are not reliable.
+* Not thread safe.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryScanWatcher
+{
+	struct Stamp
+	{
+		time_t lastWriteTime;
+		uintmax_t fileSize;
+
+		bool operator==(const Stamp& other) const
+		{
+			return lastWriteTime == other.lastWriteTime && fileSize == other.fileSize;
+		}
+	};
+
+	string directory;
+
+	/** The stamp of each scan when it was last reported.*/
+	unordered_map<string, Stamp> reportedStamps;
+	/** The stamp of each new or changed scan at the previous poll.*/
+	unordered_map<string, Stamp> pendingStamps;
+
+	explicit DiscoveryScanWatcher(const string& directory) : directory(directory) {}
+
+	/** Returns the paths of the scans which have landed since the previous poll, in path order.*/
+	vector<string> poll()
+	{
+		unordered_map<string, Stamp> stamps;
+		bool isComplete = true;
+		try {
+			for (filesystem::recursive_directory_iterator it(directory); it != filesystem::recursive_directory_iterator(); it++)
+				if (is_regular_file(*it) && it->path().extension() == ".scan")
+				{
+					Stamp stamp = { filesystem::last_write_time(it->path()), filesystem::file_size(it->path()) };
+					stamps.insert(make_pair(it->path().string(), stamp));
+				}
+		}
+		// e.g. a scan deleted while the directory is walked, the scans not seen this time are seen by the next poll
+		catch (boost::filesystem::filesystem_error &ex){ std::cout << ex.what() << "\n"; isComplete = false; }
+
+		vector<string> landedScanPaths;
+		unordered_map<string, Stamp> stillPendingStamps;
+		for (auto it = stamps.begin(); it != stamps.end(); it++)
+		{
+			auto itReported = reportedStamps.find(it->first);
+			if (itReported != reportedStamps.end() && itReported->second == it->second)
+				continue;
+
+			auto itPending = pendingStamps.find(it->first);
+			if (itPending != pendingStamps.end() && itPending->second == it->second)
+			{
+				landedScanPaths.push_back(it->first);
+				reportedStamps[it->first] = it->second;
+			}
+			else
+				stillPendingStamps.insert(*it);
+		}
+		pendingStamps.swap(stillPendingStamps);
+
+		// a deleted scan is reported again when it comes back, but only when the walk was complete, or the scans missed would all be processed again
+		if (isComplete)
+			for (auto it = reportedStamps.begin(); it != reportedStamps.end();)
+			{
+				if (stamps.find(it->first) == stamps.end())
+					it = reportedStamps.erase(it);
+				else
+					it++;
+			}
+
+		sort(landedScanPaths.begin(), landedScanPaths.end());
+		return landedScanPaths;
+	}
+};
@@ -0,0 +1,150 @@
+/*
+Copyright 2015 Inferapp
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include "stdafx.h"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/** What a single worker of DiscoveryWorkStealingPool did during run.*/
+struct DiscoveryWorkerStats
+{
+	size_t tasks;
+	/** Tasks taken from other workers' queues.*/
+	size_t steals;
+	long long busyNanoseconds;
+	/** Time within run not spent on tasks, mostly waiting at the end for the other workers to finish.*/
+	long long idleNanoseconds;
+
+	DiscoveryWorkerStats() : tasks(0), steals(0), busyNanoseconds(0), idleNanoseconds(0) {}
+};
+
+/**
+* The <code>DiscoveryWorkStealingPool</code> class runs a known set of tasks on a fixed number of worker threads.
+* Tasks are dealt to the workers' queues round robin as they are posted, so when they are posted largest first
+* each queue is largest first too and the workers start out with about the same amount of work.
+* A worker takes the tasks of its own queue from the front and, once it is empty, steals from the front of the other queues,
+* so the largest task left anywhere is the next one started and no worker sits idle while there is work left.
+* run returns once every task has been run, tasks cannot be posted while it runs.
+* @author Inferapp
+* @version 1.0
+*/
+struct DiscoveryWorkStealingPool
+{
+	struct Worker
+	{
+		mutex mutexTasks;
+		deque<function<void()>> tasks;
+		DiscoveryWorkerStats stats;
+	};
+
+	vector<unique_ptr<Worker>> workers;
+
+	/** When set, worker i runs on logical processor i only, modulo the number of processors.*/
+	bool isPinningWorkers;
+
+	size_t nextWorker;
+
+	DiscoveryWorkStealingPool(size_t workerCount, bool isPinningWorkers) : isPinningWorkers(isPinningWorkers), nextWorker(0)
+	{
+		for (size_t i = 0; i < (workerCount > 0 ? workerCount : 1); i++)
+			workers.push_back(unique_ptr<Worker>(new Worker()));
+	}
+
+	void post(const function<void()>& task)
+	{
+		workers[nextWorker]->tasks.push_back(task);
+		nextWorker = (nextWorker + 1) % workers.size();
+	}
+
+	void run()
+	{
+		auto start = chrono::steady_clock::now();
+
+		boost::thread_group threadGroup;
+		for (size_t i = 0; i < workers.size(); i++)
+			threadGroup.create_thread(boost::bind(&DiscoveryWorkStealingPool::work, this, i));
+		threadGroup.join_all();
+
+		long long runNanoseconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		for (auto it = workers.begin(); it != workers.end(); it++)
+			(*it)->stats.idleNanoseconds = runNanoseconds - (*it)->stats.busyNanoseconds;
+	}
+
+	const DiscoveryWorkerStats& stats(size_t worker) const
+	{
+		return workers[worker]->stats;
+	}
+
+private:
+	void work(size_t worker)
+	{
+		if (isPinningWorkers)
+			pinCurrentThread(worker % max<unsigned>(thread::hardware_concurrency(), 1));
+
+		DiscoveryWorkerStats& stats = workers[worker]->stats;
+		function<void()> task;
+		for (;;)
+		{
+			if (!take(worker, task))
+			{
+				// no task is ever added while running, so once all the queues are empty the worker is done
+				bool isStolen = false;
+				for (size_t i = 1; i < workers.size() && !isStolen; i++)
+					isStolen = take((worker + i) % workers.size(), task);
+				if (!isStolen)
+					return;
+				stats.steals++;
+			}
+
+			auto start = chrono::steady_clock::now();
+			task();
+			stats.busyNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+			stats.tasks++;
+		}
+	}
+
+	bool take(size_t worker, function<void()>& task)
+	{
+		mutex::scoped_lock lock(workers[worker]->mutexTasks);
+		if (workers[worker]->tasks.empty())
+			return false;
+		task = move(workers[worker]->tasks.front());
+		workers[worker]->tasks.pop_front();
+		return true;
+	}
+
+	static void pinCurrentThread(unsigned processor)
+	{
+#ifdef _WIN32
+		SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << (processor % (sizeof(DWORD_PTR) * 8)));
+#else
+		cpu_set_t processors;
+		CPU_ZERO(&processors);
+		CPU_SET(processor, &processors);
+		pthread_setaffinity_np(pthread_self(), sizeof(processors), &processors);
+#endif
+	}
+};